@@ -26,6 +26,12 @@ typedef enum
     ERL_NIF_LATIN1 = 1
 } ErlNifCharEncoding;
 
+typedef enum
+{
+    ERL_NIF_INTERNAL_HASH = 1,
+    ERL_NIF_PHASH2 = 2
+} ErlNifHash;
+
 typedef struct
 {
     size_t size;
@@ -41,6 +47,9 @@ typedef struct /* All fields all internal and may change */
     ERL_NIF_TERM map;
     ERL_NIF_UINT size;
     ERL_NIF_UINT idx;
+    ERL_NIF_TERM* keys;
+    ERL_NIF_TERM* values;
+    void* buf;
 } ErlNifMapIterator;
 
 typedef enum {
@@ -48,10 +57,39 @@ typedef enum {
     ERL_NIF_MAP_ITERATOR_LAST = 2
 } ErlNifMapIteratorEntry;
 
+typedef struct /* heap position saved by cnif_heap_begin */
+{
+    void* frag;
+    ERL_NIF_TERM* top;
+} cnif_heap_mark_t;
+
+// memory owned outside the env heap, see cnif_make_external_binary
+typedef struct _cnif_external_t cnif_external_t;
+typedef void (*cnif_release_t)(void* data, size_t size, void* arg);
+
+typedef struct /* heap usage of an env, in words */
+{
+    size_t used;        // words holding terms
+    size_t size;        // words in fragments
+    size_t peak;        // largest size so far
+    size_t wasted;      // unused tail words of full fragments
+    size_t fragments;
+    size_t limit;       // 0 when unlimited
+    size_t failures;    // allocations refused
+} cnif_heap_stats_t;
+
 ERL_NIF_API_FUNC_DECL(ERL_NIF_TERM*,cnif_heap_alloc,(ErlNifEnv*,size_t size));
-ERL_NIF_API_FUNC_DECL(int,cnif_heap_begin,(ErlNifEnv*, void** mark));
-ERL_NIF_API_FUNC_DECL(int,cnif_heap_rewind,(ErlNifEnv*, void** mark));
-ERL_NIF_API_FUNC_DECL(int,cnif_heap_commit,(ErlNifEnv*, void** mark));
+ERL_NIF_API_FUNC_DECL(int,cnif_heap_begin,(ErlNifEnv*, cnif_heap_mark_t* mark));
+ERL_NIF_API_FUNC_DECL(int,cnif_heap_rewind,(ErlNifEnv*, const cnif_heap_mark_t* mark));
+ERL_NIF_API_FUNC_DECL(int,cnif_heap_commit,(ErlNifEnv*, cnif_heap_mark_t* mark));
+ERL_NIF_API_FUNC_DECL(size_t,cnif_heap_ranges,(ErlNifEnv*, ERL_NIF_TERM** ranges, size_t max));
+ERL_NIF_API_FUNC_DECL(int,cnif_heap_stats,(ErlNifEnv*, cnif_heap_stats_t* stats));
+ERL_NIF_API_FUNC_DECL(int,cnif_heap_set_limit,(ErlNifEnv*, size_t words));
+ERL_NIF_API_FUNC_DECL(void,cnif_heap_free,(ErlNifEnv*));
+ERL_NIF_API_FUNC_DECL(cnif_external_t*,cnif_external_new,(void* data, size_t size, cnif_release_t release, void* arg));
+ERL_NIF_API_FUNC_DECL(void,cnif_external_release,(cnif_external_t* ext));
+ERL_NIF_API_FUNC_DECL(ERL_NIF_TERM,cnif_make_external_binary,(ErlNifEnv*, cnif_external_t* ext, size_t offs, size_t size));
+ERL_NIF_API_FUNC_DECL(ERL_NIF_TERM,cnif_intern_keys,(ErlNifEnv*, const ERL_NIF_TERM keys[], unsigned cnt));
 
 ERL_NIF_API_FUNC_DECL(ErlNifEnv*,enif_alloc_env,(void));
 ERL_NIF_API_FUNC_DECL(void,enif_free_env,(ErlNifEnv* env));
@@ -73,6 +111,7 @@ ERL_NIF_API_FUNC_DECL(int,enif_get_list_cell,(ErlNifEnv* env, ERL_NIF_TERM term,
 ERL_NIF_API_FUNC_DECL(int,enif_get_tuple,(ErlNifEnv* env, ERL_NIF_TERM tpl, int* arity, const ERL_NIF_TERM** array));
 ERL_NIF_API_FUNC_DECL(int,enif_is_identical,(ERL_NIF_TERM lhs, ERL_NIF_TERM rhs));
 ERL_NIF_API_FUNC_DECL(int,enif_compare,(ERL_NIF_TERM lhs, ERL_NIF_TERM rhs));
+ERL_NIF_API_FUNC_DECL(ErlNifUInt64,enif_hash,(ErlNifHash type, ERL_NIF_TERM term, ErlNifUInt64 salt));
 ERL_NIF_API_FUNC_DECL(ERL_NIF_TERM,enif_make_binary,(ErlNifEnv* env, ErlNifBinary* bin));
 ERL_NIF_API_FUNC_DECL(ERL_NIF_TERM,enif_make_badarg,(ErlNifEnv* env));
 ERL_NIF_API_FUNC_DECL(ERL_NIF_TERM,enif_make_int,(ErlNifEnv* env, int i));
@@ -0,0 +1,38 @@
+//
+// Pluggable memory allocators
+//
+#ifndef __CNIF_ALLOC_H__
+#define __CNIF_ALLOC_H__
+
+#include "cnif.h"
+
+// enif_alloc/enif_realloc/enif_free go through the global allocator,
+// heap fragments through the allocator of their env. Blocks must be
+// aligned for any C type (16 bytes). The global allocator should be set
+// before anything is allocated, a block is always released through the
+// allocator that returned it.
+typedef struct _cnif_allocator_t
+{
+    void* (*alloc)(void* arg, size_t size);
+    void* (*realloc)(void* arg, void* ptr, size_t size);
+    void  (*free)(void* arg, void* ptr);
+    void* arg;
+} cnif_allocator_t;
+
+// plain libc malloc/realloc/free
+extern const cnif_allocator_t cnif_malloc_allocator;
+// size classes cached per thread in front of malloc, the default
+extern const cnif_allocator_t cnif_cache_allocator;
+// one mmap per block, unmapped on free, for large env fragments
+extern const cnif_allocator_t cnif_mmap_allocator;
+// as mmap with 2M aligned blocks advised to use transparent huge pages
+extern const cnif_allocator_t cnif_hugepage_allocator;
+
+ERL_NIF_API_FUNC_DECL(const cnif_allocator_t*,cnif_get_allocator,(void));
+ERL_NIF_API_FUNC_DECL(int,cnif_set_allocator,(const cnif_allocator_t* a));
+ERL_NIF_API_FUNC_DECL(const cnif_allocator_t*,cnif_env_allocator,(ErlNifEnv* env));
+ERL_NIF_API_FUNC_DECL(int,cnif_env_set_allocator,(ErlNifEnv* env, const cnif_allocator_t* a));
+ERL_NIF_API_FUNC_DECL(int,cnif_env_set_fragment_size,(ErlNifEnv* env, size_t words));
+ERL_NIF_API_FUNC_DECL(void,cnif_cache_flush,(void));
+
+#endif
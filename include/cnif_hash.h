@@ -0,0 +1,13 @@
+#ifndef __CNIF_HASH_H__
+#define __CNIF_HASH_H__
+
+#include "cnif.h"
+
+// Structural term hash. Terms that compare equal with enif_compare
+// hash to the same value, so an integral float hashes as the integer.
+ERL_NIF_API_FUNC_DECL(uint32_t,cnif_hash_term,(ERL_NIF_TERM term, uint32_t salt));
+ERL_NIF_API_FUNC_DECL(uint64_t,cnif_hash_term64,(ERL_NIF_TERM term, uint64_t salt));
+// erlang:phash2(Term, 1 bsl 32)
+ERL_NIF_API_FUNC_DECL(uint32_t,cnif_phash2,(ERL_NIF_TERM term));
+
+#endif
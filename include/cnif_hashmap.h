@@ -0,0 +1,17 @@
+#ifndef __CNIF_HASHMAP_H__
+#define __CNIF_HASHMAP_H__
+
+#include "cnif.h"
+
+ERL_NIF_API_FUNC_DECL(int,cnif_map_key_compare,(ERL_NIF_TERM lhs, ERL_NIF_TERM rhs));
+ERL_NIF_API_FUNC_DECL(ERL_NIF_TERM,cnif_hashmap_from_arrays,(ErlNifEnv* env, const ERL_NIF_TERM keys[], const ERL_NIF_TERM values[], unsigned cnt));
+ERL_NIF_API_FUNC_DECL(int,cnif_hashmap_get,(ERL_NIF_TERM map, ERL_NIF_TERM key, ERL_NIF_TERM* value));
+ERL_NIF_API_FUNC_DECL(int,cnif_hashmap_put,(ErlNifEnv* env, ERL_NIF_TERM map, ERL_NIF_TERM key, ERL_NIF_TERM value, int update, ERL_NIF_TERM* map_out));
+ERL_NIF_API_FUNC_DECL(int,cnif_hashmap_remove,(ErlNifEnv* env, ERL_NIF_TERM map, ERL_NIF_TERM key, ERL_NIF_TERM* map_out));
+ERL_NIF_API_FUNC_DECL(ERL_NIF_UINT,cnif_hashmap_leaves,(ERL_NIF_TERM map, ERL_NIF_TERM* leaves));
+ERL_NIF_API_FUNC_DECL(int,cnif_map_sorted_arrays,(ERL_NIF_TERM map, ERL_NIF_TERM** keys, ERL_NIF_TERM** values, void** bufp));
+ERL_NIF_API_FUNC_DECL(ERL_NIF_UINT,cnif_map_entries,(ERL_NIF_TERM map, ERL_NIF_TERM* keys, ERL_NIF_TERM* values));
+ERL_NIF_API_FUNC_DECL(ERL_NIF_TERM,cnif_make_flatmap,(ErlNifEnv* env, const ERL_NIF_TERM keys[], const ERL_NIF_TERM values[], unsigned cnt));
+ERL_NIF_API_FUNC_DECL(ERL_NIF_TERM,cnif_make_map_from_sorted,(ErlNifEnv* env, const ERL_NIF_TERM keys[], const ERL_NIF_TERM values[], unsigned cnt));
+
+#endif
@@ -4,14 +4,14 @@
 
 #include <stdio.h>
 #include <stdarg.h>
+#include <sys/types.h>
 
 #include "cnif.h"
 
 struct _enif_io_t;
 
 typedef int (*enif_io_putc_t)(struct _enif_io_t* p, int c, void* arg);
-typedef int (*enif_io_getc_t)(struct _enif_io_t* p, void* arg);
-typedef int (*enif_io_ungetc_t)(struct _enif_io_t* p, int c, void* arg);
+typedef ssize_t (*enif_io_read_t)(struct _enif_io_t* p, void* arg, char* buf, size_t len);
 typedef int (*enif_io_close_t)(struct _enif_io_t* p, void* arg);
 typedef int (*enif_io_format_t)(struct _enif_io_t* p, void* arg, char* fmt, va_list ap);
 typedef int (*enif_io_callback_t)(struct _enif_io_t* p, ERL_NIF_TERM term);
@@ -19,8 +19,7 @@ typedef int (*enif_io_callback_t)(struct _enif_io_t* p, ERL_NIF_TERM term);
 typedef struct {
     enif_io_putc_t     putc;
     enif_io_format_t   format;
-    enif_io_getc_t     getc;
-    enif_io_ungetc_t   ungetc;
+    enif_io_read_t     read;      // refill the input window, 0 at end
     enif_io_close_t    close;
 } enif_io_methods_t;
 
@@ -28,13 +27,19 @@ typedef struct _enif_io_state_t
 {
     int line;
     char* ifile;
-    void* iarg;   // argument to getc/ungetc/close
+    void* iarg;   // argument to read/close
     char* ofile;
     char* oarg;   // argument to putc/format/close
     char* error;
+    const char* ptr;  // next input char
+    const char* end;  // end of the input window
+    char* buf;        // window buffer, NULL for an in-memory buffer
+    const char* base; // start of an in-memory buffer
+    cnif_external_t* ext; // owner of the buffer, binaries may reference it
 } enif_io_state_t;
 
 #define ENIF_IO_MAX_DEPTH 10
+#define ENIF_IO_BUF_SIZE  65536  // bytes read per refill
 
 typedef struct _enif_io_t {
     int sp;
@@ -75,14 +80,23 @@ static UNUSED inline char* enif_io_error(enif_io_t* p)
     return "";
 }
 
+ERL_NIF_API_FUNC_DECL(int, enif_io_fill, (enif_io_t*));
+
+// the input is scanned in a window refilled by the read method
 static inline int enif_io_getc(enif_io_t* p)
 {
-    return p->meth->getc(p, p->state[p->sp].iarg);
+    enif_io_state_t* sp = &p->state[p->sp];
+    if (sp->ptr < sp->end)
+	return (unsigned char) *sp->ptr++;
+    return enif_io_fill(p);
 }
 
+// push back the last char read, at most two chars can be pushed back
 static inline int enif_io_ungetc(int c, enif_io_t* p)
 {
-    return p->meth->ungetc(p, c, p->state[p->sp].iarg);
+    if (c != EOF)
+	p->state[p->sp].ptr--;
+    return c;
 }
 
 static inline int enif_io_putc(enif_io_t* p, int c)
@@ -109,6 +123,7 @@ static inline void enif_io_set_callback(enif_io_t* p, enif_io_callback_t cb)
 ERL_NIF_API_FUNC_DECL(enif_io_t*, enif_io_alloc, (ErlNifEnv* env, enif_io_methods_t* meth, void* data));
 ERL_NIF_API_FUNC_DECL(void, enif_io_free, (enif_io_t*));
 ERL_NIF_API_FUNC_DECL(int, enif_io_push, (enif_io_t*,void* iarg,char* ifile,int line,void* oarg,char* ofile));
+ERL_NIF_API_FUNC_DECL(int, enif_io_push_buffer, (enif_io_t*,const char* data,size_t len,char* ifile,int line,void* oarg,char* ofile));
 ERL_NIF_API_FUNC_DECL(int, enif_io_pop, (enif_io_t*));
 ERL_NIF_API_FUNC_DECL(int, enif_io_scan_forms, (enif_io_t*));
 ERL_NIF_API_FUNC_DECL(void, enif_io_set_error, (enif_io_t*, char* err));
@@ -12,6 +12,7 @@ typedef int (*hcmp_fun_t)(void*, void*);
 typedef lhash_value_t (*h_fun_t)(void*);
 typedef void* (*halloc_fun_t)(void*);
 typedef void (*hfree_fun_t)(void*);
+typedef void (*heach_fun_t)(void*, void*);
 
 typedef struct
 {
@@ -48,5 +49,6 @@ extern void   lhash_free(lhash_t*);
 extern void* lhash_get(lhash_t*, void*);
 extern void* lhash_put(lhash_t*, void*);
 extern void* lhash_erase(lhash_t*, void*);
+extern void  lhash_each(lhash_t*, heach_fun_t, void*);
 
 #endif
@@ -23,6 +23,28 @@ typedef enum {
     ENIF_TYPE_BINARY  = 13
 } enif_type_t;
 
+// enif_make_sorted_list options, a key position in the low bits sorts
+// tuples on that element like lists:keysort/2, 0 sorts whole terms
+typedef enum {
+    ENIF_SORT_KEY_MASK = 0xffff,
+    ENIF_SORT_UNIQUE   = 0x10000,  // keep the first of equal elements
+    ENIF_SORT_REVERSE  = 0x20000   // descending order
+} enif_sort_opt_t;
+
+// Array view of a compact list, element i is at elem[i*stride].
+// Lists built by enif_make_list_from_array, enif_make_list,
+// enif_make_reverse_list, the bulk builders and enif_make_compact_list
+// are compact: all cons cells are adjacent in one heap block.
+typedef struct {
+    const ERL_NIF_TERM* elem;
+    unsigned size;
+    unsigned stride;
+} ErlNifListView;
+
+// Lookup index for flatmaps sharing one keys tuple, for example maps
+// derived from the same record template with enif_make_map_update.
+typedef struct _ErlNifMapIndex ErlNifMapIndex;
+
 
 static ERL_NIF_INLINE ERL_NIF_TERM enif_make_tuple0(ErlNifEnv* env)
 {
@@ -38,10 +60,18 @@ ERL_NIF_API_FUNC_DECL(int,enif_is_float,(ErlNifEnv*, ERL_NIF_TERM term));
 ERL_NIF_API_FUNC_DECL(int,enif_is_integer,(ErlNifEnv*, ERL_NIF_TERM term));
 
 ERL_NIF_API_FUNC_DECL(ERL_NIF_TERM,enif_make_map_from_arrays,(ErlNifEnv* env,ERL_NIF_TERM keys[],ERL_NIF_TERM value[],unsigned cnt));
+ERL_NIF_API_FUNC_DECL(int,enif_make_map_merge,(ErlNifEnv* env, ERL_NIF_TERM map1, ERL_NIF_TERM map2, ERL_NIF_TERM* map_out));
+ERL_NIF_API_FUNC_DECL(int,enif_make_map_put_many,(ErlNifEnv* env, ERL_NIF_TERM map_in, ERL_NIF_TERM keys[], ERL_NIF_TERM values[], unsigned cnt, ERL_NIF_TERM* map_out));
+ERL_NIF_API_FUNC_DECL(int,enif_make_map_remove_many,(ErlNifEnv* env, ERL_NIF_TERM map_in, ERL_NIF_TERM keys[], unsigned cnt, ERL_NIF_TERM* map_out));
+
+ERL_NIF_API_FUNC_DECL(ErlNifMapIndex*,enif_map_index_create,(ErlNifEnv* env, ERL_NIF_TERM map));
+ERL_NIF_API_FUNC_DECL(void,enif_map_index_destroy,(ErlNifMapIndex* index));
+ERL_NIF_API_FUNC_DECL(int,enif_get_map_value_indexed,(ErlNifEnv* env, const ErlNifMapIndex* index, ERL_NIF_TERM map, ERL_NIF_TERM key, ERL_NIF_TERM* value));
 
 ERL_NIF_API_FUNC_DECL(enif_type_t,enif_get_type,(ERL_NIF_TERM term, int number));
 ERL_NIF_API_FUNC_DECL(int,enif_iolist_size,(ErlNifEnv* env, ERL_NIF_TERM term, size_t* len));
 ERL_NIF_API_FUNC_DECL(int,enif_byte_size,(ErlNifEnv* env, ERL_NIF_TERM term, size_t* len));
+ERL_NIF_API_FUNC_DECL(int,enif_get_string_length,(ErlNifEnv* env, ERL_NIF_TERM list, unsigned* len, ErlNifCharEncoding));
 ERL_NIF_API_FUNC_DECL(int,enif_inline_reverse_list,(ErlNifEnv*, ERL_NIF_TERM term, ERL_NIF_TERM tail, ERL_NIF_TERM *list));
 
 ERL_NIF_API_FUNC_DECL(int, enif_each_element,
@@ -50,9 +80,25 @@ ERL_NIF_API_FUNC_DECL(int, enif_each_element,
 		      ERL_NIF_TERM term,
 		       void* arg));
 
+ERL_NIF_API_FUNC_DECL(ERL_NIF_TERM,enif_make_list_from_int64_array,(ErlNifEnv* env, const ErlNifSInt64 arr[], unsigned cnt));
+ERL_NIF_API_FUNC_DECL(ERL_NIF_TERM,enif_make_list_from_double_array,(ErlNifEnv* env, const double arr[], unsigned cnt));
+ERL_NIF_API_FUNC_DECL(ERL_NIF_TERM,enif_make_list_from_uint8_array,(ErlNifEnv* env, const uint8_t arr[], unsigned cnt));
+ERL_NIF_API_FUNC_DECL(int,enif_get_int64_array,(ErlNifEnv* env, ERL_NIF_TERM term, ErlNifSInt64* arr, unsigned len, unsigned* cnt));
+ERL_NIF_API_FUNC_DECL(int,enif_get_double_array,(ErlNifEnv* env, ERL_NIF_TERM term, double* arr, unsigned len, unsigned* cnt));
+ERL_NIF_API_FUNC_DECL(int,enif_get_uint8_array,(ErlNifEnv* env, ERL_NIF_TERM term, uint8_t* arr, unsigned len, unsigned* cnt));
+
+ERL_NIF_API_FUNC_DECL(int,enif_get_list_view,(ErlNifEnv* env, ERL_NIF_TERM list, ErlNifListView* view));
+ERL_NIF_API_FUNC_DECL(int,enif_make_compact_list,(ErlNifEnv* env, ERL_NIF_TERM list, ERL_NIF_TERM* compact));
+ERL_NIF_API_FUNC_DECL(int,enif_make_sorted_list,(ErlNifEnv* env, ERL_NIF_TERM list, unsigned opts, ERL_NIF_TERM* sorted));
+
 ERL_NIF_API_FUNC_DECL(ERL_NIF_UINT,enif_flat_size,(ERL_NIF_TERM src_term));
+ERL_NIF_API_FUNC_DECL(ERL_NIF_UINT,enif_struct_size,(ERL_NIF_TERM src_term));
 
 ERL_NIF_API_FUNC_DECL(ERL_NIF_TERM,enif_make_flat_copy,(ErlNifEnv* dst_env, ERL_NIF_TERM src_term));
 ERL_NIF_API_FUNC_DECL(ERL_NIF_TERM,enif_make_struct_copy,(ErlNifEnv* dst_env, ERL_NIF_TERM src_term));
+ERL_NIF_API_FUNC_DECL(int,enif_env_adopt,(ErlNifEnv* dst, ErlNifEnv* src));
+ERL_NIF_API_FUNC_DECL(int,enif_is_env_term,(ErlNifEnv* env, ERL_NIF_TERM term));
+ERL_NIF_API_FUNC_DECL(ERL_NIF_TERM,enif_env_transfer_term,(ErlNifEnv* dst, ErlNifEnv* src, ERL_NIF_TERM term));
+ERL_NIF_API_FUNC_DECL(int,enif_env_gc,(ErlNifEnv* env, ERL_NIF_TERM roots[], unsigned nroots));
 
 #endif
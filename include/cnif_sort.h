@@ -3,6 +3,8 @@
 
 #include "cnif.h"
 
+typedef int (*cnif_compare_t)(ERL_NIF_TERM, ERL_NIF_TERM);
+
 ERL_NIF_API_FUNC_DECL(int,cnif_is_sorted,(const ERL_NIF_TERM* arr, size_t n));
 ERL_NIF_API_FUNC_DECL(int,cnif_is_usorted,(const ERL_NIF_TERM* arr, size_t n));
 ERL_NIF_API_FUNC_DECL(void,cnif_inline_quick_sort_aux,(ERL_NIF_TERM* src1,
@@ -28,5 +30,30 @@ ERL_NIF_API_FUNC_DECL(int,cnif_quick_usort_aux,(ERL_NIF_TERM* src1,
 ERL_NIF_API_FUNC_DECL(int,cnif_quick_usort,(ERL_NIF_TERM* src1,
 					    ERL_NIF_TERM* dst1,
 					    int left,int right));
+ERL_NIF_API_FUNC_DECL(void,cnif_merge_sort_aux,(ERL_NIF_TERM* src1,
+						ERL_NIF_TERM* src2,
+						size_t n, cnif_compare_t cmp));
+ERL_NIF_API_FUNC_DECL(size_t,cnif_merge_usort_last_aux,(ERL_NIF_TERM* src1,
+							ERL_NIF_TERM* src2,
+							size_t n,
+							cnif_compare_t cmp));
+ERL_NIF_API_FUNC_DECL(void,cnif_pdq_sort_aux,(ERL_NIF_TERM* src1,
+					      ERL_NIF_TERM* src2,
+					      size_t n, cnif_compare_t cmp));
+ERL_NIF_API_FUNC_DECL(size_t,cnif_pdq_usort_aux,(ERL_NIF_TERM* src1,
+						 ERL_NIF_TERM* src2,
+						 size_t n, cnif_compare_t cmp));
+ERL_NIF_API_FUNC_DECL(int,cnif_keysort,(ERL_NIF_TERM* arr, size_t n,
+				       unsigned pos));
+ERL_NIF_API_FUNC_DECL(int,cnif_sort_threads,(void));
+ERL_NIF_API_FUNC_DECL(void,cnif_parallel_sort_aux,(ERL_NIF_TERM* src1,
+						   ERL_NIF_TERM* src2,
+						   size_t n, cnif_compare_t cmp,
+						   int nthreads));
+ERL_NIF_API_FUNC_DECL(size_t,cnif_parallel_usort_aux,(ERL_NIF_TERM* src1,
+						      ERL_NIF_TERM* src2,
+						      size_t n,
+						      cnif_compare_t cmp,
+						      int nthreads));
 
 #endif
@@ -4,5 +4,7 @@
 #include "cnif_io.h"
 
 ERL_NIF_API_FUNC_DECL(enif_io_t*, enif_stdio_alloc, (ErlNifEnv* env, void* data));
+ERL_NIF_API_FUNC_DECL(int, enif_io_parse_buffer, (ErlNifEnv* env, const char* data, size_t len, enif_io_callback_t callback, void* cb_data));
+ERL_NIF_API_FUNC_DECL(int, enif_io_parse_file_mmap, (ErlNifEnv* env, const char* path, enif_io_callback_t callback, void* cb_data));
 
 #endif
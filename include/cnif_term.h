@@ -3,6 +3,7 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 
 #include "cnif.h"
 #include "cnif_lhash.h"
@@ -96,6 +97,11 @@
 #define GET_ATOM(term)    ((atom_t*)((term) & ~MASK_WORD(TAG_IMMED2_SIZE)))
 #define IS_SMALL(term)    (((term) & TAG_IMMED1_MASK) == TAG_IMMED1_SMALL)
 #define MAKE_SMALL(val)   (((val) << TAG_IMMED1_SIZE) | TAG_IMMED1_SMALL)
+#define GET_SMALL(term)   (((ERL_NIF_INT)(term)) >> TAG_IMMED1_SIZE)
+#define SMALL_BITS        (__WORDSIZE-TAG_IMMED1_SIZE)
+#define MAX_SMALL         ((INT64_C(1) << (SMALL_BITS-1))-1)
+#define MIN_SMALL         (-(INT64_C(1) << (SMALL_BITS-1)))
+#define IS_SSMALL(x)      (((x) >= MIN_SMALL) && ((x) <= MAX_SMALL))
 
 #define MAKE_BIGNUM(ptr)   MAKE_BOXED(ptr)
 #define MAKE_POS_BIGVAL(ari) (((ari)<<_HEADER_ARITY_OFFS) | TAG_HEADER_POS_BIG)
@@ -131,6 +137,68 @@
 #define WORDSIZE __WORDSIZE   // from stdint better alternative?
 #define NWORDS(bytes) (((bytes)+sizeof(ERL_NIF_TERM)-1)/sizeof(ERL_NIF_TERM))
 
+#if defined(__GNUC__)
+#define PREFETCH(ptr) __builtin_prefetch((ptr))
+#else
+#define PREFETCH(ptr)
+#endif
+
+// Explicit work stack, used by term walkers instead of C recursion
+#define WSTACK_DEFAULT_SIZE 32
+
+typedef struct {
+    ERL_NIF_TERM* sp;     // next free slot
+    ERL_NIF_TERM* start;  // def or allocated area
+    ERL_NIF_TERM* end;
+    ERL_NIF_TERM  def[WSTACK_DEFAULT_SIZE];
+} wstack_t;
+
+static inline void wstack_init(wstack_t* s)
+{
+    s->start = s->def;
+    s->sp    = s->def;
+    s->end   = s->def + WSTACK_DEFAULT_SIZE;
+}
+
+static inline void wstack_grow(wstack_t* s)
+{
+    size_t n = s->end - s->start;
+    ERL_NIF_TERM* ptr;
+
+    if (s->start == s->def) {
+	ptr = enif_alloc(2*n*sizeof(ERL_NIF_TERM));
+	memcpy(ptr, s->def, n*sizeof(ERL_NIF_TERM));
+    }
+    else
+	ptr = enif_realloc(s->start, 2*n*sizeof(ERL_NIF_TERM));
+    s->start = ptr;
+    s->sp    = ptr + n;
+    s->end   = ptr + 2*n;
+}
+
+static inline void wstack_push(wstack_t* s, ERL_NIF_TERM t)
+{
+    if (s->sp == s->end)
+	wstack_grow(s);
+    *s->sp++ = t;
+}
+
+static inline ERL_NIF_TERM wstack_pop(wstack_t* s)
+{
+    return *--s->sp;
+}
+
+static inline int wstack_is_empty(wstack_t* s)
+{
+    return (s->sp == s->start);
+}
+
+static inline void wstack_free(wstack_t* s)
+{
+    if (s->start != s->def)
+	enif_free(s->start);
+}
+
 // Global heap object
 typedef struct _binary_t
 {
@@ -140,6 +208,11 @@ typedef struct _binary_t
     uint8_t orig_bytes[1];
 } binary_t;
 
+#define BINARY_EXTERNAL 0x1  // flags of the binary_t in a cnif_external_t
+
+// take a reference to val for a refc binary copied into env
+ERL_NIF_API_FUNC_DECL(int,cnif_binary_keep,(ErlNifEnv* env, binary_t* val));
+
 // Global atom object
 typedef struct _atom_t 
 {
@@ -183,5 +256,22 @@ typedef struct _flatmap_t {
     ERL_NIF_TERM value[]; // value[0..size-1]
 } flatmap_t;
 
+// Maps larger than MAP_SMALL_MAP_LIMIT are hash array mapped tries.
+// The keys slot holds HASHMAP_MARKER in place of the keys tuple. Nodes
+// are tuples {Bitmap, Child...} where a child is a sub node or a leaf
+// cons [Key|Value].
+#define MAP_SMALL_MAP_LIMIT 32
+#define HASHMAP_MARKER      MAKE_SMALL(0)
+
+typedef struct _hashmap_t {
+    ERL_NIF_TERM header;  // MAKE_MAPVAL(3)
+    ERL_NIF_UINT size;    // number of key/value pairs
+    ERL_NIF_TERM marker;  // HASHMAP_MARKER
+    ERL_NIF_TERM root;    // root node
+} hashmap_t;
+
+#define IS_HASHMAP_PTR(mp) (!IS_BOXED(((flatmap_t*)(mp))->keys))
+#define IS_HASHMAP(term)   (IS_MAP(term) && IS_HASHMAP_PTR(GET_MAP(term)))
+
 #endif
 
@@ -0,0 +1,30 @@
+//
+// Term keyed hash table
+//
+#ifndef __CNIF_TERMTAB_H__
+#define __CNIF_TERMTAB_H__
+
+#include "cnif.h"
+
+// Keys match with enif_is_identical, keys and values are copied into
+// the table env. Updates and erases may compact the env, terms got from
+// the table are valid until the next put, erase or load.
+typedef struct _cnif_termtab_t cnif_termtab_t;
+
+typedef void (*cnif_termtab_fun_t)(ERL_NIF_TERM key, ERL_NIF_TERM value,
+				   void* arg);
+
+ERL_NIF_API_FUNC_DECL(cnif_termtab_t*,cnif_termtab_new,(void));
+ERL_NIF_API_FUNC_DECL(void,cnif_termtab_free,(cnif_termtab_t* tab));
+ERL_NIF_API_FUNC_DECL(ErlNifEnv*,cnif_termtab_env,(cnif_termtab_t* tab));
+ERL_NIF_API_FUNC_DECL(size_t,cnif_termtab_size,(cnif_termtab_t* tab));
+ERL_NIF_API_FUNC_DECL(int,cnif_termtab_get,(cnif_termtab_t* tab, ERL_NIF_TERM key, ERL_NIF_TERM* value));
+ERL_NIF_API_FUNC_DECL(int,cnif_termtab_put,(cnif_termtab_t* tab, ERL_NIF_TERM key, ERL_NIF_TERM value));
+ERL_NIF_API_FUNC_DECL(int,cnif_termtab_put_new,(cnif_termtab_t* tab, ERL_NIF_TERM key, ERL_NIF_TERM value));
+ERL_NIF_API_FUNC_DECL(int,cnif_termtab_erase,(cnif_termtab_t* tab, ERL_NIF_TERM key));
+ERL_NIF_API_FUNC_DECL(void,cnif_termtab_each,(cnif_termtab_t* tab, cnif_termtab_fun_t fun, void* arg));
+ERL_NIF_API_FUNC_DECL(int,cnif_termtab_load,(cnif_termtab_t* tab, const ERL_NIF_TERM keys[], const ERL_NIF_TERM values[], size_t n));
+ERL_NIF_API_FUNC_DECL(int,cnif_termtab_load_map,(cnif_termtab_t* tab, ERL_NIF_TERM map));
+ERL_NIF_API_FUNC_DECL(int,cnif_termtab_load_list,(cnif_termtab_t* tab, ERL_NIF_TERM list));
+
+#endif
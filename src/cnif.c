@@ -8,11 +8,13 @@
 #include <limits.h>
 
 #include "../include/cnif.h"
+#include "../include/cnif_alloc.h"
 #include "../include/cnif_big.h"
 #include "../include/cnif_lhash.h"
 #include "../include/cnif_term.h"
 #include "../include/cnif_sort.h"
 #include "../include/cnif_misc.h"
+#include "../include/cnif_hashmap.h"
 
 #define DBG(...) printf(__VA_ARGS__)
 
@@ -20,21 +22,29 @@
 
 typedef struct _fragment_t {
     size_t size;
+    size_t free;          // words left unused when a newer fragment began
     struct _fragment_t* prev;
     ERL_NIF_TERM data[];
 } fragment_t;
 
-typedef struct _cnif_heap_mark_t
-{
-    fragment_t* frag;
-    ERL_NIF_TERM* top;
-} cnif_heap_mark_t;    
+typedef struct _held_t {
+    struct _held_t* next;
+    cnif_external_t* ext;
+} held_t;
 
 struct enif_environment_t
 {
     fragment_t* first;
     fragment_t* last;
     ERL_NIF_TERM* top;    // into last moving backwards
+    lhash_t* shapes;      // interned flatmap keys tuples
+    const cnif_allocator_t* allocator;  // of the fragments
+    size_t fragment_size; // words in new fragments, 0 for default
+    held_t* held;         // external binaries referenced
+    size_t heap_words;    // words in fragments
+    size_t peak;          // largest heap_words
+    size_t limit;         // max heap_words, 0 for no limit
+    size_t failures;      // refused allocations
 };
 
 static lhash_value_t atom_hash(void* a);
@@ -52,71 +62,159 @@ static const lhash_methods_t atom_funcs =
     atom_free
 };
 
+// Return n words on the env heap or NULL when the env limit is reached
+// or memory is exhausted, builders then return INVALID_TERM.
 ERL_NIF_TERM* cnif_heap_alloc(ErlNifEnv* env, size_t n)
 {
     if ((env->top == NULL) || ((env->top - env->last->data) < n)) {
-	size_t sz = (n < DEFAULT_FRAGMENT_SIZE) ? DEFAULT_FRAGMENT_SIZE : (n << 1);
-	size_t memsz = sizeof(fragment_t) + sizeof(ERL_NIF_TERM)*sz;
-	fragment_t* fp = malloc(memsz);
-
-	DBG("new framgent %p size %zu allocated\n", fp, sz);
+	size_t fsz = env->fragment_size ? env->fragment_size :
+	    DEFAULT_FRAGMENT_SIZE;
+	size_t sz = (n < fsz) ? fsz : (n << 1);
+	fragment_t* fp;
+
+	if (env->limit) {
+	    if (env->heap_words + n > env->limit)
+		goto fail;
+	    if (env->heap_words + sz > env->limit)  // last fragment
+		sz = env->limit - env->heap_words;
+	}
+	fp = env->allocator->alloc(env->allocator->arg,
+				   sizeof(fragment_t)+sizeof(ERL_NIF_TERM)*sz);
+	if (fp == NULL)
+	    goto fail;
+	if (env->last)
+	    env->last->free = env->top - env->last->data;
 	fp->size = sz;
+	fp->free = 0;
 	fp->prev = env->last;
+	if (env->first == NULL)
+	    env->first = fp;
 	env->last = fp;
 	env->top = &env->last->data[sz];
+	env->heap_words += sz;
+	if (env->heap_words > env->peak)
+	    env->peak = env->heap_words;
     }
     env->top -= n;
-    // DBG("heap alloc %zu, top = %p\n", n, env->top);
     return env->top;
+fail:
+    env->failures++;
+    return NULL;
 }
 
-int cnif_heap_begin(ErlNifEnv* env, void** mark)
+// Marks are plain values, a rewind frees the terms allocated after the
+// mark and a commit keeps them. A mark is invalid after enif_clear_env,
+// enif_env_gc or a rewind to an earlier mark.
+int cnif_heap_begin(ErlNifEnv* env, cnif_heap_mark_t* mark)
 {
-    cnif_heap_mark_t* mp = enif_alloc(sizeof(cnif_heap_mark_t));
-    mp->frag = env->last;
-    mp->top  = env->top;
-    *mark = mp;
+    mark->frag = env->last;
+    mark->top  = env->top;
     return 1;
 }
 
-int cnif_heap_rewind(ErlNifEnv* env, void** mark)
+int cnif_heap_rewind(ErlNifEnv* env, const cnif_heap_mark_t* mark)
 {
-    cnif_heap_mark_t* mp = (cnif_heap_mark_t*) mark;
     fragment_t* fp = env->last;
 
-    while(fp && (fp != mp->frag)) {
+    while(fp && (fp != mark->frag) && (fp != env->first)) {
 	fragment_t* fpp = fp->prev;
-	enif_free(fp);
+	env->heap_words -= fp->size;
+	env->allocator->free(env->allocator->arg, fp);
 	fp = fpp;
     }
-    if ((env->last = fp) == NULL)
-	env->first = NULL;
-    env->top = mp->top;
-    enif_free(mp);
+    if (fp && (mark->frag == NULL)) {
+	// rewind to the empty heap, keep the oldest fragment for reuse
+	env->last = fp;
+	env->top  = &fp->data[fp->size];
+    }
+    else {
+	env->last = fp;
+	env->top  = mark->top;
+    }
+    if (env->shapes) {  // interned tuples may live above the mark
+	lhash_free(env->shapes);
+	env->shapes = NULL;
+    }
     return 1;
 }    
 
-int cnif_heap_commit(ErlNifEnv* env, void** mark)
+int cnif_heap_commit(ErlNifEnv* env, cnif_heap_mark_t* mark)
+{
+    mark->frag = NULL;
+    mark->top  = NULL;
+    return 1;
+}
+
+// store the [lo,hi) word range of each fragment, newest first, into
+// ranges[2*i], ranges[2*i+1] for at most max fragments and return the
+// number of fragments in the env
+size_t cnif_heap_ranges(ErlNifEnv* env, ERL_NIF_TERM** ranges, size_t max)
+{
+    fragment_t* fp;
+    size_t n = 0;
+
+    for (fp = env->last; fp != NULL; fp = fp->prev) {
+	if (n < max) {
+	    ranges[2*n]   = fp->data;
+	    ranges[2*n+1] = fp->data + fp->size;
+	}
+	n++;
+    }
+    return n;
+}
+
+// usage of the env heap, the tail words of all but the newest fragment
+// are counted as wasted
+int cnif_heap_stats(ErlNifEnv* env, cnif_heap_stats_t* stats)
 {
-    cnif_heap_mark_t* mp = (cnif_heap_mark_t*) mark;
-    enif_free(mp);
+    fragment_t* fp;
+
+    memset(stats, 0, sizeof(cnif_heap_stats_t));
+    for (fp = env->last; fp != NULL; fp = fp->prev) {
+	stats->fragments++;
+	if (fp != env->last)
+	    stats->wasted += fp->free;
+    }
+    stats->size = env->heap_words;
+    stats->used = env->heap_words - stats->wasted;
+    if (env->last)
+	stats->used -= (env->top - env->last->data);
+    stats->peak = env->peak;
+    stats->limit = env->limit;
+    stats->failures = env->failures;
     return 1;
 }
 
+// limit the env heap to words, allocations beyond fail, 0 removes the
+// limit. Terms already allocated are kept.
+int cnif_heap_set_limit(ErlNifEnv* env, size_t words)
+{
+    env->limit = words;
+    return 1;
+}
 
-void* enif_alloc(size_t size)
+const cnif_allocator_t* cnif_env_allocator(ErlNifEnv* env)
 {
-    return malloc(size);
+    return env->allocator;
 }
 
-void* enif_realloc(void* ptr, size_t size)
+// allocate the heap fragments of env with a, NULL selects the global
+// allocator. Only an env without fragments can change allocator.
+int cnif_env_set_allocator(ErlNifEnv* env, const cnif_allocator_t* a)
 {
-    return realloc(ptr, size);
+    if (env->last != NULL)
+	return 0;
+    env->allocator = (a != NULL) ? a : cnif_get_allocator();
+    return 1;
 }
 
-void enif_free(void* ptr)
+// size of new heap fragments in words, 0 restores the default. Large
+// fragments together with the mmap or hugepage allocator keep a big
+// heap in few mappings.
+int cnif_env_set_fragment_size(ErlNifEnv* env, size_t words)
 {
-    free(ptr);
+    env->fragment_size = words;
+    return 1;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -126,31 +224,295 @@ void enif_free(void* ptr)
 ErlNifEnv* enif_alloc_env(void)
 {
     ErlNifEnv* env = enif_alloc(sizeof(struct enif_environment_t));
-    if (env)
+    if (env) {
 	memset(env, 0, sizeof(struct enif_environment_t));
+	env->allocator = cnif_get_allocator();
+    }
     if (!global_atoms) {
 	global_atoms = lhash_new("atoms", 3, &atom_funcs);
     }
     return env;
 }
 
-void enif_clear_env(ErlNifEnv* env)
+static void release_held(ErlNifEnv* env);
+
+// free the heap and the interned shapes, the references to external
+// binaries are kept until the env is cleared
+void cnif_heap_free(ErlNifEnv* env)
 {
     fragment_t* p = env->last;
     while(p) {
 	fragment_t* pn = p->prev;
-	enif_free(p);
+	env->allocator->free(env->allocator->arg, p);
 	p = pn;
     }
     env->first = NULL;
     env->last = NULL;
     env->top = NULL;
+    env->heap_words = 0;
+    if (env->shapes) {
+	lhash_free(env->shapes);
+	env->shapes = NULL;
+    }
+}
+
+void enif_clear_env(ErlNifEnv* env)
+{
+    cnif_heap_free(env);
+    release_held(env);
+}
+
+// Move all fragments of src into dst without copying, terms built in
+// src stay valid and are owned by dst, src is left empty. The src chain
+// is linked in below the current dst fragment so dst keeps allocating
+// where it was. Interned shapes of src are dropped unless dst has none.
+// Envs with different allocators can not share fragments.
+int enif_env_adopt(ErlNifEnv* dst, ErlNifEnv* src)
+{
+    if ((dst == src) || (dst->allocator != src->allocator))
+	return 0;
+    if (src->last != NULL) {
+	if (dst->last == NULL) {
+	    dst->first = src->first;
+	    dst->last  = src->last;
+	    dst->top   = src->top;
+	}
+	else {
+	    src->last->free = src->top - src->last->data;
+	    src->first->prev = dst->last->prev;
+	    dst->last->prev = src->last;
+	    if (dst->first == dst->last)
+		dst->first = src->first;
+	}
+    }
+    if (src->shapes) {
+	if (dst->shapes == NULL)
+	    dst->shapes = src->shapes;
+	else
+	    lhash_free(src->shapes);
+    }
+    if (src->held) {
+	held_t** hpp = &src->held;
+	while(*hpp)
+	    hpp = &(*hpp)->next;
+	*hpp = dst->held;
+	dst->held = src->held;
+	src->held = NULL;
+    }
+    dst->heap_words += src->heap_words;
+    if (dst->heap_words > dst->peak)
+	dst->peak = dst->heap_words;
+    src->first  = NULL;
+    src->last   = NULL;
+    src->top    = NULL;
+    src->shapes = NULL;
+    src->heap_words = 0;
+    return 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// EXTERNAL BINARIES
+///////////////////////////////////////////////////////////////////////////////
+
+// Binaries over memory owned outside the env heaps, a mapped file for
+// example. The creator and each env with binaries over the memory hold
+// a reference, copies into other envs included. The release function is
+// called when the last reference is dropped. Envs may be handed between
+// threads so the count is updated atomically.
+
+struct _cnif_external_t {
+    binary_t val;         // refc counts the holders
+    uint8_t* data;
+    size_t size;
+    cnif_release_t release;
+    void* arg;
+};
+
+// the creator holds the first reference
+cnif_external_t* cnif_external_new(void* data, size_t size,
+				   cnif_release_t release, void* arg)
+{
+    cnif_external_t* ext = enif_alloc(sizeof(cnif_external_t));
+
+    if (ext == NULL)
+	return NULL;
+    memset(&ext->val, 0, sizeof(binary_t));
+    ext->val.flags = BINARY_EXTERNAL;
+    ext->val.refc = 1;
+    ext->val.orig_size = size;
+    ext->data = data;
+    ext->size = size;
+    ext->release = release;
+    ext->arg = arg;
+    return ext;
+}
+
+void cnif_external_release(cnif_external_t* ext)
+{
+    if (__atomic_sub_fetch(&ext->val.refc, 1, __ATOMIC_ACQ_REL) == 0) {
+	if (ext->release)
+	    ext->release(ext->data, ext->size, ext->arg);
+	enif_free(ext);
+    }
+}
+
+static void release_held(ErlNifEnv* env)
+{
+    held_t* hp = env->held;
+
+    while(hp) {
+	held_t* hpn = hp->next;
+	cnif_external_release(hp->ext);
+	enif_free(hp);
+	hp = hpn;
+    }
+    env->held = NULL;
+}
+
+// env holds a reference to ext until it is cleared
+static int hold_external(ErlNifEnv* env, cnif_external_t* ext)
+{
+    held_t* hp;
+
+    if ((env->held != NULL) && (env->held->ext == ext))
+	return 1;
+    if ((hp = enif_alloc(sizeof(held_t))) == NULL)
+	return 0;
+    __atomic_fetch_add(&ext->val.refc, 1, __ATOMIC_RELAXED);
+    hp->ext = ext;
+    hp->next = env->held;
+    env->held = hp;
+    return 1;
+}
+
+int cnif_binary_keep(ErlNifEnv* env, binary_t* val)
+{
+    if (val->flags & BINARY_EXTERNAL)
+	return hold_external(env, (cnif_external_t*) val);
+    val->refc++;
+    return 1;
+}
+
+// a binary over size bytes at offs of the external memory
+ERL_NIF_TERM cnif_make_external_binary(ErlNifEnv* env, cnif_external_t* ext,
+				       size_t offs, size_t size)
+{
+    size_t n = NWORDS(sizeof(refc_binary_t));
+    refc_binary_t* rbp;
+
+    if (offs + size > ext->size)
+	return INVALID_TERM;
+    if (!hold_external(env, ext))
+	return INVALID_TERM;
+    if ((rbp = (refc_binary_t*) cnif_heap_alloc(env, n)) == NULL)
+	return INVALID_TERM;
+    rbp->header = MAKE_REFC_BINVAL(n-1);
+    rbp->size   = size;
+    rbp->next   = 0;
+    rbp->val    = &ext->val;
+    rbp->bytes  = ext->data + offs;
+    rbp->flags  = 0;
+    return MAKE_BINARY(rbp);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SHAPES
+///////////////////////////////////////////////////////////////////////////////
+
+// Flatmaps built in the same env with the same sorted immediate keys
+// share one keys tuple, the table only holds terms on the env heap
+// and is dropped with it.
+
+typedef struct {
+    lhash_bucket_t bucket;
+    ERL_NIF_TERM keys;          // interned tuple
+    const ERL_NIF_TERM* kv;     // template keys
+    unsigned cnt;
+    ErlNifEnv* env;
+} shape_t;
+
+static lhash_value_t shape_hash(void* a)
+{
+    shape_t* sp = (shape_t*) a;
+    uint64_t h = 0xcbf29ce484222325 ^ sp->cnt;
+    unsigned i;
+
+    for (i = 0; i < sp->cnt; i++)
+	h = (h ^ (uint64_t) sp->kv[i]) * 0x100000001b3;
+    return (lhash_value_t) (h ^ (h >> 32));
+}
+
+static int shape_cmp(void* a, void* b)
+{
+    shape_t* ap = (shape_t*) a;
+    shape_t* bp = (shape_t*) b;
+    if (ap->cnt != bp->cnt)
+	return 1;
+    if (ap->cnt == 0)  // kv may be NULL
+	return 0;
+    return memcmp(ap->kv, bp->kv, ap->cnt*sizeof(ERL_NIF_TERM));
+}
+
+static void* shape_alloc(void* a)
+{
+    shape_t* ap = (shape_t*) a;
+    shape_t* bp = enif_alloc(sizeof(shape_t));
+    ERL_NIF_TERM* tp = cnif_heap_alloc(ap->env, 1+ap->cnt);
+
+    if (tp == NULL) {
+	enif_free(bp);
+	return NULL;
+    }
+    tp[0] = MAKE_ARITYVAL(ap->cnt);
+    if (ap->cnt > 0)
+	memcpy(tp+1, ap->kv, ap->cnt*sizeof(ERL_NIF_TERM));
+    bp->keys = MAKE_TUPLE(tp);
+    bp->kv   = tp+1;
+    bp->cnt  = ap->cnt;
+    bp->env  = NULL;
+    return bp;
+}
+
+static void shape_free(void* a)
+{
+    enif_free(a);
+}
+
+static const lhash_methods_t shape_funcs =
+{
+    shape_hash,
+    shape_cmp,
+    shape_alloc,
+    shape_free
+};
+
+// keys tuple shared by all flatmaps in env with sorted unique keys,
+// 0 if some key is not an immediate
+ERL_NIF_TERM cnif_intern_keys(ErlNifEnv* env, const ERL_NIF_TERM keys[],
+			      unsigned cnt)
+{
+    shape_t templ;
+    shape_t* sp;
+    unsigned i;
+
+    for (i = 0; i < cnt; i++) {
+	if (IS_LIST(keys[i]) || IS_BOXED(keys[i]))
+	    return 0;
+    }
+    if (!env->shapes)
+	env->shapes = lhash_new("shapes", 3, &shape_funcs);
+    templ.kv  = keys;
+    templ.cnt = cnt;
+    templ.env = env;
+    if ((sp = lhash_put(env->shapes, &templ)) == NULL)
+	return INVALID_TERM;
+    return sp->keys;
 }
 
 void enif_free_env(ErlNifEnv* env)
 {
     enif_clear_env(env);
-    free(env);
+    enif_free(env);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -176,7 +538,8 @@ ERL_NIF_TERM enif_make_uint64(ErlNifEnv* env, uint64_t u)
     else {
 	ERL_NIF_TERM* ptr;
 	int ari = (u <= UINT64(0xffffffff)) ? 1 : 2;
-	ptr = cnif_heap_alloc(env, 1+ari);
+	if ((ptr = cnif_heap_alloc(env, 1+ari)) == NULL)
+	    return INVALID_TERM;
 	ptr[0] = MAKE_POS_BIGVAL(ari);
 	if (arg == 2)
 	    ptr[2] = (u >> 32);
@@ -191,7 +554,8 @@ ERL_NIF_TERM enif_make_uint64(ErlNifEnv* env, uint64_t u)
     else {
 	ERL_NIF_TERM* ptr;
 	int ari = 1;
-	ptr = cnif_heap_alloc(env, 1+ari);
+	if ((ptr = cnif_heap_alloc(env, 1+ari)) == NULL)
+	    return INVALID_TERM;
 	ptr[0] = MAKE_POS_BIGVAL(ari);
 	ptr[1] = u;
 	return MAKE_BIGNUM(ptr);
@@ -213,7 +577,7 @@ ERL_NIF_TERM enif_make_uint(ErlNifEnv* env, unsigned u)
 ERL_NIF_TERM enif_make_int64(ErlNifEnv* env, int64_t i)
 {
 #if WORDSIZE == 32
-    if ((i >= -(UINT64_C(1) << 27)) || (i < (UINT64_C(1) << 27))) {
+    if ((i >= -(INT64_C(1) << 27)) && (i < (INT64_C(1) << 27))) {
 	ERL_NIF_TERM  cell = i & UINT32_C(0x0fffffff);
 	return (cell << TAG_IMMED1_SIZE) | TAG_IMMED1_SMALL;
     }
@@ -222,7 +586,8 @@ ERL_NIF_TERM enif_make_int64(ErlNifEnv* env, int64_t i)
 	int sign = (i < 0) ? 1 : 0;
 	uint64_t u = (i < 0) ? -i : i;
 	int ari = (u <= UINT64(0xffffffff)) ? 1 : 2;
-	ptr = cnif_heap_alloc(env, 1+ari);
+	if ((ptr = cnif_heap_alloc(env, 1+ari)) == NULL)
+	    return INVALID_TERM;
 	ptr[0] = sign ? MAKE_NEG_BIGVAL(ari) : MAKE_POS_BIGVAL(ari);
 	if (arg == 2)
 	    ptr[2] = (u >> 32);
@@ -230,7 +595,7 @@ ERL_NIF_TERM enif_make_int64(ErlNifEnv* env, int64_t i)
 	return MAKE_BIGNUM(ptr);
     }
 #elif WORDSIZE == 64
-    if ((i >= -(UINT64_C(1) << 59)) && (i < (UINT64_C(1) << 59))) {
+    if ((i >= -(INT64_C(1) << 59)) && (i < (INT64_C(1) << 59))) {
 	ERL_NIF_TERM  cell = i & UINT64_C(0x0fffffffffffffff);
 	return (cell << TAG_IMMED1_SIZE) | TAG_IMMED1_SMALL;
     }
@@ -239,7 +604,8 @@ ERL_NIF_TERM enif_make_int64(ErlNifEnv* env, int64_t i)
 	int sign = (i < 0) ? 1 : 0;
 	uint64_t u = (i < 0) ? -i : i;
 	int ari = 1;
-	ptr = cnif_heap_alloc(env, 1+ari);
+	if ((ptr = cnif_heap_alloc(env, 1+ari)) == NULL)
+	    return INVALID_TERM;
 	ptr[0] = sign ? MAKE_NEG_BIGVAL(ari) : MAKE_POS_BIGVAL(ari);
 	ptr[1] = u;
 	return MAKE_BIGNUM(ptr);
@@ -407,6 +773,8 @@ ERL_NIF_TERM enif_make_double(ErlNifEnv* env, double d)
     int arity = sizeof(double)/sizeof(ERL_NIF_TERM);
     ERL_NIF_TERM* ptr = cnif_heap_alloc(env, 1+arity);
 
+    if (ptr == NULL)
+	return INVALID_TERM;
     ptr[0] = MAKE_FLOATVAL(arity);
     *((double*)(ptr+1)) = d;
     return MAKE_FLOAT(ptr);
@@ -667,6 +1035,10 @@ uint8_t* enif_make_new_binary(ErlNifEnv* env,size_t size,ERL_NIF_TERM* termp)
 {
     size_t hsize = NWORDS(size+sizeof(heap_binary_t));
     heap_binary_t* hbp = (heap_binary_t*) cnif_heap_alloc(env,hsize);
+    if (hbp == NULL) {
+	*termp = INVALID_TERM;
+	return NULL;
+    }
     hbp->header = MAKE_HEAP_BINVAL(hsize-1);
     hbp->size = size;
     *termp = MAKE_BINARY(hbp);
@@ -691,54 +1063,55 @@ ERL_NIF_TERM enif_make_binary(ErlNifEnv* env, ErlNifBinary* bin)
 }
 
 
-static int iolist_to_buf(ERL_NIF_TERM term,uint8_t* buf,int i,unsigned len)
+// copy iolist bytes into buf, nested lists are walked with an explicit stack
+static int iolist_to_buf(ERL_NIF_TERM term,uint8_t* buf,size_t len)
 {
-    while (IS_LIST(term)) {
-    	ERL_NIF_TERM* ptr = GET_LIST(term);
-	if (IS_SMALL(ptr[0])) {
-	    ERL_NIF_UINT val = (ptr[0] >> TAG_IMMED1_SIZE);
-	    if ((ptr[0] >> TAG_IMMED1_SIZE) > 255)
-		return -1;
-	    if (val > 255)
-		return -1;
-	    if (i >= len)
-		return -1;
-	    buf[i++] = val;
-	}
-	else if (IS_LIST(ptr[0])) {
-	    int n;
-	    if ((n = iolist_to_buf(ptr[0], buf, i, len)) < 0)
-		return -1;
-	    i += n;
-	}
-	else if (IS_BINARY(ptr[0])) {
-	    ErlNifBinary bin;
-	    if (!get_binary(ptr[0], &bin))
-		return -1;
-	    if (bin.size <= (len - i)) {
+    wstack_t stack;
+    ErlNifBinary bin;
+    size_t i = 0;
+
+    wstack_init(&stack);
+    while(1) {
+	while (IS_LIST(term)) {
+	    ERL_NIF_TERM* ptr = GET_LIST(term);
+	    ERL_NIF_TERM  hd  = ptr[0];
+	    term = ptr[1];
+	    PREFETCH(GET_PTR(term));
+	    if (IS_SMALL(hd)) {
+		ERL_NIF_UINT val = (hd >> TAG_IMMED1_SIZE);
+		if ((val > 255) || (i >= len))
+		    goto error;
+		buf[i++] = val;
+	    }
+	    else if (IS_LIST(hd)) {
+		wstack_push(&stack, term);
+		term = hd;
+	    }
+	    else if (hd == MAKE_NIL)
+		continue;
+	    else if (get_binary(hd, &bin) && (bin.size <= (len - i))) {
 		memcpy(buf+i, bin.data, bin.size);
 		i += bin.size;
 	    }
 	    else
-		return -1;
+		goto error;
 	}
-	else
-	    return -1;
-	term = ptr[1];
-    }
-    if (IS_BINARY(term)) {
-	ErlNifBinary bin;
-	if (!get_binary(term, &bin))
-	    return -1;
-	if (bin.size <= (len - i)) {
-	    memcpy(buf, bin.data, bin.size);
+	if (get_binary(term, &bin)) {
+	    if (bin.size > (len - i))
+		goto error;
+	    memcpy(buf+i, bin.data, bin.size);
 	    i += bin.size;
-	    return i+bin.size;
 	}
-	return -1;
+	else if (term != MAKE_NIL)
+	    goto error;
+	if (wstack_is_empty(&stack))
+	    break;
+	term = wstack_pop(&stack);
     }
-    else if (term == MAKE_NIL)
-	return i;
+    wstack_free(&stack);
+    return i;
+error:
+    wstack_free(&stack);
     return -1;
 }
 
@@ -749,7 +1122,7 @@ int enif_inspect_iolist_as_binary(ErlNifEnv* env, ERL_NIF_TERM term, ErlNifBinar
 	return 0;
     if (!enif_alloc_binary(len, bin))
 	return 0;
-    if (iolist_to_buf(term, bin->data, 0, bin->size) < 0) {
+    if (iolist_to_buf(term, bin->data, bin->size) < 0) {
 	enif_release_binary(bin);
 	return 0;
     }
@@ -760,49 +1133,36 @@ ERL_NIF_TERM enif_make_sub_binary(ErlNifEnv* env, ERL_NIF_TERM term, size_t pos,
 {
     if (IS_BINARY(term)) {
 	ERL_NIF_TERM* ptr = GET_BINARY(term);
-	ERL_NIF_TERM  offs = 0;
-	ERL_NIF_TERM  size = 0;
+	size_t        offs = pos;
+	size_t        orig_size;
 	size_t        n;
 	sub_binary_t* sbp;
-	int           is_sub = 0;
 
 	if (IS_SUB_BIN(ptr[0])) {
+	    // refer to the original binary, not to the sub binary
 	    sbp = (sub_binary_t*) ptr;
-	    is_sub = 1;
-	    size = sbp->size;
-	    term = sbp->orig;
-	    offs = sbp->offs;
-	    ptr = GET_BINARY(sbp->orig);
-	}
-	offs += pos;
-	if (IS_HEAP_BIN(ptr[0])) {
-	    heap_binary_t* hbp = (heap_binary_t*) ptr;
-	    if (hbp->size < size+offs)
+	    if (sbp->size < pos+size)
 		return INVALID_TERM;
-	    n = NWORDS(sizeof(sub_binary_t));
-	    sbp = (sub_binary_t*) cnif_heap_alloc(env,n);
-	    sbp->header = MAKE_SUB_BINVAL(n-1);
-	    sbp->size = size;
-	    sbp->offs = offs+pos;
-	    sbp->bitsize = 0;
-	    sbp->bitoffs = 0;
-	    sbp->is_writable = 0;
-	    sbp->orig = term;
-	}
-	else {
-	    refc_binary_t* rbp = (refc_binary_t*) ptr;
-	    if (rbp->size < size+offs)
-		return 0;
-	    n = NWORDS(sizeof(refc_binary_t));
-	    sbp = (sub_binary_t*) cnif_heap_alloc(env,n);
-	    sbp->header = MAKE_SUB_BINVAL(n-1);
-	    sbp->size = size;
-	    sbp->offs = offs+pos;
-	    sbp->bitsize = 0;
-	    sbp->bitoffs = 0;
-	    sbp->is_writable = 0;
-	    sbp->orig = term;
+	    offs += sbp->offs;
+	    term = sbp->orig;
+	    ptr = GET_BINARY(term);
 	}
+	if (IS_HEAP_BIN(ptr[0]))
+	    orig_size = ((heap_binary_t*) ptr)->size;
+	else
+	    orig_size = ((refc_binary_t*) ptr)->size;
+	if (orig_size < offs+size)
+	    return INVALID_TERM;
+	n = NWORDS(sizeof(sub_binary_t));
+	if ((sbp = (sub_binary_t*) cnif_heap_alloc(env,n)) == NULL)
+	    return INVALID_TERM;
+	sbp->header = MAKE_SUB_BINVAL(n-1);
+	sbp->size = size;
+	sbp->offs = offs;
+	sbp->bitsize = 0;
+	sbp->bitoffs = 0;
+	sbp->is_writable = 0;
+	sbp->orig = term;
 	return MAKE_BINARY(sbp);
     }
     return INVALID_TERM;
@@ -823,6 +1183,8 @@ ERL_NIF_TERM enif_make_list_from_array(ErlNifEnv* env, const ERL_NIF_TERM arr[],
     else {
 	ERL_NIF_TERM* ptr = cnif_heap_alloc(env, 2*cnt);
 	int i, j;
+	if (ptr == NULL)
+	    return INVALID_TERM;
 	for (i = 0, j = 0; i < (int)cnt; i++, j += 2) {
 	    ptr[j] =  arr[i];
 	    ptr[j+1] = MAKE_LIST(&ptr[j+2]);
@@ -844,6 +1206,8 @@ ERL_NIF_TERM enif_make_list(ErlNifEnv* env, unsigned cnt, ...)
     else {
 	ERL_NIF_TERM* ptr = cnif_heap_alloc(env, 2*cnt);
 	int i,j;
+	if (ptr == NULL)
+	    return INVALID_TERM;
 	va_start(ap, cnt);
 	for (i = 0, j = 0; i < (int) cnt; i++, j += 2) {
 	    ptr[j] = va_arg(ap, ERL_NIF_TERM);
@@ -860,6 +1224,8 @@ ERL_NIF_TERM enif_make_list_cell(ErlNifEnv* env, ERL_NIF_TERM car, ERL_NIF_TERM
 {
     ERL_NIF_TERM* ptr = cnif_heap_alloc(env, 2);
     ERL_NIF_TERM cell;
+    if (ptr == NULL)
+	return INVALID_TERM;
     ptr[0] = car;
     ptr[1] = cdr;
     cell = MAKE_LIST(ptr);
@@ -896,6 +1262,8 @@ ERL_NIF_TERM enif_make_string_len(ErlNifEnv* env, const char* string, size_t len
     else {
 	ERL_NIF_TERM* ptr = cnif_heap_alloc(env, 2*len);
 	int i, j;
+	if (ptr == NULL)
+	    return INVALID_TERM;
 	for (i = 0, j = 0; i < (int)len; i++, j += 2) {
 	    ptr[j] =  MAKE_SMALL(string[i]);
 	    ptr[j+1] = MAKE_LIST(&ptr[j+2]);
@@ -908,19 +1276,22 @@ ERL_NIF_TERM enif_make_string_len(ErlNifEnv* env, const char* string, size_t len
 
 int enif_get_string(ErlNifEnv* env, ERL_NIF_TERM list, char* buf, unsigned len, ErlNifCharEncoding code)
 {
-    int i = 0;
+    unsigned i = 0;
 
+    if (len == 0)
+	return 0;
     while(IS_LIST(list)) {
 	ERL_NIF_TERM* ptr = GET_LIST(list);
-	if (IS_SMALL(ptr[0])) {
-	    ERL_NIF_UINT val = (ptr[0] >> TAG_IMMED1_SIZE);
-	    if (val > 255)
-		return 0;
-	    if (i >= len)
-		return 0;
-	    buf[i++] = val;
-	}
+	ERL_NIF_UINT val;
 	list = ptr[1];
+	PREFETCH(GET_PTR(list));
+	if (!IS_SMALL(ptr[0]))
+	    return 0;
+	if ((val = (ptr[0] >> TAG_IMMED1_SIZE)) > 255)
+	    return 0;
+	if (i >= len-1)
+	    return 0;
+	buf[i++] = val;
     }
     if (list != MAKE_NIL)
 	return 0;
@@ -940,6 +1311,12 @@ int enif_get_list_length(ErlNifEnv* env, ERL_NIF_TERM term, unsigned* len)
     while(IS_LIST(term)) {
 	ERL_NIF_TERM* ptr = GET_LIST(term);
 	n++;
+	// cells laid out back to back by the list builders are stepped
+	// over by address arithmetic, no load of the tail on the critical path
+	while(ptr[1] == MAKE_LIST(ptr+2)) {
+	    ptr += 2;
+	    n++;
+	}
 	term = ptr[1];
     }
     *len = n;  // always store len even when not pure
@@ -960,12 +1337,20 @@ int enif_make_reverse_list(ErlNifEnv* env, ERL_NIF_TERM term, ERL_NIF_TERM *list
     else {
 	ERL_NIF_TERM* ptr = cnif_heap_alloc(env, 2*cnt);
 	ERL_NIF_TERM* lptr = GET_LIST(term);
-	int i, j;
+	ERL_NIF_TERM* dst = ptr + 2*cnt;
 
-	for (i = 0,j = 2*cnt-2; i < (int)cnt; i++, j -= 2) {
-	    ptr[j] = lptr[0];
-	    ptr[j+1] = MAKE_LIST(&ptr[j+2]);
-	    lptr = GET_LIST(lptr[1]);
+	if (ptr == NULL)
+	    return 0;
+	// build from the end, the new cells are contiguous as well
+	while(dst > ptr) {
+	    ERL_NIF_TERM next = lptr[1];
+	    dst -= 2;
+	    dst[0] = lptr[0];
+	    dst[1] = MAKE_LIST(dst+2);
+	    if (next == MAKE_LIST(lptr+2))
+		lptr += 2;
+	    else
+		lptr = GET_LIST(next);
 	}
 	ptr[2*cnt-1] = MAKE_NIL;
 	*list = MAKE_LIST(ptr);
@@ -995,20 +1380,6 @@ static void insert_value(ERL_NIF_TERM* dst, int i, ERL_NIF_TERM* src,
 	dst[j] = src[j-1];
 }
 
-static ERL_NIF_TERM insert_element(ErlNifEnv* env, int i, ERL_NIF_TERM tpl,
-				   ERL_NIF_TERM value)
-{
-    if (IS_TUPLE(tpl)) {
-	ERL_NIF_TERM* src = GET_BOXED(tpl);
-	size_t n = GET_ARITYVAL(src[0]);
-	ERL_NIF_TERM* dst = cnif_heap_alloc(env, 1+n+1);
-	dst[0] = MAKE_ARITYVAL(n+1);
-	insert_value(dst+1, i-1, src+1, n, value);
-	return MAKE_TUPLE(dst);
-    }
-    return INVALID_TERM;
-}
-
 static void delete_value(ERL_NIF_TERM* dst, int i, ERL_NIF_TERM* src, size_t n)
 {
     int j;
@@ -1018,26 +1389,14 @@ static void delete_value(ERL_NIF_TERM* dst, int i, ERL_NIF_TERM* src, size_t n)
 	dst[j-1] = src[j];
 }
 
-static ERL_NIF_TERM delete_element(ErlNifEnv* env, int i, ERL_NIF_TERM tpl)
-{
-    if (IS_TUPLE(tpl)) {
-	ERL_NIF_TERM* src = GET_BOXED(tpl);
-	size_t n = GET_ARITYVAL(src[0]);
-	ERL_NIF_TERM* dst = cnif_heap_alloc(env, 1+n-1);
-	int j;
-	dst[0] = MAKE_ARITYVAL(n-1);
-	delete_value(dst+1, i-1, src+1, n);
-	return MAKE_TUPLE(dst);
-    }
-    return INVALID_TERM;
-}
-
 ERL_NIF_TERM enif_make_tuple(ErlNifEnv* env, unsigned cnt, ...)
 {
     va_list ap;
     ERL_NIF_TERM* ptr = cnif_heap_alloc(env, 1+cnt);
     int i;
 
+    if (ptr == NULL)
+	return INVALID_TERM;
     ptr[0] = MAKE_ARITYVAL(cnt);
     va_start(ap, cnt);
     for (i = 0; i < (int) cnt; i++)
@@ -1051,6 +1410,8 @@ ERL_NIF_TERM enif_make_tuple_from_array(ErlNifEnv* env, const ERL_NIF_TERM arr[]
     ERL_NIF_TERM* ptr = cnif_heap_alloc(env, 1+cnt);
     int i;
 
+    if (ptr == NULL)
+	return INVALID_TERM;
     ptr[0] = MAKE_ARITYVAL(cnt);
     for (i = 0; i < (int) cnt; i++)
 	ptr[i+1] = arr[i];
@@ -1089,25 +1450,20 @@ int enif_get_map_size (ErlNifEnv* env, ERL_NIF_TERM term, size_t *size)
 
 ERL_NIF_TERM enif_make_new_map(ErlNifEnv* env)
 {
-    size_t n = NWORDS(sizeof(flatmap_t));
-    flatmap_t* mp = (flatmap_t*) cnif_heap_alloc(env,n);
-    mp->header = MAKE_MAPVAL(n-1);
-    mp->size = 0;
-    mp->keys = enif_make_tuple0(env);
-    return MAKE_MAP(mp);
+    return cnif_make_flatmap(env, NULL, NULL, 0);
 }
 
 static int key_index(int low, int high, int* index,
 		     ERL_NIF_TERM key, const ERL_NIF_TERM* keys)
 {
-    int mid = 0;
+    int mid;
     while(low <= high) {
 	int r;
 	ERL_NIF_TERM key1;
 	mid = (high+low)/2;
 	key1 = keys[mid-1];
 
-	if ((r = enif_compare(key, key1)) < 0)
+	if ((r = cnif_map_key_compare(key, key1)) < 0)
 	    high = mid-1;
 	else if (r > 0)
 	    low = mid+1;
@@ -1115,11 +1471,41 @@ static int key_index(int low, int high, int* index,
 	    *index = mid;
 	    return 1;
 	}
-    } while(low <= high);
-    *index = mid;
+    }
+    *index = low;  // insert position
     return 0;
 }
 
+// flatmap at the size limit plus a new key becomes a hashmap
+static ERL_NIF_TERM flatmap_grow(ErlNifEnv* env, flatmap_t* mp,
+				 ERL_NIF_TERM key, ERL_NIF_TERM value)
+{
+    ERL_NIF_TERM keys[MAP_SMALL_MAP_LIMIT+1];
+    ERL_NIF_TERM values[MAP_SMALL_MAP_LIMIT+1];
+    ERL_NIF_UINT n = mp->size;
+
+    memcpy(keys, GET_TUPLE(mp->keys)+1, n*sizeof(ERL_NIF_TERM));
+    memcpy(values, mp->value, n*sizeof(ERL_NIF_TERM));
+    keys[n] = key;
+    values[n] = value;
+    return cnif_hashmap_from_arrays(env, keys, values, n+1);
+}
+
+// hashmap shrunk down to the size limit becomes a flatmap
+static ERL_NIF_TERM hashmap_shrink(ErlNifEnv* env, ERL_NIF_TERM map)
+{
+    ERL_NIF_TERM* keys;
+    ERL_NIF_TERM* values;
+    ERL_NIF_UINT cnt = ((hashmap_t*) GET_MAP(map))->size;
+    void* buf;
+
+    if (!cnif_map_sorted_arrays(map, &keys, &values, &buf))
+	return INVALID_TERM;
+    map = cnif_make_flatmap(env, keys, values, cnt);
+    enif_free(buf);
+    return map;
+}
+
 int enif_get_map_value(ErlNifEnv* env, ERL_NIF_TERM map, ERL_NIF_TERM key, ERL_NIF_TERM* value)
 {
     if (IS_MAP(map)) {
@@ -1127,6 +1513,8 @@ int enif_get_map_value(ErlNifEnv* env, ERL_NIF_TERM map, ERL_NIF_TERM key, ERL_N
 	const ERL_NIF_TERM* keys;
 	int arity;
 	int i;
+	if (IS_HASHMAP_PTR(mp))
+	    return cnif_hashmap_get(map, key, value);
 	enif_get_tuple(env, mp->keys, &arity, &keys);
 	if (!key_index(1, arity, &i, key, keys))
 	    return 0;
@@ -1146,10 +1534,13 @@ int enif_make_map_update(ErlNifEnv* env, ERL_NIF_TERM map_in, ERL_NIF_TERM key,
 	int arity;
 	int cnt = mp_in->size;
 	int i;
+	if (IS_HASHMAP_PTR(mp_in))
+	    return cnif_hashmap_put(env, map_in, key, value, 1, map_out);
 	enif_get_tuple(env, mp_in->keys, &arity, &keys);
 	if (!key_index(1, arity, &i, key, keys))
 	    return 0;
-	mp_out =  (flatmap_t*) cnif_heap_alloc(env, n+cnt);
+	if ((mp_out = (flatmap_t*) cnif_heap_alloc(env, n+cnt)) == NULL)
+	    return 0;
 	*mp_out = *mp_in;
 	memcpy(mp_out->value, mp_in->value, cnt*sizeof(ERL_NIF_TERM));
 	mp_out->value[i-1] = value;  // new value
@@ -1169,18 +1560,26 @@ int enif_make_map_put(ErlNifEnv* env, ERL_NIF_TERM map_in, ERL_NIF_TERM key, ERL
 	int arity;
 	int cnt = mp_in->size;
 	int i;
+	if (IS_HASHMAP_PTR(mp_in))
+	    return cnif_hashmap_put(env, map_in, key, value, 0, map_out);
 	enif_get_tuple(env, mp_in->keys, &arity, &keys);
 	if (!key_index(1, arity, &i, key, keys)) {
-	    mp_out =  (flatmap_t*) cnif_heap_alloc(env, n+cnt+1);
-	    mp_out->header = MAKE_MAPVAL(n+cnt);
-	    mp_out->size = cnt+1;
-	    mp_out->keys = insert_element(env, i, mp_in->keys, key);
-	    insert_value(mp_out->value,i-1,mp_in->value,cnt,value);
-	    *map_out = MAKE_MAP(mp_out);
-	    return 1;
+	    if (cnt >= MAP_SMALL_MAP_LIMIT) {
+		*map_out = flatmap_grow(env, mp_in, key, value);
+		return (*map_out != INVALID_TERM);
+	    }
+	    else {
+		ERL_NIF_TERM kbuf[MAP_SMALL_MAP_LIMIT];
+		ERL_NIF_TERM vbuf[MAP_SMALL_MAP_LIMIT];
+		insert_value(kbuf,i-1,(ERL_NIF_TERM*)keys,cnt,key);
+		insert_value(vbuf,i-1,mp_in->value,cnt,value);
+		*map_out = cnif_make_flatmap(env, kbuf, vbuf, cnt+1);
+		return (*map_out != INVALID_TERM);
+	    }
 	}
 	else {
-	    mp_out =  (flatmap_t*) cnif_heap_alloc(env, n+cnt);
+	    if ((mp_out = (flatmap_t*) cnif_heap_alloc(env, n+cnt)) == NULL)
+		return 0;
 	    *mp_out = *mp_in;
 	    memcpy(mp_out->value,mp_in->value,cnt*sizeof(ERL_NIF_TERM));
 	    mp_out->value[i-1] = value;  // new value
@@ -1195,22 +1594,26 @@ int enif_make_map_remove (ErlNifEnv* env, ERL_NIF_TERM map_in, ERL_NIF_TERM key,
 {
     if (IS_MAP(map_in)) {
 	flatmap_t* mp_in = (flatmap_t*) GET_MAP(map_in);
-	flatmap_t* mp_out;
 	const ERL_NIF_TERM* keys;
-	size_t n = NWORDS(sizeof(flatmap_t));
 	int arity;
 	int cnt = mp_in->size;
-	int i, j;
+	int i;
+	ERL_NIF_TERM kbuf[MAP_SMALL_MAP_LIMIT];
+	ERL_NIF_TERM vbuf[MAP_SMALL_MAP_LIMIT];
+	if (IS_HASHMAP_PTR(mp_in)) {
+	    if (!cnif_hashmap_remove(env, map_in, key, map_out))
+		return 0;
+	    if (cnt-1 <= MAP_SMALL_MAP_LIMIT)
+		*map_out = hashmap_shrink(env, *map_out);
+	    return (*map_out != INVALID_TERM);
+	}
 	enif_get_tuple(env, mp_in->keys, &arity, &keys);
 	if (!key_index(1, arity, &i, key, keys))
 	    return 0;
-	mp_out =  (flatmap_t*) cnif_heap_alloc(env, n+cnt);
-	mp_out->header = MAKE_MAPVAL(n+cnt-1-1);
-	mp_out->size = cnt-1;
-	mp_out->keys = delete_element(env, i, mp_in->keys);
-	delete_value(mp_out->value, i-1, mp_in->value, cnt);
-	*map_out = MAKE_MAP(mp_out);
-	return 1;
+	delete_value(kbuf, i-1, (ERL_NIF_TERM*)keys, cnt);
+	delete_value(vbuf, i-1, mp_in->value, cnt);
+	*map_out = cnif_make_flatmap(env, kbuf, vbuf, cnt-1);
+	return (*map_out != INVALID_TERM);
     }
     return 0;
 }
@@ -1219,27 +1622,30 @@ int enif_map_iterator_create (ErlNifEnv *env, ERL_NIF_TERM map, ErlNifMapIterato
 {
     if (IS_MAP(map)) {
 	flatmap_t* mp = (flatmap_t*) GET_MAP(map);
-	if (entry == ERL_NIF_MAP_ITERATOR_FIRST) {
-	    iter->map  = map;
-	    iter->size = mp->size;
-	    iter->idx  = 0;
-	    return 1;
-	}
-	else if (entry == ERL_NIF_MAP_ITERATOR_LAST) {
-	    iter->map  = map;
-	    iter->size = mp->size;
-	    iter->idx  = mp->size+1;
-	    return 1;
-	}
+	if ((entry != ERL_NIF_MAP_ITERATOR_FIRST) &&
+	    (entry != ERL_NIF_MAP_ITERATOR_LAST))
+	    return 0;
+	if (!cnif_map_sorted_arrays(map, &iter->keys, &iter->values,
+				    &iter->buf))
+	    return 0;
+	iter->map  = map;
+	iter->size = mp->size;
+	iter->idx  = (entry == ERL_NIF_MAP_ITERATOR_FIRST) ? 0 : mp->size+1;
+	return 1;
     }
     return 0;
 }
 
 void enif_map_iterator_destroy (ErlNifEnv *env, ErlNifMapIterator *iter)
 {
+    if (iter->buf)
+	enif_free(iter->buf);
     iter->map  = 0;
     iter->size = 0;
     iter->idx  = 0;
+    iter->keys = NULL;
+    iter->values = NULL;
+    iter->buf  = NULL;
 }
 
 int enif_map_iterator_is_head (ErlNifEnv *env, ErlNifMapIterator *iter)
@@ -1280,15 +1686,11 @@ int enif_map_iterator_prev(ErlNifEnv *env, ErlNifMapIterator *iter)
 
 int enif_map_iterator_get_pair(ErlNifEnv *env, ErlNifMapIterator *iter, ERL_NIF_TERM *key, ERL_NIF_TERM *value)
 {
-    flatmap_t* mp = (flatmap_t*) GET_MAP(iter->map);
-    const ERL_NIF_TERM* keys;
-    int arity;
     ERL_NIF_UINT i;
 
-    enif_get_tuple(env, mp->keys, &arity, &keys);
-    if (((i = iter->idx) >= 1) && (i <= mp->size)) {
-	*key = keys[i-1];
-	*value = mp->value[i-1];
+    if (((i = iter->idx) >= 1) && (i <= iter->size)) {
+	*key = iter->keys[i-1];
+	*value = iter->values[i-1];
 	return 1;
     }
     return 0;
@@ -1305,7 +1707,7 @@ static int compare_integer(ERL_NIF_TERM lhs, ERL_NIF_TERM rhs)
     int64_t li, ri;
     get_int64(lhs, &li);
     get_int64(rhs, &ri);
-    return li - ri;
+    return (li < ri) ? -1 : (li > ri);
 }
 
 static int compare_float(ERL_NIF_TERM lhs, ERL_NIF_TERM rhs)
@@ -1331,115 +1733,222 @@ static int compare_integer_float(ERL_NIF_TERM lhs, ERL_NIF_TERM rhs, int exact)
     return 0;
 }
 
-static int compare_atom(ERL_NIF_TERM lhs, ERL_NIF_TERM rhs)
+static int compare_bytes(const uint8_t* lptr, size_t llen,
+			 const uint8_t* rptr, size_t rlen)
 {
-    atom_t* lptr;
-    atom_t* rptr;
-    size_t  n;
-    size_t  i;
     int r;
-    lptr = GET_ATOM(lhs);
-    rptr = GET_ATOM(rhs);
-    n = (lptr->len < rptr->len) ? lptr->len : rptr->len;
-    for (i = 0; i < n; i++) {
-	if ((r = (lptr->name[i] - rptr->name[i])) != 0)
-	    return r;
-    }
-    return lptr->len - rptr->len;
+    if ((r = memcmp(lptr, rptr, (llen < rlen) ? llen : rlen)) != 0)
+	return r;
+    return (llen < rlen) ? -1 : (llen > rlen);
+}
+
+static int compare_atom(ERL_NIF_TERM lhs, ERL_NIF_TERM rhs)
+{
+    atom_t* lptr = GET_ATOM(lhs);
+    atom_t* rptr = GET_ATOM(rhs);
+    return compare_bytes((uint8_t*) lptr->name, lptr->len,
+			 (uint8_t*) rptr->name, rptr->len);
 }
 
 static int compare_binary(ERL_NIF_TERM lhs, ERL_NIF_TERM rhs)
 {
     ErlNifBinary lb, rb;
-    size_t n;
-    size_t i;
-    int r;
 
     get_binary(lhs, &lb);
     get_binary(rhs, &rb);
-
-    n = (lb.size < rb.size) ? lb.size : rb.size;
-    for (i = 0; i < n; i++) {
-	if ((r = (lb.data[i] - rb.data[i])) != 0)
-	    return r;
-    }
-    return lb.size - rb.size;
+    if (lb.data == rb.data)  // same bytes, a sub binary prefix or equal
+	return (lb.size < rb.size) ? -1 : (lb.size > rb.size);
+    return compare_bytes(lb.data, lb.size, rb.data, rb.size);
 }
 
+// Pending work is kept on a stack of (lptr, rptr, n<<1|exact) entries,
+// compare the n terms at lptr with the n terms at rptr. Tuple elements,
+// list tails and map keys/values are pushed as one entry each so the
+// stack only grows with the nesting depth. Map keys always compare exact.
+
+#define CMP_PUSH(s, lp, rp, n, ex) do {			\
+	wstack_push((s), (ERL_NIF_TERM) (lp));		\
+	wstack_push((s), (ERL_NIF_TERM) (rp));		\
+	wstack_push((s), ((ERL_NIF_TERM) (n) << 1) | (ex));	\
+    } while(0)
+
 static int compare(ERL_NIF_TERM lhs, ERL_NIF_TERM rhs, int exact)
 {
+    wstack_t stack;
+    wstack_t bufs;     // sorted hashmap arrays to free
+    int r = 0;
+
     if (lhs == rhs)
 	return 0;
-    else {
-	enif_type_t lt = enif_get_type(lhs, 0);
-	enif_type_t rt = enif_get_type(rhs, 0);
-
+    wstack_init(&stack);
+    wstack_init(&bufs);
+    while(1) {
+	enif_type_t lt, rt;
+
+	if (lhs == rhs)  // equal immediates or shared subterm
+	    goto next;
+	if (IS_SMALL(lhs) && IS_SMALL(rhs)) {
+	    r = ((ERL_NIF_INT) lhs < (ERL_NIF_INT) rhs) ? -1 : 1;
+	    break;
+	}
+	if (IS_ATOM(lhs) && IS_ATOM(rhs)) {
+	    if ((r = compare_atom(lhs, rhs)) != 0)
+		break;
+	    goto next;
+	}
+	lt = enif_get_type(lhs, 0);
+	rt = enif_get_type(rhs, 0);
 	if ((lt <= ENIF_TYPE_NUMBER) && (rt <= ENIF_TYPE_NUMBER)) {
-	    if (lt == ENIF_TYPE_INTEGER) {
+	    // exact order puts all integers before floats (map key order)
+	    if (exact && (lt != rt))
+		r = (lt == ENIF_TYPE_INTEGER) ? -1 : 1;
+	    else if (lt == ENIF_TYPE_INTEGER) {
 		if (rt == ENIF_TYPE_INTEGER)
-		    return compare_integer(lhs, rhs);
+		    r = compare_integer(lhs, rhs);
 		else
-		    return compare_integer_float(lhs, rhs, exact);
+		    r = compare_integer_float(lhs, rhs, exact);
 	    }
 	    else {
 		if (rt == ENIF_TYPE_FLOAT)
-		    return compare_float(lhs, rhs);
+		    r = compare_float(lhs, rhs);
 		else
-		    return -compare_integer_float(rhs, lhs, exact);
+		    r = -compare_integer_float(rhs, lhs, exact);
 	    }
+	    if (r != 0)
+		break;
+	    goto next;
+	}
+	if (lt != rt) {
+	    r = (lt < rt) ? -1 : 1;
+	    break;
 	}
-	if (lt != rt)
-	    return lt - rt;
 	switch(lt) {
 	case ENIF_TYPE_ATOM:
-	    return compare_atom(lhs, rhs);
+	    if ((r = compare_atom(lhs, rhs)) != 0)
+		goto done;
+	    break;
 	case ENIF_TYPE_TUPLE: {
 	    ERL_NIF_TERM* lptr = GET_TUPLE(lhs);
 	    ERL_NIF_TERM* rptr = GET_TUPLE(rhs);
-	    int lari = GET_ARITYVAL(lptr[0]);
-	    int rari = GET_ARITYVAL(rptr[0]);
-	    int i;
-	    if (lari != rari)
-		return lari - rari;
-	    for (i = 1; i <= lari; i++) {
-		int r;
-		if ((r = compare(lptr[i], rptr[i], exact)) != 0)
-		    return r;
+	    ERL_NIF_UINT lari = GET_ARITYVAL(lptr[0]);
+	    ERL_NIF_UINT rari = GET_ARITYVAL(rptr[0]);
+	    if (lari != rari) {
+		r = (lari < rari) ? -1 : 1;
+		goto done;
 	    }
-	    return 0;
+	    // skip the equal prefix, push the rest after the first difference
+	    for (lptr++, rptr++; (lari > 0) && (*lptr == *rptr); lari--) {
+		lptr++; rptr++;
+	    }
+	    if (lari == 0)
+		break;
+	    if (lari > 1)
+		CMP_PUSH(&stack, lptr+1, rptr+1, lari-1, exact);
+	    lhs = *lptr;
+	    rhs = *rptr;
+	    continue;
+	}
+	case ENIF_TYPE_MAP: {
+	    flatmap_t* lmp = (flatmap_t*) GET_MAP(lhs);
+	    flatmap_t* rmp = (flatmap_t*) GET_MAP(rhs);
+	    ERL_NIF_TERM *lkeys, *lvalues, *rkeys, *rvalues;
+	    void* buf;
+	    ERL_NIF_UINT n = lmp->size;
+
+	    // size, then keys in map key order and then values
+	    if (lmp->size != rmp->size) {
+		r = (lmp->size < rmp->size) ? -1 : 1;
+		goto done;
+	    }
+	    if (n == 0)
+		break;
+	    if (IS_HASHMAP_PTR(lmp) && IS_HASHMAP_PTR(rmp) &&
+		(((hashmap_t*) lmp)->root == ((hashmap_t*) rmp)->root))
+		break;
+	    if (!IS_HASHMAP_PTR(lmp) && (lmp->keys == rmp->keys)) {
+		// same shape, only values differ
+		CMP_PUSH(&stack, lmp->value, rmp->value, n, exact);
+		break;
+	    }
+	    if (!cnif_map_sorted_arrays(lhs, &lkeys, &lvalues, &buf))
+		goto no_memory;
+	    if (buf)
+		wstack_push(&bufs, (ERL_NIF_TERM) buf);
+	    if (!cnif_map_sorted_arrays(rhs, &rkeys, &rvalues, &buf))
+		goto no_memory;
+	    if (buf)
+		wstack_push(&bufs, (ERL_NIF_TERM) buf);
+	    CMP_PUSH(&stack, lvalues, rvalues, n, exact);
+	    CMP_PUSH(&stack, lkeys, rkeys, n, 1);
+	    break;
 	}
-	case ENIF_TYPE_MAP:
-	    return 1;
 	case ENIF_TYPE_NIL:
-	    return 0;
+	    break;
 	case ENIF_TYPE_LIST: {
 	    ERL_NIF_TERM* lptr = GET_LIST(lhs);
 	    ERL_NIF_TERM* rptr = GET_LIST(rhs);
-	    int r;
-	    
-	    while((r = compare(lptr[0], rptr[0], exact)) == 0) {
-		if ((lptr[1] == MAKE_NIL) && (rptr[1] == MAKE_NIL))
-		    return 0;
-		if (IS_LIST(lptr[1]) && IS_LIST(rptr[1])) {
-		    lptr = GET_LIST(lptr[1]);
-		    rptr = GET_LIST(rptr[1]);
-		}
-		else {
-		    if (lptr[1] == MAKE_NIL)
-			return -1;
-		    if (rptr[1] == MAKE_NIL)
-			return 1;
-		    return compare(lptr[1], rptr[1], exact);
-		}
+	    // skip equal heads in place, descend into the first that differs
+	    // with the tails pushed, nil sorts before a list tail
+	    while(lptr[0] == rptr[0]) {
+		lhs = lptr[1];
+		rhs = rptr[1];
+		if ((lhs == rhs) || !IS_LIST(lhs) || !IS_LIST(rhs))
+		    break;
+		lptr = GET_LIST(lhs);
+		rptr = GET_LIST(rhs);
 	    }
-	    return r;
+	    if (lptr[0] != rptr[0]) {
+		if (lptr[1] != rptr[1])
+		    CMP_PUSH(&stack, lptr+1, rptr+1, 1, exact);
+		lhs = lptr[0];
+		rhs = rptr[0];
+	    }
+	    continue;
 	}
 	case ENIF_TYPE_BINARY:
-	    return compare_binary(lhs, rhs);
+	    if ((r = compare_binary(lhs, rhs)) != 0)
+		goto done;
+	    break;
 	default:
-	    return 1;
+	    r = 1;
+	    goto done;
+	}
+    next:
+	while(1) {
+	    ERL_NIF_TERM* lptr;
+	    ERL_NIF_TERM* rptr;
+	    ERL_NIF_TERM n;
+
+	    if (wstack_is_empty(&stack))
+		goto done;
+	    n = wstack_pop(&stack);
+	    rptr = (ERL_NIF_TERM*) wstack_pop(&stack);
+	    lptr = (ERL_NIF_TERM*) wstack_pop(&stack);
+	    exact = n & 1;
+	    n >>= 1;
+	    while((n > 0) && (*lptr == *rptr)) {
+		lptr++; rptr++; n--;
+	    }
+	    if (n == 0)
+		continue;
+	    if (n > 1)
+		CMP_PUSH(&stack, lptr+1, rptr+1, n-1, exact);
+	    lhs = *lptr;
+	    rhs = *rptr;
+	    break;
 	}
     }
+    goto done;
+no_memory:
+    // the key order of the maps is unknown, keep the order total by
+    // falling back to their addresses
+    r = (lhs < rhs) ? -1 : 1;
+done:
+    while(!wstack_is_empty(&bufs))
+	enif_free((void*) wstack_pop(&bufs));
+    wstack_free(&bufs);
+    wstack_free(&stack);
+    return r;
 }
 
 int enif_compare(ERL_NIF_TERM lhs, ERL_NIF_TERM rhs)
@@ -1451,3 +1960,9 @@ int enif_is_identical(ERL_NIF_TERM lhs, ERL_NIF_TERM rhs)
 {
     return compare(lhs, rhs, 1) == 0;  // compare =:= 
 }
+
+// total order of map keys, as =:= but integers before floats
+int cnif_map_key_compare(ERL_NIF_TERM lhs, ERL_NIF_TERM rhs)
+{
+    return compare(lhs, rhs, 1);
+}
@@ -0,0 +1,335 @@
+//
+// Memory allocators
+//
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "../include/cnif.h"
+#include "../include/cnif_alloc.h"
+
+//
+// MALLOC
+//
+
+static void* malloc_alloc(void* arg, size_t size)
+{
+    return malloc(size);
+}
+
+static void* malloc_realloc(void* arg, void* ptr, size_t size)
+{
+    return realloc(ptr, size);
+}
+
+static void malloc_free(void* arg, void* ptr)
+{
+    free(ptr);
+}
+
+const cnif_allocator_t cnif_malloc_allocator =
+{
+    malloc_alloc,
+    malloc_realloc,
+    malloc_free,
+    NULL
+};
+
+//
+// CACHE - blocks are rounded up to size classes, four per power of two
+// from 32 bytes to 256K bytes. Freed blocks are kept on per thread free
+// lists and handed out again without locking. A block freed by another
+// thread than the one that allocated it lands in the freeing thread's
+// cache. Larger blocks go straight to malloc.
+//
+
+#define CACHE_MIN_SIZE   32
+#define CACHE_MAX_SIZE   (256*1024)
+#define CACHE_CLASSES    53
+#define CACHE_LARGE      CACHE_CLASSES
+#define CACHE_DEPTH      64                // blocks kept per class
+#define CACHE_MAX_BYTES  (4*1024*1024)     // bytes kept per thread
+
+typedef struct {  // in front of each block, 16 bytes keeps the alignment
+    size_t cls;
+    size_t size;  // usable bytes
+} block_t;
+
+typedef struct {
+    block_t* head[CACHE_CLASSES];  // next link is kept in the block data
+    unsigned count[CACHE_CLASSES];
+    size_t   bytes;
+    int      registered;
+} cache_t;
+
+static __thread cache_t cache;
+static pthread_key_t cache_key;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+static inline unsigned cache_class(size_t size)
+{
+    size_t s;
+    int b;
+
+    if (size <= CACHE_MIN_SIZE)
+	return 0;
+    s = size - 1;
+    b = 63 - __builtin_clzl(s);
+    return (b-5)*4 + ((s >> (b-2)) & 3) + 1;
+}
+
+static inline size_t class_size(unsigned c)
+{
+    if (c == 0)
+	return CACHE_MIN_SIZE;
+    c--;
+    return (size_t)(4 + (c & 3) + 1) << (5 + (c >> 2) - 2);
+}
+
+static void cache_release(cache_t* cp)
+{
+    unsigned c;
+
+    for (c = 0; c < CACHE_CLASSES; c++) {
+	while(cp->head[c] != NULL) {
+	    block_t* bp = cp->head[c];
+	    cp->head[c] = *(block_t**)(bp+1);
+	    free(bp);
+	}
+	cp->count[c] = 0;
+    }
+    cp->bytes = 0;
+}
+
+// release the cached blocks when the thread exits
+static void cache_destroy(void* arg)
+{
+    cache_release((cache_t*) arg);
+}
+
+static void cache_key_init(void)
+{
+    pthread_key_create(&cache_key, cache_destroy);
+}
+
+static void cache_register(void)
+{
+    pthread_once(&cache_once, cache_key_init);
+    pthread_setspecific(cache_key, &cache);
+    cache.registered = 1;
+}
+
+static void* cache_alloc(void* arg, size_t size)
+{
+    block_t* bp;
+    unsigned c;
+
+    if (size > CACHE_MAX_SIZE) {
+	if ((bp = malloc(sizeof(block_t)+size)) == NULL)
+	    return NULL;
+	bp->cls  = CACHE_LARGE;
+	bp->size = size;
+	return bp+1;
+    }
+    c = cache_class(size);
+    if ((bp = cache.head[c]) != NULL) {
+	cache.head[c] = *(block_t**)(bp+1);
+	cache.count[c]--;
+	cache.bytes -= bp->size;
+	return bp+1;
+    }
+    if ((bp = malloc(sizeof(block_t)+class_size(c))) == NULL)
+	return NULL;
+    bp->cls  = c;
+    bp->size = class_size(c);
+    return bp+1;
+}
+
+static void cache_free(void* arg, void* ptr)
+{
+    block_t* bp;
+    unsigned c;
+
+    if (ptr == NULL)
+	return;
+    bp = ((block_t*) ptr) - 1;
+    c = bp->cls;
+    if ((c == CACHE_LARGE) || (cache.count[c] >= CACHE_DEPTH) ||
+	(cache.bytes + bp->size > CACHE_MAX_BYTES)) {
+	free(bp);
+	return;
+    }
+    if (!cache.registered)
+	cache_register();
+    *(block_t**) ptr = cache.head[c];
+    cache.head[c] = bp;
+    cache.count[c]++;
+    cache.bytes += bp->size;
+}
+
+static void* cache_realloc(void* arg, void* ptr, size_t size)
+{
+    block_t* bp;
+    void* nptr;
+
+    if (ptr == NULL)
+	return cache_alloc(arg, size);
+    bp = ((block_t*) ptr) - 1;
+    if (bp->cls == CACHE_LARGE) {
+	if (size > CACHE_MAX_SIZE) {
+	    if ((bp = realloc(bp, sizeof(block_t)+size)) == NULL)
+		return NULL;
+	    bp->size = size;
+	    return bp+1;
+	}
+    }
+    else if ((size <= CACHE_MAX_SIZE) && (cache_class(size) == bp->cls))
+	return ptr;
+    if ((nptr = cache_alloc(arg, size)) == NULL)
+	return NULL;
+    memcpy(nptr, ptr, (size < bp->size) ? size : bp->size);
+    cache_free(arg, ptr);
+    return nptr;
+}
+
+const cnif_allocator_t cnif_cache_allocator =
+{
+    cache_alloc,
+    cache_realloc,
+    cache_free,
+    NULL
+};
+
+// return the blocks cached by the calling thread to malloc
+void cnif_cache_flush(void)
+{
+    cache_release(&cache);
+}
+
+//
+// MMAP - each block is a private anonymous mapping, unmapped when the
+// block is freed. Meant for large env fragments. The huge page variant
+// aligns the mapping to 2M and asks for transparent huge pages, sizes
+// a little below a multiple of 2M fill the pages.
+//
+
+#define HUGE_PAGE_SIZE (2*1024*1024)
+
+typedef struct {  // in front of each mapping, 16 bytes
+    size_t len;   // mapped bytes
+    size_t huge;
+} map_t;
+
+static void* map_block(size_t size, int huge)
+{
+    size_t align = huge ? HUGE_PAGE_SIZE : (size_t) sysconf(_SC_PAGESIZE);
+    size_t len = (sizeof(map_t) + size + align - 1) & ~(align - 1);
+    size_t maplen = huge ? len + align : len;
+    char* ptr;
+    map_t* mp;
+
+    ptr = mmap(NULL, maplen, PROT_READ|PROT_WRITE,
+	       MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED)
+	return NULL;
+    if (huge) {  // trim to an aligned range
+	char* aptr = (char*)(((uintptr_t) ptr + align - 1) & ~(align - 1));
+	if (aptr > ptr)
+	    munmap(ptr, aptr - ptr);
+	if (aptr + len < ptr + maplen)
+	    munmap(aptr + len, (ptr + maplen) - (aptr + len));
+	ptr = aptr;
+#ifdef MADV_HUGEPAGE
+	madvise(ptr, len, MADV_HUGEPAGE);
+#endif
+    }
+    mp = (map_t*) ptr;
+    mp->len  = len;
+    mp->huge = huge;
+    return mp+1;
+}
+
+static void map_free(void* arg, void* ptr)
+{
+    map_t* mp;
+
+    if (ptr == NULL)
+	return;
+    mp = ((map_t*) ptr) - 1;
+    munmap(mp, mp->len);
+}
+
+static void* map_realloc(void* arg, void* ptr, size_t size)
+{
+    map_t* mp;
+    void* nptr;
+    size_t avail;
+
+    if (ptr == NULL)
+	return map_block(size, arg != NULL);
+    mp = ((map_t*) ptr) - 1;
+    avail = mp->len - sizeof(map_t);
+    if (size <= avail)
+	return ptr;
+    if ((nptr = map_block(size, mp->huge)) == NULL)
+	return NULL;
+    memcpy(nptr, ptr, avail);
+    map_free(arg, ptr);
+    return nptr;
+}
+
+static void* map_alloc(void* arg, size_t size)
+{
+    return map_block(size, arg != NULL);
+}
+
+const cnif_allocator_t cnif_mmap_allocator =
+{
+    map_alloc,
+    map_realloc,
+    map_free,
+    NULL
+};
+
+const cnif_allocator_t cnif_hugepage_allocator =
+{
+    map_alloc,
+    map_realloc,
+    map_free,
+    (void*) 1     // huge pages
+};
+
+//
+// GLOBAL
+//
+
+static const cnif_allocator_t* allocator = &cnif_cache_allocator;
+
+const cnif_allocator_t* cnif_get_allocator(void)
+{
+    return allocator;
+}
+
+// NULL restores the default allocator
+int cnif_set_allocator(const cnif_allocator_t* a)
+{
+    allocator = (a != NULL) ? a : &cnif_cache_allocator;
+    return 1;
+}
+
+void* enif_alloc(size_t size)
+{
+    return allocator->alloc(allocator->arg, size);
+}
+
+void* enif_realloc(void* ptr, size_t size)
+{
+    return allocator->realloc(allocator->arg, ptr, size);
+}
+
+void enif_free(void* ptr)
+{
+    allocator->free(allocator->arg, ptr);
+}
@@ -0,0 +1,1195 @@
+//
+//  Benchmarks
+//
+//  Build with optimization for meaningful numbers:
+//    make CFLAGS="-O2 -g" cnif_bench
+//  Run all benchmarks or the ones named on the command line:
+//    cnif_bench [list|build|view|map|record|compare|hash|termtab|sort|kernel|parallel|keysort|copy|adopt|gc|alloc|traverse|parse ...]
+//  TLB misses of the traversals can be counted with
+//    perf stat -e dTLB-load-misses cnif_bench traverse
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include "../include/cnif.h"
+#include "../include/cnif_misc.h"
+#include "../include/cnif_term.h"
+#include "../include/cnif_sort.h"
+#include "../include/cnif_termtab.h"
+#include "../include/cnif_alloc.h"
+#include "../include/cnif_io.h"
+#include "../include/cnif_stdio.h"
+
+#define MIN(a,b) (((a)<(b))?(a):(b))
+
+#define LIST_SIZE  10000000
+#define BUILD_SIZE 1000000
+#define MAP_SIZE   100000
+
+static double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000.0 + ts.tv_nsec/1000000.0;
+}
+
+static void report(char* name, double t0, double t1, size_t n)
+{
+    double ms = t1 - t0;
+    printf("%-32s %10.3f ms %10.2f Mitems/s\n", name, ms,
+	   (ms > 0) ? (n / ms) / 1000.0 : 0.0);
+}
+
+static uint64_t rand_state = 88172645463325252ULL;
+
+static uint64_t rand64(void)
+{
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 7;
+    rand_state ^= rand_state << 17;
+    return rand_state;
+}
+
+// list of n bytes with cells linked in random memory order
+static ERL_NIF_TERM make_scattered_list(ErlNifEnv* env, size_t n)
+{
+    ERL_NIF_TERM* ptr = cnif_heap_alloc(env, 2*n);
+    size_t* perm = malloc(n*sizeof(size_t));
+    ERL_NIF_TERM list;
+    size_t i;
+
+    for (i = 0; i < n; i++)
+	perm[i] = i;
+    for (i = n-1; i > 0; i--) {
+	size_t j = rand64() % (i+1);
+	size_t t = perm[i];
+	perm[i] = perm[j];
+	perm[j] = t;
+    }
+    for (i = 0; i < n; i++) {
+	ERL_NIF_TERM* cell = &ptr[2*perm[i]];
+	cell[0] = MAKE_SMALL((ERL_NIF_TERM)(i & 0x7f));
+	cell[1] = (i+1 < n) ? MAKE_LIST(&ptr[2*perm[i+1]]) : MAKE_NIL;
+    }
+    list = MAKE_LIST(&ptr[2*perm[0]]);
+    free(perm);
+    return list;
+}
+
+// iolist [[...[[1],2]...],2] nested d levels deep
+static ERL_NIF_TERM make_nested_iolist(ErlNifEnv* env, size_t d)
+{
+    ERL_NIF_TERM* ptr = cnif_heap_alloc(env, 4*d);
+    ERL_NIF_TERM list = MAKE_NIL;
+    size_t i;
+
+    for (i = 0; i < d; i++, ptr += 4) {
+	ptr[0] = list;
+	ptr[1] = MAKE_LIST(ptr+2);
+	ptr[2] = MAKE_SMALL((ERL_NIF_TERM)2);
+	ptr[3] = MAKE_NIL;
+	list = MAKE_LIST(ptr);
+    }
+    return list;
+}
+
+static void bench_list_walk(char* kind, ErlNifEnv* env, ERL_NIF_TERM list,
+			    size_t n)
+{
+    char name[64];
+    unsigned len;
+    ERL_NIF_TERM rev;
+    double t0;
+
+    snprintf(name, sizeof(name), "%s get_list_length", kind);
+    t0 = now_ms();
+    enif_get_list_length(env, list, &len);
+    report(name, t0, now_ms(), n);
+
+    snprintf(name, sizeof(name), "%s get_string_length", kind);
+    t0 = now_ms();
+    enif_get_string_length(env, list, &len, ERL_NIF_LATIN1);
+    report(name, t0, now_ms(), n);
+
+    snprintf(name, sizeof(name), "%s make_reverse_list", kind);
+    t0 = now_ms();
+    enif_make_reverse_list(env, list, &rev);
+    report(name, t0, now_ms(), n);
+}
+
+static void bench_list(size_t n)
+{
+    ErlNifEnv* env = enif_alloc_env();
+    ERL_NIF_TERM* arr = malloc(n*sizeof(ERL_NIF_TERM));
+    ERL_NIF_TERM list;
+    ERL_NIF_TERM nested;
+    size_t len;
+    size_t i;
+    double t0;
+
+    for (i = 0; i < n; i++)
+	arr[i] = enif_make_int(env, i & 0x7f);
+    list = enif_make_list_from_array(env, arr, n);
+    bench_list_walk("compact", env, list, n);
+
+    list = make_scattered_list(env, n);
+    bench_list_walk("scattered", env, list, n);
+
+    nested = make_nested_iolist(env, n/10);
+    t0 = now_ms();
+    enif_iolist_size(env, nested, &len);
+    report("nested iolist_size", t0, now_ms(), n/10);
+
+    free(arr);
+    enif_free_env(env);
+}
+
+// sum small integers by walking cells or through an array view
+static void bench_view(size_t n)
+{
+    ErlNifEnv* env = enif_alloc_env();
+    ErlNifListView view;
+    ERL_NIF_TERM list;
+    ERL_NIF_TERM compact;
+    ERL_NIF_TERM t;
+    long sum;
+    size_t i;
+    double t0;
+
+    list = make_scattered_list(env, n);
+    t0 = now_ms();
+    sum = 0;
+    for (t = list; IS_LIST(t); t = GET_LIST(t)[1])
+	sum += GET_SMALL(GET_LIST(t)[0]);
+    report("scattered walk sum", t0, now_ms(), n);
+
+    t0 = now_ms();
+    enif_make_compact_list(env, list, &compact);
+    report("make_compact_list", t0, now_ms(), n);
+
+    t0 = now_ms();
+    sum = 0;
+    for (t = compact; IS_LIST(t); t = GET_LIST(t)[1])
+	sum += GET_SMALL(GET_LIST(t)[0]);
+    report("compact walk sum", t0, now_ms(), n);
+
+    t0 = now_ms();
+    if (!enif_get_list_view(env, compact, &view))
+	view.size = 0;
+    report("get_list_view", t0, now_ms(), n);
+
+    t0 = now_ms();
+    sum = 0;
+    for (i = 0; i < view.size; i++)
+	sum += GET_SMALL(view.elem[i*2]);
+    report("compact view sum", t0, now_ms(), n);
+    if (sum != (long) n/128*(127*128/2) + (long)((n%128)*(n%128-1)/2))
+	printf("bad sum %ld\n", sum);
+    enif_free_env(env);
+}
+
+// incremental build, lookup and removal of a large map
+static void bench_map(size_t n)
+{
+    ErlNifEnv* env = enif_alloc_env();
+    ERL_NIF_TERM* keys = malloc(n*sizeof(ERL_NIF_TERM));
+    ERL_NIF_TERM map;
+    ERL_NIF_TERM map2;
+    ERL_NIF_TERM v;
+    size_t i;
+    double t0;
+
+    for (i = 0; i < n; i++)
+	keys[i] = enif_make_int(env, (int) (rand64() & 0x7fffffff));
+
+    t0 = now_ms();
+    map = enif_make_new_map(env);
+    for (i = 0; i < n; i++)
+	enif_make_map_put(env, map, keys[i], keys[i], &map);
+    report("map_put", t0, now_ms(), n);
+
+    t0 = now_ms();
+    for (i = 0; i < n; i++)
+	enif_get_map_value(env, map, keys[i], &v);
+    report("get_map_value", t0, now_ms(), n);
+
+    t0 = now_ms();
+    for (i = 0; i < n; i++)
+	enif_make_map_remove(env, map, keys[i], &map);
+    report("map_remove", t0, now_ms(), n);
+
+    t0 = now_ms();
+    map = enif_make_map_from_arrays(env, keys, keys, n);
+    report("make_map_from_arrays", t0, now_ms(), n);
+
+    t0 = now_ms();
+    map = enif_make_new_map(env);
+    enif_make_map_put_many(env, map, keys, keys, n, &map);
+    report("map_put_many", t0, now_ms(), n);
+
+    t0 = now_ms();
+    map = enif_make_map_from_arrays(env, keys, keys, n/2);
+    map2 = enif_make_map_from_arrays(env, keys+n/2, keys+n/2, n-n/2);
+    enif_make_map_merge(env, map, map2, &map);
+    report("map_merge (incl. build)", t0, now_ms(), n);
+
+    // many small maps, flatmap path
+    t0 = now_ms();
+    for (i = 0; i+16 <= n; i += 16)
+	map = enif_make_map_from_arrays(env, keys+i, keys+i, 16);
+    report("small make_map_from_arrays", t0, now_ms(), n);
+
+    free(keys);
+    enif_free_env(env);
+}
+
+// lookups in record like maps with atom keys
+static void bench_record(size_t n)
+{
+    ErlNifEnv* env = enif_alloc_env();
+    ERL_NIF_TERM keys[60];
+    ERL_NIF_TERM map;
+    ERL_NIF_TERM v;
+    ErlNifMapIndex* index;
+    char name[64];
+    size_t i;
+    int w;
+    double t0;
+
+    for (i = 0; i < 60; i++) {
+	snprintf(name, sizeof(name), "field_%zu", i);
+	keys[i] = enif_make_atom(env, name);
+    }
+    for (w = 30; w <= 60; w += 30) {
+	map = enif_make_map_from_arrays(env, keys, keys, w);
+	enif_make_map_update(env, map, keys[0], keys[1], &map);
+
+	snprintf(name, sizeof(name), "%d keys get_map_value", w);
+	t0 = now_ms();
+	for (i = 0; i < n; i++)
+	    enif_get_map_value(env, map, keys[i % w], &v);
+	report(name, t0, now_ms(), n);
+
+	if ((index = enif_map_index_create(env, map)) != NULL) {
+	    snprintf(name, sizeof(name), "%d keys indexed", w);
+	    t0 = now_ms();
+	    for (i = 0; i < n; i++)
+		enif_get_map_value_indexed(env, index, map, keys[i % w], &v);
+	    report(name, t0, now_ms(), n);
+	    enif_map_index_destroy(index);
+	}
+    }
+
+    // same shaped records share their keys tuple
+    {
+	size_t m = n / 10;
+	ERL_NIF_TERM* recs = malloc(m*sizeof(ERL_NIF_TERM));
+	ERL_NIF_TERM vals[8];
+
+	t0 = now_ms();
+	for (i = 0; i < m; i++) {
+	    for (w = 0; w < 8; w++)
+		vals[w] = enif_make_int(env, (int)(i+w));
+	    recs[i] = enif_make_map_from_arrays(env, keys, vals, 8);
+	}
+	report("8 keys record build", t0, now_ms(), m);
+	t0 = now_ms();
+	for (i = 1; i < m; i++)
+	    enif_compare(recs[i-1], recs[i]);
+	report("8 keys record compare", t0, now_ms(), m-1);
+	free(recs);
+    }
+    enif_free_env(env);
+}
+
+// the previous recursive comparator, kept as reference
+static int compare_recursive(ERL_NIF_TERM lhs, ERL_NIF_TERM rhs)
+{
+    enif_type_t lt, rt;
+
+    if (lhs == rhs)
+	return 0;
+    lt = enif_get_type(lhs, 0);
+    rt = enif_get_type(rhs, 0);
+    if ((lt <= ENIF_TYPE_NUMBER) && (rt <= ENIF_TYPE_NUMBER))
+	return enif_compare(lhs, rhs);
+    if (lt != rt)
+	return lt - rt;
+    switch(lt) {
+    case ENIF_TYPE_ATOM: {
+	atom_t* lptr = GET_ATOM(lhs);
+	atom_t* rptr = GET_ATOM(rhs);
+	size_t i, n = MIN(lptr->len, rptr->len);
+	int r;
+	for (i = 0; i < n; i++) {
+	    if ((r = (lptr->name[i] - rptr->name[i])) != 0)
+		return r;
+	}
+	return lptr->len - rptr->len;
+    }
+    case ENIF_TYPE_TUPLE: {
+	ERL_NIF_TERM* lptr = GET_TUPLE(lhs);
+	ERL_NIF_TERM* rptr = GET_TUPLE(rhs);
+	int lari = GET_ARITYVAL(lptr[0]);
+	int rari = GET_ARITYVAL(rptr[0]);
+	int i, r;
+	if (lari != rari)
+	    return lari - rari;
+	for (i = 1; i <= lari; i++) {
+	    if ((r = compare_recursive(lptr[i], rptr[i])) != 0)
+		return r;
+	}
+	return 0;
+    }
+    case ENIF_TYPE_LIST: {
+	ERL_NIF_TERM* lptr = GET_LIST(lhs);
+	ERL_NIF_TERM* rptr = GET_LIST(rhs);
+	int r;
+	while((r = compare_recursive(lptr[0], rptr[0])) == 0) {
+	    if (IS_LIST(lptr[1]) && IS_LIST(rptr[1])) {
+		lptr = GET_LIST(lptr[1]);
+		rptr = GET_LIST(rptr[1]);
+	    }
+	    else
+		return compare_recursive(lptr[1], rptr[1]);
+	}
+	return r;
+    }
+    case ENIF_TYPE_BINARY: {
+	ErlNifBinary lb, rb;
+	size_t i, n;
+	int r;
+	enif_inspect_binary(NULL, lhs, &lb);
+	enif_inspect_binary(NULL, rhs, &rb);
+	n = MIN(lb.size, rb.size);
+	for (i = 0; i < n; i++) {
+	    if ((r = (lb.data[i] - rb.data[i])) != 0)
+		return r;
+	}
+	return lb.size - rb.size;
+    }
+    default:
+	return enif_compare(lhs, rhs);
+    }
+}
+
+// list of n records {atom, int, <<16 bytes>>, "name"}
+static ERL_NIF_TERM make_record_list(ErlNifEnv* env, size_t n)
+{
+    ERL_NIF_TERM tag = enif_make_atom(env, "a_rather_long_record_tag_name");
+    ERL_NIF_TERM list = enif_make_list(env, 0);
+    ERL_NIF_TERM bin;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+	memset(enif_make_new_binary(env, 16, &bin), 'x', 16);
+	list = enif_make_list_cell(env,
+				   enif_make_tuple4(env, tag,
+						    enif_make_int(env, i),
+						    bin,
+						    enif_make_string(env, "name", ERL_NIF_LATIN1)),
+				   list);
+    }
+    return list;
+}
+
+static void bench_compare_pair(char* kind, ERL_NIF_TERM a, ERL_NIF_TERM b,
+			       size_t n, int rounds)
+{
+    char name[64];
+    double t0;
+    int i;
+
+    snprintf(name, sizeof(name), "%s recursive", kind);
+    t0 = now_ms();
+    for (i = 0; i < rounds; i++)
+	compare_recursive(a, b);
+    report(name, t0, now_ms(), n*rounds);
+
+    snprintf(name, sizeof(name), "%s iterative", kind);
+    t0 = now_ms();
+    for (i = 0; i < rounds; i++)
+	enif_compare(a, b);
+    report(name, t0, now_ms(), n*rounds);
+}
+
+// equal terms built separately, the compare walks all of them
+static void bench_compare(size_t n)
+{
+    ErlNifEnv* env = enif_alloc_env();
+    ERL_NIF_TERM* arr = malloc(n*sizeof(ERL_NIF_TERM));
+    ERL_NIF_TERM a, b;
+    size_t m = n/10;
+    size_t bsz = 1 << 24;
+    size_t i;
+
+    for (i = 0; i < n; i++)
+	arr[i] = enif_make_int(env, i);
+    a = enif_make_list_from_array(env, arr, n);
+    b = enif_make_list_from_array(env, arr, n);
+    bench_compare_pair("int list", a, b, n, 1);
+
+    for (i = 0; i < n; i++)
+	arr[i] = enif_make_tuple2(env, arr[i], arr[i]);
+    a = enif_make_tuple_from_array(env, arr, n);
+    for (i = 0; i < n; i++)
+	arr[i] = enif_make_tuple2(env, GET_TUPLE(arr[i])[1],
+				  GET_TUPLE(arr[i])[2]);
+    b = enif_make_tuple_from_array(env, arr, n);
+    bench_compare_pair("tuple of pairs", a, b, n, 1);
+
+    a = make_record_list(env, m);
+    b = make_record_list(env, m);
+    bench_compare_pair("record list", a, b, m, 1);
+
+    memset(enif_make_new_binary(env, bsz, &a), 'x', bsz);
+    memset(enif_make_new_binary(env, bsz, &b), 'x', bsz);
+    bench_compare_pair("16M binary (bytes)", a, b, bsz, 4);
+
+    free(arr);
+    enif_free_env(env);
+}
+
+// terms per second over records, bytes per second over a binary
+static void bench_hash(size_t n)
+{
+    ErlNifEnv* env = enif_alloc_env();
+    ERL_NIF_TERM list, t, bin;
+    ErlNifUInt64 h = 0;
+    size_t bsz = 1 << 24;
+    double t0;
+    int i;
+
+    list = make_record_list(env, n);
+    t0 = now_ms();
+    for (t = list; IS_LIST(t); t = GET_LIST(t)[1])
+	h += enif_hash(ERL_NIF_INTERNAL_HASH, GET_LIST(t)[0], 0);
+    report("record internal hash", t0, now_ms(), n);
+    t0 = now_ms();
+    for (t = list; IS_LIST(t); t = GET_LIST(t)[1])
+	h += enif_hash(ERL_NIF_PHASH2, GET_LIST(t)[0], 0);
+    report("record phash2", t0, now_ms(), n);
+
+    memset(enif_make_new_binary(env, bsz, &bin), 'x', bsz);
+    t0 = now_ms();
+    for (i = 0; i < 4; i++)
+	h += enif_hash(ERL_NIF_INTERNAL_HASH, bin, 0);
+    report("16M binary internal (bytes)", t0, now_ms(), 4*bsz);
+    t0 = now_ms();
+    for (i = 0; i < 4; i++)
+	h += enif_hash(ERL_NIF_PHASH2, bin, 0);
+    report("16M binary phash2 (bytes)", t0, now_ms(), 4*bsz);
+    if (h == 0)
+	printf("zero hash\n");
+    enif_free_env(env);
+}
+
+// the middle pivot quick sort that cnif_inline_quick_sort_aux used to be
+static void quick_sort_naive(ERL_NIF_TERM* src1, int left, int right)
+{
+    int i=left, j=right;
+    ERL_NIF_TERM pivot = src1[(left+right)/2];
+
+    while (i <= j) {
+	while(enif_compare(src1[i],pivot) < 0)
+	    i++;
+	while(enif_compare(src1[j],pivot) > 0)
+	    j--;
+	if (i <= j) {
+	    ERL_NIF_TERM tmp = src1[i];
+	    src1[i] = src1[j];
+	    src1[j] = tmp;
+	    i++;
+	    j--;
+	}
+    }
+    if (left < j)
+	quick_sort_naive(src1,left,j);
+    if (i < right)
+	quick_sort_naive(src1,i,right);
+}
+
+static void bench_sort(size_t n)
+{
+    static char* kinds[] = { "random", "sorted", "reversed", "duplicates" };
+    ErlNifEnv* env = enif_alloc_env();
+    ERL_NIF_TERM* orig = malloc(n*sizeof(ERL_NIF_TERM));
+    ERL_NIF_TERM* arr = malloc(n*sizeof(ERL_NIF_TERM));
+    ERL_NIF_TERM tag = enif_make_atom(env, "k");
+    char name[64];
+    size_t i;
+    int kind;
+    double t0;
+
+    for (kind = 0; kind < 4; kind++) {
+	for (i = 0; i < n; i++) {
+	    long x;
+	    switch(kind) {
+	    case 0: x = rand64() % n; break;
+	    case 1: x = i; break;
+	    case 2: x = n-i; break;
+	    default: x = rand64() % 16; break;
+	    }
+	    orig[i] = enif_make_tuple2(env, tag, enif_make_long(env, x));
+	}
+	snprintf(name, sizeof(name), "%s naive quick", kinds[kind]);
+	memcpy(arr, orig, n*sizeof(ERL_NIF_TERM));
+	t0 = now_ms();
+	quick_sort_naive(arr, 0, n-1);
+	report(name, t0, now_ms(), n);
+
+	snprintf(name, sizeof(name), "%s pdq", kinds[kind]);
+	memcpy(arr, orig, n*sizeof(ERL_NIF_TERM));
+	t0 = now_ms();
+	cnif_pdq_sort_aux(arr, NULL, n, enif_compare);
+	report(name, t0, now_ms(), n);
+
+	snprintf(name, sizeof(name), "%s merge", kinds[kind]);
+	memcpy(arr, orig, n*sizeof(ERL_NIF_TERM));
+	t0 = now_ms();
+	cnif_merge_sort_aux(arr, NULL, n, enif_compare);
+	report(name, t0, now_ms(), n);
+    }
+    free(arr);
+    free(orig);
+    enif_free_env(env);
+}
+
+// same order as enif_compare but hides it from the sort kernel dispatch
+static int generic_compare(ERL_NIF_TERM a, ERL_NIF_TERM b)
+{
+    return enif_compare(a, b);
+}
+
+// homogeneous arrays, radix kernels against the generic comparator
+static void bench_kernel(size_t n)
+{
+    static char* kinds[] = { "int", "float", "atom", "binary" };
+    static char* names[] = { "ok", "error", "undefined", "true", "false",
+			     "infinity", "badarg", "normal" };
+    ErlNifEnv* env = enif_alloc_env();
+    ERL_NIF_TERM* orig = malloc(n*sizeof(ERL_NIF_TERM));
+    ERL_NIF_TERM* arr = malloc(n*sizeof(ERL_NIF_TERM));
+    char name[64];
+    size_t i;
+    int kind;
+    double t0;
+
+    for (kind = 0; kind < 4; kind++) {
+	for (i = 0; i < n; i++) {
+	    uint64_t x = rand64();
+	    switch(kind) {
+	    case 0: orig[i] = enif_make_long(env, (long)(x >> 8)); break;
+	    case 1: orig[i] = enif_make_double(env, (long)x / 7.0); break;
+	    case 2: orig[i] = enif_make_atom(env, names[x % 8]); break;
+	    default:
+		memcpy(enif_make_new_binary(env, 12, &orig[i]), &x, 8);
+		break;
+	    }
+	}
+	snprintf(name, sizeof(name), "%s generic pdq", kinds[kind]);
+	memcpy(arr, orig, n*sizeof(ERL_NIF_TERM));
+	t0 = now_ms();
+	cnif_pdq_sort_aux(arr, NULL, n, generic_compare);
+	report(name, t0, now_ms(), n);
+
+	snprintf(name, sizeof(name), "%s kernel", kinds[kind]);
+	memcpy(arr, orig, n*sizeof(ERL_NIF_TERM));
+	t0 = now_ms();
+	cnif_pdq_sort_aux(arr, NULL, n, enif_compare);
+	report(name, t0, now_ms(), n);
+    }
+    free(arr);
+    free(orig);
+    enif_free_env(env);
+}
+
+// scaling with the number of threads, tuple keys use the generic compare
+static void bench_parallel(size_t n)
+{
+    ErlNifEnv* env = enif_alloc_env();
+    ERL_NIF_TERM* orig = malloc(n*sizeof(ERL_NIF_TERM));
+    ERL_NIF_TERM* arr = malloc(n*sizeof(ERL_NIF_TERM));
+    ERL_NIF_TERM tag = enif_make_atom(env, "k");
+    int ncpu = cnif_sort_threads();
+    char name[64];
+    size_t i;
+    int t;
+    double t0;
+
+    for (i = 0; i < n; i++)
+	orig[i] = enif_make_tuple2(env, tag, enif_make_long(env, rand64() % n));
+    for (t = 1; (t <= 2*ncpu) || (t <= 4); t *= 2) {
+	snprintf(name, sizeof(name), "parallel sort %d threads", t);
+	memcpy(arr, orig, n*sizeof(ERL_NIF_TERM));
+	t0 = now_ms();
+	cnif_parallel_sort_aux(arr, NULL, n, enif_compare, t);
+	report(name, t0, now_ms(), n);
+    }
+    free(arr);
+    free(orig);
+    enif_free_env(env);
+}
+
+// lists:keysort(1, L) on a list of records
+static void bench_keysort(size_t n)
+{
+    ErlNifEnv* env = enif_alloc_env();
+    ERL_NIF_TERM* keys = malloc(n*sizeof(ERL_NIF_TERM));
+    ERL_NIF_TERM* arr = malloc(n*sizeof(ERL_NIF_TERM));
+    ERL_NIF_TERM tag = enif_make_atom(env, "user");
+    ERL_NIF_TERM list, sorted;
+    size_t i;
+    double t0;
+
+    for (i = 0; i < n; i++)
+	arr[i] = enif_make_tuple3(env, enif_make_long(env, rand64() % n), tag,
+				  enif_make_long(env, i));
+    list = enif_make_list_from_array(env, arr, n);
+
+    // keys in a side array and the old quick sort with src2
+    t0 = now_ms();
+    sorted = list;
+    for (i = 0; i < n; i++) {
+	ERL_NIF_TERM* cell = GET_LIST(sorted);
+	arr[i] = cell[0];
+	keys[i] = GET_TUPLE(cell[0])[1];
+	sorted = cell[1];
+    }
+    cnif_quick_sort_aux(keys, arr, NULL, NULL, 0, n-1);
+    sorted = enif_make_list_from_array(env, arr, n);
+    report("keysort side array", t0, now_ms(), n);
+
+    t0 = now_ms();
+    enif_make_sorted_list(env, list, 1, &sorted);
+    report("keysort enif_make_sorted_list", t0, now_ms(), n);
+
+    free(arr);
+    free(keys);
+    enif_free_env(env);
+}
+
+// copy of a list of distinct records and of one record shared n times
+static void bench_copy(size_t n)
+{
+    ErlNifEnv* env = enif_alloc_env();
+    ErlNifEnv* dst;
+    ERL_NIF_TERM* arr = malloc(n*sizeof(ERL_NIF_TERM));
+    ERL_NIF_TERM list, shared;
+    size_t i;
+    double t0;
+
+    list = make_record_list(env, n);
+    for (i = 0; i < n; i++)
+	arr[i] = GET_LIST(list)[0];
+    shared = enif_make_list_from_array(env, arr, n);
+
+    dst = enif_alloc_env();
+    t0 = now_ms();
+    enif_make_copy(dst, list);
+    report("records enif_make_copy", t0, now_ms(), n);
+    enif_free_env(dst);
+
+    dst = enif_alloc_env();
+    t0 = now_ms();
+    enif_make_flat_copy(dst, list);
+    report("records flat copy", t0, now_ms(), n);
+    enif_free_env(dst);
+
+    dst = enif_alloc_env();
+    t0 = now_ms();
+    enif_make_struct_copy(dst, list);
+    report("records struct copy", t0, now_ms(), n);
+    enif_free_env(dst);
+
+    dst = enif_alloc_env();
+    t0 = now_ms();
+    enif_make_copy(dst, shared);
+    report("shared record enif_make_copy", t0, now_ms(), n);
+    enif_free_env(dst);
+
+    dst = enif_alloc_env();
+    t0 = now_ms();
+    enif_make_struct_copy(dst, shared);
+    report("shared record struct copy", t0, now_ms(), n);
+    enif_free_env(dst);
+
+    free(arr);
+    enif_free_env(env);
+}
+
+// hand a large term from a scratch env to a long lived env
+static void bench_adopt(size_t n)
+{
+    ErlNifEnv* dst = enif_alloc_env();
+    ErlNifEnv* src = enif_alloc_env();
+    ERL_NIF_TERM list;
+    double t0;
+
+    list = make_record_list(src, n);
+    t0 = now_ms();
+    enif_make_flat_copy(dst, list);
+    report("records flat copy", t0, now_ms(), n);
+    enif_clear_env(dst);
+
+    t0 = now_ms();
+    enif_is_env_term(src, list);
+    report("records ownership check", t0, now_ms(), n);
+
+    t0 = now_ms();
+    enif_env_transfer_term(dst, src, list);
+    report("records transfer", t0, now_ms(), n);
+
+    list = make_record_list(src, n);
+    t0 = now_ms();
+    enif_env_adopt(dst, src);
+    report("records adopt", t0, now_ms(), n);
+
+    enif_free_env(src);
+    enif_free_env(dst);
+}
+
+// heap words held by the fragments of env
+static size_t heap_words(ErlNifEnv* env)
+{
+    size_t n = cnif_heap_ranges(env, NULL, 0);
+    ERL_NIF_TERM** r = malloc(2*n*sizeof(ERL_NIF_TERM*)+1);
+    size_t i, words = 0;
+
+    cnif_heap_ranges(env, r, n);
+    for (i = 0; i < n; i++)
+	words += r[2*i+1] - r[2*i];
+    free(r);
+    return words;
+}
+
+// a state map updated in place, collected now and then
+static void bench_gc(size_t n)
+{
+    ErlNifEnv* env = enif_alloc_env();
+    ERL_NIF_TERM roots[2];
+    size_t i, before;
+    double t0;
+
+    roots[0] = enif_make_new_map(env);
+    for (i = 0; i < n; i++)
+	enif_make_map_put(env, roots[0], enif_make_int(env, i % 1000),
+			  enif_make_double(env, i), &roots[0]);
+    roots[1] = make_record_list(env, n/10);
+    before = heap_words(env);
+    t0 = now_ms();
+    enif_env_gc(env, roots, 2);
+    report("gc map and records", t0, now_ms(), n/10);
+    printf("heap words %zu -> %zu\n", before, heap_words(env));
+
+    t0 = now_ms();
+    enif_env_gc(env, roots, 2);
+    report("gc live heap", t0, now_ms(), n/10);
+
+    enif_free_env(env);
+}
+
+// bump allocator over a preallocated buffer, free is a no-op and the
+// buffer is reset when the env is cleared
+typedef struct {
+    char*  base;
+    size_t size;
+    size_t used;
+} arena_t;
+
+static void* arena_alloc(void* arg, size_t size)
+{
+    arena_t* ap = (arena_t*) arg;
+    void* ptr;
+
+    size = (size + 15) & ~(size_t)15;
+    if (ap->used + size > ap->size)
+	return NULL;
+    ptr = ap->base + ap->used;
+    ap->used += size;
+    return ptr;
+}
+
+static void* arena_realloc(void* arg, void* ptr, size_t size)
+{
+    return NULL;
+}
+
+static void arena_free(void* arg, void* ptr)
+{
+}
+
+// build and clear an env of m records per round
+static void bench_env_rounds(char* kind, const cnif_allocator_t* a,
+			     arena_t* arena, size_t n)
+{
+    ErlNifEnv* env = enif_alloc_env();
+    size_t rounds = 1000;
+    size_t m = n / rounds;
+    size_t r, i;
+    char name[64];
+    double t0;
+
+    cnif_env_set_allocator(env, a);
+    t0 = now_ms();
+    for (r = 0; r < rounds; r++) {
+	ERL_NIF_TERM list = enif_make_list(env, 0);
+	for (i = 0; i < m; i++)
+	    list = enif_make_list_cell(env,
+				       enif_make_tuple2(env,
+							enif_make_int(env, i),
+							enif_make_double(env, i)),
+				       list);
+	enif_clear_env(env);
+	if (arena)
+	    arena->used = 0;
+    }
+    snprintf(name, sizeof(name), "%s env rounds", kind);
+    report(name, t0, now_ms(), rounds*m);
+    enif_free_env(env);
+}
+
+// allocate and free blocks of mixed sizes with 256 live at a time
+static void bench_churn(char* kind, const cnif_allocator_t* a,
+			size_t* sizes, size_t n)
+{
+    void* live[256];
+    size_t i;
+    char name[64];
+    double t0;
+
+    memset(live, 0, sizeof(live));
+    t0 = now_ms();
+    for (i = 0; i < n; i++) {
+	a->free(a->arg, live[i & 255]);
+	live[i & 255] = a->alloc(a->arg, sizes[i]);
+    }
+    for (i = 0; i < 256; i++)
+	a->free(a->arg, live[i]);
+    snprintf(name, sizeof(name), "%s alloc/free churn", kind);
+    report(name, t0, now_ms(), n);
+}
+
+static void bench_alloc(size_t n)
+{
+    size_t* sizes = malloc(n*sizeof(size_t));
+    cnif_allocator_t fixed = { arena_alloc, arena_realloc, arena_free, NULL };
+    arena_t arena;
+    size_t i;
+
+    // mostly small blocks, now and then a larger one
+    for (i = 0; i < n; i++)
+	sizes[i] = (rand64() % 8 == 0) ? 16 + rand64() % 8192 :
+	    16 + rand64() % 256;
+    bench_churn("malloc", &cnif_malloc_allocator, sizes, n);
+    bench_churn("cache", &cnif_cache_allocator, sizes, n);
+    free(sizes);
+
+    bench_env_rounds("malloc", &cnif_malloc_allocator, NULL, n);
+    bench_env_rounds("cache", &cnif_cache_allocator, NULL, n);
+    // records take 7 words, the rest is fragment slack
+    arena.size = 2*7*sizeof(ERL_NIF_TERM)*(n/1000) + (1 << 20);
+    arena.base = malloc(arena.size);
+    arena.used = 0;
+    fixed.arg  = &arena;
+    bench_env_rounds("fixed buffer", &fixed, &arena, n);
+    free(arena.base);
+}
+
+// n records in a list linked in random order, a walk jumps across the
+// whole heap
+static ERL_NIF_TERM make_shuffled_records(ErlNifEnv* env, size_t n)
+{
+    ERL_NIF_TERM* recs = malloc(n*sizeof(ERL_NIF_TERM));
+    ERL_NIF_TERM list;
+    size_t i;
+
+    for (i = 0; i < n; i++)
+	recs[i] = enif_make_tuple2(env, enif_make_int(env, i),
+				   enif_make_double(env, i));
+    for (i = n-1; i > 0; i--) {
+	size_t j = rand64() % (i+1);
+	ERL_NIF_TERM t = recs[i];
+	recs[i] = recs[j];
+	recs[j] = t;
+    }
+    list = enif_make_list_from_array(env, recs, n);
+    free(recs);
+    return list;
+}
+
+static void bench_traverse_heap(char* kind, const cnif_allocator_t* a,
+				size_t fragment_size, size_t n)
+{
+    ErlNifEnv* env = enif_alloc_env();
+    ErlNifEnv* dst = enif_alloc_env();
+    uint64_t seed = rand_state;
+    ERL_NIF_TERM x, y;
+    char name[64];
+    double t0;
+
+    cnif_env_set_allocator(env, a);
+    cnif_env_set_fragment_size(env, fragment_size);
+    cnif_env_set_allocator(dst, a);
+    cnif_env_set_fragment_size(dst, fragment_size);
+    // two equal terms with the same layout
+    x = make_shuffled_records(env, n);
+    rand_state = seed;
+    y = make_shuffled_records(env, n);
+
+    snprintf(name, sizeof(name), "%s compare", kind);
+    t0 = now_ms();
+    enif_compare(x, y);
+    report(name, t0, now_ms(), n);
+
+    snprintf(name, sizeof(name), "%s make_copy", kind);
+    t0 = now_ms();
+    enif_make_copy(dst, x);
+    report(name, t0, now_ms(), n);
+
+    enif_free_env(dst);
+    enif_free_env(env);
+}
+
+// 32M byte fragments, the headers fit below the last huge page
+#define LARGE_FRAGMENT_SIZE  ((32 << 20)/sizeof(ERL_NIF_TERM) - 8)
+
+static void bench_traverse(size_t n)
+{
+    bench_traverse_heap("8K fragments", cnif_get_allocator(), 0, n);
+    bench_traverse_heap("32M mmap", &cnif_mmap_allocator,
+			LARGE_FRAGMENT_SIZE, n);
+    bench_traverse_heap("32M hugepage", &cnif_hugepage_allocator,
+			LARGE_FRAGMENT_SIZE, n);
+}
+
+// count the form, the terms are dropped now and then
+static int count_form(enif_io_t* p, ERL_NIF_TERM term)
+{
+    if ((++(*(size_t*) p->data) % 4096) == 0)
+	enif_clear_env(p->env);
+    return 1;
+}
+
+static void report_parse(char* name, double t0, double t1,
+			 size_t forms, long bytes)
+{
+    report(name, t0, t1, forms);
+    printf("%zu forms %.1f MB/s\n", forms, (bytes / 1e6) / ((t1 - t0) / 1000.0));
+}
+
+// parse n forms of mixed terms from a file, read through the input
+// window, from a copy in memory and from a mapping of the file
+static void bench_parse(size_t n)
+{
+    ErlNifEnv* env = enif_alloc_env();
+    char path[] = "/tmp/cnif_bench_XXXXXX";
+    int fd = mkstemp(path);
+    FILE* f = fdopen(fd, "w+");
+    enif_io_t* iop;
+    size_t forms = 0;
+    char* data;
+    long bytes;
+    size_t i;
+    double t0, t1;
+
+    for (i = 0; i < n; i++)
+	fprintf(f, "{%zu,%zu.5,abc,\"string %zu\",[1,2,3],"
+		"#{k => <<1,2>>, b => <<\"binary %zu\">>}}.\n",
+		i, i, i, i);
+    bytes = ftell(f);
+    rewind(f);
+    data = malloc(bytes);
+    if (fread(data, 1, bytes, f) != (size_t) bytes)
+	fprintf(stderr, "parse: short read\n");
+    rewind(f);
+
+    iop = enif_stdio_alloc(env, &forms);
+    enif_io_set_callback(iop, count_form);
+    enif_io_push(iop, f, "*bench*", 1, stdout, "*stdout*");
+    t0 = now_ms();
+    enif_io_scan_forms(iop);
+    t1 = now_ms();
+    report_parse("parse forms", t0, t1, forms, bytes);
+    enif_io_free(iop);
+    enif_clear_env(env);
+
+    forms = 0;
+    t0 = now_ms();
+    enif_io_parse_buffer(env, data, bytes, count_form, &forms);
+    t1 = now_ms();
+    report_parse("parse forms buffer", t0, t1, forms, bytes);
+    enif_clear_env(env);
+
+    forms = 0;
+    t0 = now_ms();
+    enif_io_parse_file_mmap(env, path, count_form, &forms);
+    t1 = now_ms();
+    report_parse("parse forms mmap", t0, t1, forms, bytes);
+
+    unlink(path);
+    free(data);
+    enif_free_env(env);
+}
+
+// group tuple keys into a term table and look them up again
+static void bench_termtab(size_t n)
+{
+    ErlNifEnv* env = enif_alloc_env();
+    ERL_NIF_TERM* keys = malloc(n*sizeof(ERL_NIF_TERM));
+    ERL_NIF_TERM tag = enif_make_atom(env, "user");
+    cnif_termtab_t* tab = cnif_termtab_new();
+    ERL_NIF_TERM v;
+    size_t i;
+    double t0;
+
+    for (i = 0; i < n; i++)
+	keys[i] = enif_make_tuple2(env, tag,
+				   enif_make_int(env, rand64() % (n/10)));
+    t0 = now_ms();
+    for (i = 0; i < n; i++) {
+	long c = 0;
+	if (cnif_termtab_get(tab, keys[i], &v))
+	    enif_get_long(env, v, &c);
+	cnif_termtab_put(tab, keys[i], enif_make_long(env, c+1));
+    }
+    report("termtab count (get+put)", t0, now_ms(), n);
+
+    t0 = now_ms();
+    for (i = 0; i < n; i++)
+	cnif_termtab_get(tab, keys[i], &v);
+    report("termtab get", t0, now_ms(), n);
+
+    cnif_termtab_free(tab);
+    tab = cnif_termtab_new();
+    t0 = now_ms();
+    cnif_termtab_load(tab, keys, keys, n);
+    report("termtab load", t0, now_ms(), n);
+
+    cnif_termtab_free(tab);
+    free(keys);
+    enif_free_env(env);
+}
+
+#define BUILD_ROUNDS 5
+
+static void bench_build(size_t n)
+{
+    ErlNifEnv* env = enif_alloc_env();
+    ERL_NIF_TERM* arr = malloc(n*sizeof(ERL_NIF_TERM));
+    ErlNifSInt64* ivec = malloc(n*sizeof(ErlNifSInt64));
+    double* dvec = malloc(n*sizeof(double));
+    double best[6] = {1e9,1e9,1e9,1e9,1e9,1e9};
+    ERL_NIF_TERM list;
+    unsigned cnt;
+    size_t i;
+    int r;
+    double t0;
+
+    for (i = 0; i < n; i++) {
+	ivec[i] = (i & 1) ? (ErlNifSInt64) rand64() : (ErlNifSInt64) i;
+	dvec[i] = i * 0.5;
+    }
+    // best of a few rounds, the env is cleared between rounds
+    for (r = 0; r < BUILD_ROUNDS; r++) {
+	t0 = now_ms();
+	for (i = 0; i < n; i++)
+	    arr[i] = enif_make_int64(env, ivec[i]);
+	list = enif_make_list_from_array(env, arr, n);
+	best[0] = MIN(best[0], now_ms()-t0);
+
+	t0 = now_ms();
+	list = enif_make_list_from_int64_array(env, ivec, n);
+	best[1] = MIN(best[1], now_ms()-t0);
+
+	t0 = now_ms();
+	enif_get_int64_array(env, list, ivec, n, &cnt);
+	best[2] = MIN(best[2], now_ms()-t0);
+
+	t0 = now_ms();
+	for (i = 0; i < n; i++)
+	    arr[i] = enif_make_double(env, dvec[i]);
+	list = enif_make_list_from_array(env, arr, n);
+	best[3] = MIN(best[3], now_ms()-t0);
+
+	t0 = now_ms();
+	list = enif_make_list_from_double_array(env, dvec, n);
+	best[4] = MIN(best[4], now_ms()-t0);
+
+	t0 = now_ms();
+	enif_get_double_array(env, list, dvec, n, &cnt);
+	best[5] = MIN(best[5], now_ms()-t0);
+	enif_clear_env(env);
+    }
+    report("int64 per element", 0, best[0], n);
+    report("int64 bulk", 0, best[1], n);
+    report("int64 bulk extract", 0, best[2], n);
+    report("double per element", 0, best[3], n);
+    report("double bulk", 0, best[4], n);
+    report("double bulk extract", 0, best[5], n);
+
+    free(dvec);
+    free(ivec);
+    free(arr);
+    enif_free_env(env);
+}
+
+typedef struct {
+    char* name;
+    void (*fun)(size_t n);
+    size_t n;
+} bench_t;
+
+static bench_t benchmarks[] = {
+    { "list", bench_list, LIST_SIZE },
+    { "build", bench_build, BUILD_SIZE },
+    { "view", bench_view, LIST_SIZE },
+    { "map", bench_map, MAP_SIZE },
+    { "record", bench_record, LIST_SIZE },
+    { "compare", bench_compare, BUILD_SIZE },
+    { "hash", bench_hash, BUILD_SIZE },
+    { "termtab", bench_termtab, BUILD_SIZE },
+    { "sort", bench_sort, BUILD_SIZE },
+    { "kernel", bench_kernel, LIST_SIZE },
+    { "parallel", bench_parallel, 4*BUILD_SIZE },
+    { "keysort", bench_keysort, BUILD_SIZE },
+    { "copy", bench_copy, BUILD_SIZE },
+    { "adopt", bench_adopt, BUILD_SIZE },
+    { "gc", bench_gc, BUILD_SIZE },
+    { "alloc", bench_alloc, 10*BUILD_SIZE },
+    { "traverse", bench_traverse, 4*BUILD_SIZE },
+    { "parse", bench_parse, BUILD_SIZE },
+    { NULL, NULL, 0 }
+};
+
+int main(int argc, char** argv)
+{
+    bench_t* bp;
+    int i;
+
+#ifdef __GLIBC__
+    // keep freed fragments in the process so rounds do not measure
+    // page faults on fresh mmap'ed memory
+    mallopt(M_MMAP_THRESHOLD, 1 << 30);
+    mallopt(M_TRIM_THRESHOLD, -1);
+#endif
+
+    for (bp = benchmarks; bp->name; bp++) {
+	if (argc > 1) {
+	    for (i = 1; i < argc; i++)
+		if (strcmp(argv[i], bp->name) == 0)
+		    break;
+	    if (i == argc)
+		continue;
+	}
+	printf("== %s (n=%zu)\n", bp->name, bp->n);
+	bp->fun(bp->n);
+    }
+    exit(0);
+}
@@ -45,7 +45,8 @@ ERL_NIF_TERM enif_make_number(ErlNifEnv* env, ErlNifBignum* big)
 	    return enif_make_int64(env, -d);
 	}
     }
-    ptr = cnif_heap_alloc(env, 1+size);
+    if ((ptr = cnif_heap_alloc(env, 1+size)) == NULL)
+	return INVALID_TERM;
     ptr[0] = big->sign ? MAKE_NEG_BIGVAL(size) : MAKE_POS_BIGVAL(size);
     for (i = 0; i < (int) size; i++)
 	ptr[i+1] = big->digits[i];
@@ -2,89 +2,72 @@
 // Copy functions
 //
 #include <stdio.h>
+#include <stddef.h>
+#include <string.h>
 #include "../include/cnif_term.h"
+#include "../include/cnif_misc.h"
+#include "../include/cnif_alloc.h"
 
 //
-// RECURSIVE SIZE OF TERM
+// SIZE OF TERM - iterative, a shared sub term counts once per reference
 //
-static ERL_NIF_UINT size_boxed(ERL_NIF_TERM src_term);
-static ERL_NIF_UINT size_list(ERL_NIF_TERM src_term);
 
-static inline ERL_NIF_UINT flat_size(ERL_NIF_TERM src_term)
+static inline void push_node(wstack_t* stack, ERL_NIF_TERM t)
 {
-    switch(src_term & 3) {
-    case TAG_PRIMARY_HEADER: return 0;
-    case TAG_PRIMARY_LIST:   return size_list(src_term);
-    case TAG_PRIMARY_BOXED:  return size_boxed(src_term);
-    case TAG_PRIMARY_IMMED1: return 0;
-    }
-    return 0;
+    if (IS_LIST(t) || IS_BOXED(t))
+	wstack_push(stack, t);
 }
 
-static ERL_NIF_UINT size_boxed(ERL_NIF_TERM src_term)
+// push the terms held by the boxed object at ptr
+static inline void push_boxed_terms(wstack_t* stack, ERL_NIF_TERM* ptr)
 {
-    ERL_NIF_TERM* srcp  = GET_BOXED(src_term);
-    ERL_NIF_UINT  arity = GET_ARITYVAL(*srcp);
-    ERL_NIF_UINT  i;
-    ERL_NIF_UINT  sz = arity+1;
-	
-    switch(srcp[0] & _TAG_HEADER_MASK) {
-    case TAG_HEADER_POS_BIG:
-    case TAG_HEADER_NEG_BIG:
-    case TAG_HEADER_FLOAT:
-    case TAG_HEADER_HEAP_BIN:
-    case TAG_HEADER_REFC_BIN:
-    case TAG_HEADER_EXTERNAL_PID:
-    case TAG_HEADER_EXTERNAL_PORT:
-    case TAG_HEADER_EXTERNAL_REF:
-    case TAG_HEADER_BIN_MATCHSTATE:
-	break;
+    ERL_NIF_UINT arity = GET_ARITYVAL(ptr[0]);
+    ERL_NIF_UINT i;
+
+    switch(ptr[0] & _TAG_HEADER_MASK) {
     case TAG_HEADER_ARITYVAL:
-	for (i = 1; i <= arity; i++)
-	    sz += flat_size(srcp[i]);
+	for (i = arity; i >= 1; i--)
+	    push_node(stack, ptr[i]);
 	break;
-    case TAG_HEADER_SUB_BIN: {
-	sub_binary_t* src_sbp = (sub_binary_t*) srcp;
-	sz += flat_size(src_sbp->orig);
+    case TAG_HEADER_SUB_BIN:
+	push_node(stack, ((sub_binary_t*) ptr)->orig);
 	break;
-    }
     case TAG_HEADER_MAP: {
-	flatmap_t* src_mp = (flatmap_t*) srcp;
-	ERL_NIF_UINT size = src_mp->size;
-	sz += flat_size(src_mp->keys);
-	for (i = 0; i < size; i++)
-	    sz += flat_size(src_mp->value[i]);
+	// keys (or hashmap marker) and values/root are terms
+	ERL_NIF_TERM* tp = &((flatmap_t*) ptr)->keys;
+	ERL_NIF_TERM* end = ptr + arity + 1;
+	while(end > tp)
+	    push_node(stack, *--end);
 	break;
     }
     default:
 	break;
     }
-    return sz;
 }
 
-static ERL_NIF_UINT size_list(ERL_NIF_TERM src_term)
+static ERL_NIF_UINT flat_size(ERL_NIF_TERM src_term)
 {
-    ERL_NIF_TERM* srcp;
-    ERL_NIF_UINT sz = 0;  // the cons cell
-
-    goto do_list;
-again:
-    switch(src_term & 3) {
-    case TAG_PRIMARY_HEADER:
-	return 0;
-    case TAG_PRIMARY_LIST:
-    do_list:
-	srcp = GET_LIST(src_term);
-	sz += 2;
-	sz += flat_size(srcp[0]);
-	src_term = srcp[1];
-	goto again;
-    case TAG_PRIMARY_BOXED:
-	sz += size_boxed(src_term);
-	break;
-    case TAG_PRIMARY_IMMED1:
-	break;
+    wstack_t stack;
+    ERL_NIF_UINT sz = 0;
+
+    wstack_init(&stack);
+    push_node(&stack, src_term);
+    while(!wstack_is_empty(&stack)) {
+	ERL_NIF_TERM t = wstack_pop(&stack);
+	// list tails are followed in place
+	while(IS_LIST(t)) {
+	    ERL_NIF_TERM* ptr = GET_LIST(t);
+	    sz += 2;
+	    push_node(&stack, ptr[0]);
+	    t = ptr[1];
+	}
+	if (IS_BOXED(t)) {
+	    ERL_NIF_TERM* ptr = GET_BOXED(t);
+	    sz += GET_ARITYVAL(ptr[0]) + 1;
+	    push_boxed_terms(&stack, ptr);
+	}
     }
+    wstack_free(&stack);
     return sz;
 }
 
@@ -127,8 +110,10 @@ static ERL_NIF_TERM copy_boxed_tuple(ErlNifEnv* dst_env, ERL_NIF_TERM* dstp,
 {
     ERL_NIF_UINT i;
     dstp[0] = srcp[0];  // arity
-    for (i = 1; i <= n; i++)
-	dstp[i] = recursive_copy(dst_env, srcp[i]);
+    for (i = 1; i <= n; i++) {
+	if ((dstp[i] = recursive_copy(dst_env, srcp[i])) == 0)
+	    return 0;
+    }
     return MAKE_BOXED(dstp);    
 }
 
@@ -139,12 +124,23 @@ static ERL_NIF_TERM copy_boxed_map(ErlNifEnv* dst_env, ERL_NIF_TERM* dstp,
     flatmap_t* dst_mp = (flatmap_t*) dstp;
     ERL_NIF_UINT size = src_mp->size;
     ERL_NIF_UINT  i;
-	
+
+    if (IS_HASHMAP_PTR(src_mp)) {
+	hashmap_t* src_hp = (hashmap_t*) srcp;
+	hashmap_t* dst_hp = (hashmap_t*) dstp;
+	*dst_hp = *src_hp;
+	if ((dst_hp->root = recursive_copy(dst_env, src_hp->root)) == 0)
+	    return 0;
+	return MAKE_MAP(dst_hp);
+    }
     dst_mp->header = src_mp->header;
     dst_mp->size   = src_mp->size;
-    dst_mp->keys = recursive_copy(dst_env, src_mp->keys);
-    for (i = 0; i < size; i++)
-	dst_mp->value[i] = recursive_copy(dst_env, src_mp->value[i]);
+    if ((dst_mp->keys = recursive_copy(dst_env, src_mp->keys)) == 0)
+	return 0;
+    for (i = 0; i < size; i++) {
+	if ((dst_mp->value[i] = recursive_copy(dst_env, src_mp->value[i])) == 0)
+	    return 0;
+    }
     return MAKE_MAP(dst_mp);    
 }
 
@@ -157,9 +153,10 @@ static ERL_NIF_TERM copy_boxed_refc_bin(ErlNifEnv* dst_env, ERL_NIF_TERM* dstp,
     dst_rbp->size   = src_rbp->size;
     dst_rbp->next   = 0;
     dst_rbp->val    = src_rbp->val;
-    dst_rbp->bytes  = dst_rbp->bytes;
-    dst_rbp->flags  = dst_rbp->flags;
-    dst_rbp->val->refc++;
+    dst_rbp->bytes  = src_rbp->bytes;
+    dst_rbp->flags  = src_rbp->flags;
+    if (!cnif_binary_keep(dst_env, dst_rbp->val))
+	return 0;
     return MAKE_BINARY(dstp);
 }
 
@@ -174,7 +171,8 @@ static ERL_NIF_TERM copy_boxed_sub_bin(ErlNifEnv* dst_env, ERL_NIF_TERM* dstp,
     dst_sbp->bitsize   = src_sbp->bitsize;
     dst_sbp->bitoffs   = src_sbp->bitoffs;
     dst_sbp->is_writable = src_sbp->is_writable;
-    dst_sbp->orig      = recursive_copy(dst_env, src_sbp->orig);
+    if ((dst_sbp->orig = recursive_copy(dst_env, src_sbp->orig)) == 0)
+	return 0;
     return MAKE_BINARY(dstp);
 }
 
@@ -184,6 +182,8 @@ static ERL_NIF_TERM copy_boxed(ErlNifEnv* dst_env, ERL_NIF_TERM src_term)
     ERL_NIF_UINT  arity = GET_ARITYVAL(*srcp);
     ERL_NIF_TERM* dstp  = cnif_heap_alloc(dst_env, arity+1);
 
+    if (dstp == NULL)
+	return 0;
     switch(srcp[0] & _TAG_HEADER_MASK) {
     case TAG_HEADER_POS_BIG:
     case TAG_HEADER_NEG_BIG:
@@ -229,17 +229,20 @@ again:
     case TAG_PRIMARY_LIST:
     start:
 	srcp = GET_LIST(src_term);
-	dstp = cnif_heap_alloc(dst_env, 2);
+	if ((dstp = cnif_heap_alloc(dst_env, 2)) == NULL)
+	    return 0;
 	if (tailp)
 	    *tailp = MAKE_LIST(dstp);
 	else
 	    dstp0 = dstp;
-	dstp[0] = recursive_copy(dst_env, srcp[0]);
+	if ((dstp[0] = recursive_copy(dst_env, srcp[0])) == 0)
+	    return 0;
 	tailp = dstp+1;
 	src_term = srcp[1];
 	goto again;
     case TAG_PRIMARY_BOXED:
-	*tailp = copy_boxed(dst_env, src_term);
+	if ((*tailp = copy_boxed(dst_env, src_term)) == 0)
+	    return 0;
 	break;
     case TAG_PRIMARY_IMMED1:
 	*tailp = src_term;
@@ -254,46 +257,44 @@ ERL_NIF_TERM enif_make_copy(ErlNifEnv* dst_env, ERL_NIF_TERM src_term)
     return recursive_copy(dst_env, src_term);
 }
 
-// 
-// FLAT COPY - flat copy without a stack
 //
-static inline ERL_NIF_TERM flat_copy(ErlNifEnv* dst_env, 
+// FLAT COPY - breadth first (Cheney) copy without a stack into one
+// consecutive block. Objects are copied as is and the copied words are
+// then scanned, pointers still referring to the source are replaced by
+// copies appended at the end of the block. A shared sub term is copied
+// once per reference, as enif_flat_size counts it.
+//
+
+// copy the object at srcp to *top, return the copy
+static inline ERL_NIF_TERM* flat_node(ERL_NIF_TERM* srcp, ERL_NIF_UINT n,
+				      ERL_NIF_TERM** top)
+{
+    ERL_NIF_TERM* dstp = *top;
+    memcpy(dstp, srcp, n*sizeof(ERL_NIF_TERM));
+    *top += n;
+    return dstp;
+}
+
+static inline ERL_NIF_TERM flat_copy(ErlNifEnv* dst_env,
 				     ERL_NIF_TERM src_term)
 {
     ERL_NIF_UINT size;
-    ERL_NIF_TERM* srcp;
     ERL_NIF_TERM* from;
     ERL_NIF_TERM* to;
     ERL_NIF_TERM  dst_term;
 
-    if ((size=flat_size(src_term)) == 0)
+    if ((size = flat_size(src_term)) == 0)
 	return src_term;
-    to = cnif_heap_alloc(dst_env, size);  // must be consecutive chunk
+    // must be consecutive chunk
+    if ((to = cnif_heap_alloc(dst_env, size)) == NULL)
+	return INVALID_TERM;
     from = to;
 
-    switch(src_term & 3) {
-    case TAG_PRIMARY_HEADER: // FIXME: fail
-	return 0;
-    case TAG_PRIMARY_LIST: {
-	ERL_NIF_TERM* srcp = GET_LIST(src_term);
-	to[0] = srcp[0];
-	to[1] = srcp[1];
-	dst_term = MAKE_LIST(to);
-	to += 2;
-	break;
-    }
-    case TAG_PRIMARY_BOXED: {
+    if (IS_LIST(src_term))
+	dst_term = MAKE_LIST(flat_node(GET_LIST(src_term), 2, &to));
+    else {
 	ERL_NIF_TERM* srcp = GET_BOXED(src_term);
-	ERL_NIF_UINT  arity = GET_ARITYVAL(*srcp);
-	ERL_NIF_UINT  i;
-	for (i = 0; i <= arity; i++)
-	    to[i] = srcp[i];
-	dst_term = MAKE_BOXED(to);
-	to += (arity+1);
-	break;
-    }
-    case TAG_PRIMARY_IMMED1: // FIXME: fail
-	return 0;
+	dst_term = MAKE_BOXED(flat_node(srcp, GET_ARITYVAL(*srcp)+1, &to));
     }
 
     while(from < to) {
@@ -302,236 +303,594 @@ static inline ERL_NIF_TERM flat_copy(ErlNifEnv* dst_env,
 	case TAG_PRIMARY_HEADER: {
 	    ERL_NIF_UINT arity = GET_ARITYVAL(src);
 	    switch(src & _TAG_HEADER_MASK) {
-	    case TAG_HEADER_POS_BIG:
-	    case TAG_HEADER_NEG_BIG:
-	    case TAG_HEADER_FLOAT:
-	    case TAG_HEADER_HEAP_BIN:
-	    case TAG_HEADER_EXTERNAL_PID:
-	    case TAG_HEADER_EXTERNAL_PORT:
-	    case TAG_HEADER_EXTERNAL_REF:
-	    case TAG_HEADER_BIN_MATCHSTATE:
-		from += (arity+1);
+	    case TAG_HEADER_ARITYVAL:
+		from++;
 		break;
 	    case TAG_HEADER_REFC_BIN: {
 		refc_binary_t* rbp = (refc_binary_t*) from;
-		rbp->val->refc++;
-		// fixme: link it
+		if (!cnif_binary_keep(dst_env, rbp->val))
+		    return INVALID_TERM;
+		rbp->next = 0;
 		from += (arity+1);
 		break;
 	    }
-	    case TAG_HEADER_ARITYVAL:
-		from++;
-		break;
 	    case TAG_HEADER_SUB_BIN: {
 		sub_binary_t* sbp = (sub_binary_t*) from;
 		from = (ERL_NIF_TERM*) &sbp->orig;
+		break;
 	    }
 	    case TAG_HEADER_MAP: {
+		// keys (or hashmap marker) and values/root are terms
 		flatmap_t* mp = (flatmap_t*) from;
 		from = (ERL_NIF_TERM*) &mp->keys;
+		break;
 	    }
+	    case TAG_HEADER_EXPORT:
+	    case TAG_HEADER_FUN:
+		return INVALID_TERM;
 	    default:
-		// FIXME: fail
-		return 0;
+		// bignums, floats, heap binaries and other data words
+		from += (arity+1);
+		break;
 	    }
 	    break;
 	}
-
-	case TAG_PRIMARY_LIST: {
-	    ERL_NIF_TERM* srcp = GET_LIST(src);
-	    to[0] = srcp[0];
-	    to[1] = srcp[1];
-	    *from++ = MAKE_LIST(to);
-	    to += 2;
+	case TAG_PRIMARY_LIST:
+	    *from++ = MAKE_LIST(flat_node(GET_LIST(src), 2, &to));
 	    break;
-	}
 	case TAG_PRIMARY_BOXED: {
-	    ERL_NIF_TERM* srcp  = GET_BOXED(src);
-	    ERL_NIF_UINT  arity = GET_ARITYVAL(*srcp);
-	    ERL_NIF_UINT  i;
-	    for (i = 0; i <= arity; i++)
-		to[i] = srcp[i];
-	    *from++ = MAKE_BOXED(to);
-	    to += (arity+1);
+	    ERL_NIF_TERM* srcp = GET_BOXED(src);
+	    *from++ = MAKE_BOXED(flat_node(srcp, GET_ARITYVAL(*srcp)+1, &to));
 	    break;
 	}
 	case TAG_PRIMARY_IMMED1:
 	    from++;
+	    break;
 	}
     }
     return dst_term;
 }
 
-
 // copy src_term into dst_env and return the term copy
 ERL_NIF_TERM enif_make_flat_copy(ErlNifEnv* dst_env, ERL_NIF_TERM src_term)
 {
     return flat_copy(dst_env, src_term);
 }
 
-// 
-// STRUCT COPY - struct copy without a stack
-// and repair the original using a log
 //
-#define IN_RANGE(ptr,src0,src1) (((ptr) >= src0) && ((ptr) <= src1))
+// STRUCT COPY - copy preserving shared sub terms
+//
+// A term that references the same sub term many times (a DAG) is copied
+// with each distinct node copied once, so size and time are linear in
+// the number of distinct nodes instead of the number of paths. A pointer
+// table maps source nodes to their copies, the source is not modified,
+// so it may be read by other threads meanwhile. The table lookups make
+// this slower than enif_make_copy for terms without sharing.
+//
 
-#define SET_POINTER(logp, srcp, value) do {		\
-	if ((logp)) {				\
-	    (logp)[0] = (ERL_NIF_TERM) (srcp);	\
-	    (logp)[1] = (srcp)[0];		\
-	    logp += 2;				\
-	}					\
-	(srcp)[0] = (value);			\
-    } while(0)	
+typedef struct {
+    ERL_NIF_TERM* src;
+    ERL_NIF_TERM* dst;   // NULL until copied
+} ptr_entry_t;
 
+typedef struct {
+    int bits;
+    size_t used;
+    ptr_entry_t* tab;
+} ptr_table_t;
 
-static inline ERL_NIF_TERM struct_copy(ErlNifEnv* dst_env,
-				       ERL_NIF_TERM src_term)
+#define PTR_TABLE_BITS 6
+
+static inline size_t ptr_hash(ERL_NIF_TERM* ptr, int bits)
 {
-    ERL_NIF_UINT size;
-    ERL_NIF_TERM* srcp;
-    ERL_NIF_TERM* from;
-    ERL_NIF_TERM* to0;
-    ERL_NIF_TERM* to;
-    ERL_NIF_TERM* to_end;
-    ERL_NIF_TERM  dst_term;
-    ERL_NIF_TERM* logp0;
-    ERL_NIF_TERM* logp;
-    ERL_NIF_TERM* ptr;
+    return (size_t) (((uint64_t) (uintptr_t) ptr *
+		      UINT64_C(0x9E3779B97F4A7C15)) >> (64 - bits));
+}
 
-    if ((size = flat_size(src_term)) == 0)
-	return src_term;
-    to0 = cnif_heap_alloc(dst_env, size);  // must be consecutive chunk
-    to  = to0;
-    from = to0;
+static int ptr_table_init(ptr_table_t* t)
+{
+    size_t n = (size_t) 1 << PTR_TABLE_BITS;
+    t->bits = PTR_TABLE_BITS;
+    t->used = 0;
+    if ((t->tab = enif_alloc(n*sizeof(ptr_entry_t))) == NULL)
+	return 0;
+    memset(t->tab, 0, n*sizeof(ptr_entry_t));
+    return 1;
+}
 
-    logp0 = (ERL_NIF_TERM*) enif_alloc(2*size*sizeof(ERL_NIF_TERM*));
-    logp = logp0;
+static void ptr_table_free(ptr_table_t* t)
+{
+    enif_free(t->tab);
+}
 
-    switch(src_term & 3) {
-    case TAG_PRIMARY_HEADER: // FIXME: fail
+// find the entry for ptr, in the empty slot where it goes if missing
+static inline ptr_entry_t* ptr_table_find(ptr_table_t* t, ERL_NIF_TERM* ptr)
+{
+    size_t mask = ((size_t) 1 << t->bits) - 1;
+    size_t i = ptr_hash(ptr, t->bits);
+
+    while((t->tab[i].src != NULL) && (t->tab[i].src != ptr))
+	i = (i + 1) & mask;
+    return &t->tab[i];
+}
+
+// return 0, with the table as it was, if the new table can not be
+// allocated
+static int ptr_table_grow(ptr_table_t* t)
+{
+    size_t n = (size_t) 1 << t->bits;
+    ptr_entry_t* old = t->tab;
+    size_t i;
+
+    if ((t->tab = enif_alloc(2*n*sizeof(ptr_entry_t))) == NULL) {
+	t->tab = old;
 	return 0;
-    case TAG_PRIMARY_LIST: {
-	ERL_NIF_TERM* srcp = GET_LIST(src_term);
-	to[0] = srcp[0];
-	to[1] = srcp[1];
-	dst_term = MAKE_LIST(to);
-	SET_POINTER(logp, srcp, dst_term);
-	to += 2;
-	break;
     }
-    case TAG_PRIMARY_BOXED: {
-	ERL_NIF_TERM* srcp  = GET_BOXED(src_term);
-	ERL_NIF_UINT  arity = GET_ARITYVAL(*srcp);
-	ERL_NIF_UINT  i;
-	for (i = 0; i <= arity; i++)
-	    to[i] = srcp[i];
-	dst_term = MAKE_BOXED(to);
-	SET_POINTER(logp, srcp, dst_term);
-	to += (arity+1);
-	break;
+    t->bits++;
+    memset(t->tab, 0, 2*n*sizeof(ptr_entry_t));
+    for (i = 0; i < n; i++) {
+	if (old[i].src != NULL)
+	    *ptr_table_find(t, old[i].src) = old[i];
     }
-    case TAG_PRIMARY_IMMED1: // FIXME: fail
+    enif_free(old);
+    return 1;
+}
+
+// enter ptr, return 1 if it was not seen before, 0 if it was and -1
+// if the table could not grow
+static int ptr_table_add(ptr_table_t* t, ERL_NIF_TERM* ptr)
+{
+    ptr_entry_t* ep = ptr_table_find(t, ptr);
+
+    if (ep->src != NULL)
 	return 0;
+    ep->src = ptr;
+    if ((++t->used > ((size_t) 1 << t->bits)/2) && !ptr_table_grow(t))
+	return -1;
+    return 1;
+}
+
+// size of term with each distinct node counted once, nodes are entered
+// in visited. Return 0 if visited can not grow.
+static int struct_size(ERL_NIF_TERM src_term, ptr_table_t* visited,
+		       ERL_NIF_UINT* szp)
+{
+    wstack_t stack;
+    ERL_NIF_UINT sz = 0;
+    int r;
+
+    wstack_init(&stack);
+    push_node(&stack, src_term);
+    while(!wstack_is_empty(&stack)) {
+	ERL_NIF_TERM t = wstack_pop(&stack);
+	ERL_NIF_TERM* ptr = GET_PTR(t);
+
+	if ((r = ptr_table_add(visited, ptr)) < 0) {
+	    wstack_free(&stack);
+	    return 0;
+	}
+	if (r == 0)
+	    continue;
+	if (IS_LIST(t)) {
+	    sz += 2;
+	    push_node(&stack, ptr[1]);
+	    push_node(&stack, ptr[0]);
+	}
+	else {
+	    sz += GET_ARITYVAL(ptr[0]) + 1;
+	    push_boxed_terms(&stack, ptr);
+	}
     }
+    wstack_free(&stack);
+    *szp = sz;
+    return 1;
+}
 
-    while(from < to) {
-	ERL_NIF_TERM src = *from;
-	switch(src & 3) {
-	case TAG_PRIMARY_HEADER: {
-	    ERL_NIF_UINT arity = GET_ARITYVAL(src);
-	    switch(src & _TAG_HEADER_MASK) {
-	    case TAG_HEADER_POS_BIG:
-	    case TAG_HEADER_NEG_BIG:
-	    case TAG_HEADER_FLOAT:
-	    case TAG_HEADER_HEAP_BIN:
-	    case TAG_HEADER_EXTERNAL_PID:
-	    case TAG_HEADER_EXTERNAL_PORT:
-	    case TAG_HEADER_EXTERNAL_REF:
-	    case TAG_HEADER_BIN_MATCHSTATE:
-		from += (arity+1);
-		break;
-	    case TAG_HEADER_REFC_BIN: {
-		refc_binary_t* rbp = (refc_binary_t*) from;
-		rbp->val->refc++;
-		// fixme: link it
-		from += (arity+1);
-		break;
-	    }
-	    case TAG_HEADER_ARITYVAL:
-		from++;
-		break;
-	    case TAG_HEADER_SUB_BIN: {
-		sub_binary_t* sbp = (sub_binary_t*) from;
-		from = (ERL_NIF_TERM*) &sbp->orig;
-	    }
-	    case TAG_HEADER_MAP: {
-		flatmap_t* mp = (flatmap_t*) from;
-		from = (ERL_NIF_TERM*) &mp->keys;
-	    }
-	    default:
-		// FIXME: fail
-		return 0;
-	    }
+// Copy with a work stack of (slot, source term) pairs. Each node is
+// looked up once per reference: the first reference copies it and
+// pushes its term slots, later references take the copy.
+static ERL_NIF_TERM struct_copy(ErlNifEnv* dst_env, ERL_NIF_TERM src_term)
+{
+    ptr_table_t visited;
+    wstack_t stack;
+    ERL_NIF_TERM dst_term;
+
+    if (!IS_LIST(src_term) && !IS_BOXED(src_term))
+	return src_term;
+    if (!ptr_table_init(&visited))
+	return INVALID_TERM;
+    wstack_init(&stack);
+    wstack_push(&stack, (ERL_NIF_TERM) &dst_term);
+    wstack_push(&stack, src_term);
+    while(!wstack_is_empty(&stack)) {
+	ERL_NIF_TERM t = wstack_pop(&stack);
+	ERL_NIF_TERM* slot = (ERL_NIF_TERM*) wstack_pop(&stack);
+	ERL_NIF_TERM* srcp;
+	ERL_NIF_TERM* dstp;
+	ptr_entry_t* ep;
+	ERL_NIF_UINT n, i;
+
+	if (IS_LIST(t))
+	    n = 2;
+	else if (IS_BOXED(t))
+	    n = GET_ARITYVAL(*GET_BOXED(t)) + 1;
+	else {
+	    *slot = t;
+	    continue;
+	}
+	srcp = GET_PTR(t);
+	ep = ptr_table_find(&visited, srcp);
+	if (ep->src != NULL) {
+	    *slot = IS_LIST(t) ? MAKE_LIST(ep->dst) : MAKE_BOXED(ep->dst);
+	    continue;
+	}
+	if ((dstp = cnif_heap_alloc(dst_env, n)) == NULL) {
+	    dst_term = INVALID_TERM;
+	    break;
+	}
+	memcpy(dstp, srcp, n*sizeof(ERL_NIF_TERM));
+	ep->src = srcp;
+	ep->dst = dstp;
+	if ((++visited.used > ((size_t) 1 << visited.bits)/2) &&
+	    !ptr_table_grow(&visited)) {
+	    dst_term = INVALID_TERM;
 	    break;
 	}
 
-	case TAG_PRIMARY_LIST: {
-	    ERL_NIF_TERM* srcp = GET_LIST(src);
-	    if (IS_LIST(srcp[0]) && IN_RANGE(GET_PTR(srcp[0]),to0,to)) {
-		printf("reuse list = %p\n", (ERL_NIF_TERM*) srcp[0]);
-		*from++ = srcp[0];
+	if (IS_LIST(t)) {
+	    *slot = MAKE_LIST(dstp);
+	    wstack_push(&stack, (ERL_NIF_TERM) &dstp[1]);
+	    wstack_push(&stack, dstp[1]);
+	    wstack_push(&stack, (ERL_NIF_TERM) &dstp[0]);
+	    wstack_push(&stack, dstp[0]);
+	    continue;
+	}
+	*slot = MAKE_BOXED(dstp);
+	switch(dstp[0] & _TAG_HEADER_MASK) {
+	case TAG_HEADER_ARITYVAL:
+	    for (i = n-1; i >= 1; i--) {
+		wstack_push(&stack, (ERL_NIF_TERM) &dstp[i]);
+		wstack_push(&stack, dstp[i]);
 	    }
-	    else {
-		to[0] = srcp[0];
-		to[1] = srcp[1];
-		*from = MAKE_LIST(to);
-		SET_POINTER(logp, srcp, *from);
-		from++;
-		to += 2;
+	    break;
+	case TAG_HEADER_REFC_BIN: {
+	    refc_binary_t* rbp = (refc_binary_t*) dstp;
+	    if (!cnif_binary_keep(dst_env, rbp->val)) {
+		dst_term = INVALID_TERM;
+		goto done;
 	    }
+	    rbp->next = 0;
 	    break;
 	}
-	case TAG_PRIMARY_BOXED: {
-	    ERL_NIF_TERM* srcp  = GET_BOXED(src);
-	    if (IS_BOXED(srcp[0]) && IN_RANGE(GET_PTR(srcp[0]),to0,to)) {
-		printf("reuse structure = %p\n", (ERL_NIF_TERM*) srcp[0]);
-		*from++ = srcp[0];
-	    }
-	    else {
-		ERL_NIF_UINT  arity = GET_ARITYVAL(*srcp);
-		ERL_NIF_UINT  i;
-		for (i = 0; i <= arity; i++)
-		    to[i] = srcp[i];
-		*from = MAKE_BOXED(to);
-		SET_POINTER(logp, srcp, *from);
-		from++;
-		to += (arity+1);
+	case TAG_HEADER_SUB_BIN: {
+	    sub_binary_t* sbp = (sub_binary_t*) dstp;
+	    wstack_push(&stack, (ERL_NIF_TERM) &sbp->orig);
+	    wstack_push(&stack, sbp->orig);
+	    break;
+	}
+	case TAG_HEADER_MAP: {
+	    // keys (or hashmap marker) and values/root are terms
+	    flatmap_t* mp = (flatmap_t*) dstp;
+	    ERL_NIF_TERM* ptr = (ERL_NIF_TERM*) &mp->keys;
+	    for (; ptr < dstp + n; ptr++) {
+		wstack_push(&stack, (ERL_NIF_TERM) ptr);
+		wstack_push(&stack, *ptr);
 	    }
 	    break;
 	}
-	case TAG_PRIMARY_IMMED1: 
-	    from++;
+	default:
+	    // numbers, heap binaries and other data words
+	    break;
 	}
     }
-    printf("struct size = %ld\n", (to - to0));
-
-    // restore pointers
-    ptr = logp0;
-    while(ptr < logp) {
-	printf("restore pointer %p\n", (ERL_NIF_TERM*) ptr[0]);
-	*((ERL_NIF_TERM*) ptr[0]) = ptr[1];
-	ptr += 2;
+done:
+    wstack_free(&stack);
+    ptr_table_free(&visited);
+    return dst_term;
+}
+
+// copy src_term into dst_env keeping shared sub terms shared
+ERL_NIF_TERM enif_make_struct_copy(ErlNifEnv* dst_env, ERL_NIF_TERM src_term)
+{
+    return struct_copy(dst_env, src_term);
+}
+
+// heap size of src_term with shared sub terms counted once, 0 also
+// when out of memory
+ERL_NIF_UINT enif_struct_size(ERL_NIF_TERM src_term)
+{
+    ptr_table_t visited;
+    ERL_NIF_UINT size;
+
+    if (!IS_LIST(src_term) && !IS_BOXED(src_term))
+	return 0;
+    if (!ptr_table_init(&visited))
+	return 0;
+    if (!struct_size(src_term, &visited, &size))
+	size = 0;
+    ptr_table_free(&visited);
+    return size;
+}
+
+//
+// TRANSFER - hand a term over to another env
+//
+// When every node of a term lives in the heap of src the whole src heap
+// is adopted by dst in O(fragments) and the term is returned as is,
+// otherwise the term is copied into dst and src is left untouched.
+// Checking ownership reads each node header once but writes nothing.
+//
+
+typedef struct {
+    ERL_NIF_TERM* lo;
+    ERL_NIF_TERM* hi;
+} heap_range_t;
+
+static int range_cmp(const void* a, const void* b)
+{
+    ERL_NIF_TERM* x = ((const heap_range_t*) a)->lo;
+    ERL_NIF_TERM* y = ((const heap_range_t*) b)->lo;
+    return (x < y) ? -1 : ((x > y) ? 1 : 0);
+}
+
+// find the range holding ptr, try the last hit first
+static inline int range_member(heap_range_t* r, size_t n, size_t* hint,
+			       ERL_NIF_TERM* ptr)
+{
+    size_t lo = 0, hi = n;
+
+    if ((ptr >= r[*hint].lo) && (ptr < r[*hint].hi))
+	return 1;
+    while(lo < hi) {
+	size_t mid = (lo + hi) / 2;
+	if (ptr < r[mid].lo)
+	    hi = mid;
+	else if (ptr >= r[mid].hi)
+	    lo = mid + 1;
+	else {
+	    *hint = mid;
+	    return 1;
+	}
     }
-    enif_free(logp0);
+    return 0;
+}
 
-    return dst_term;
+// the fragments of env sorted on address, rp is set to NULL when there
+// are none. Return 0 if the ranges can not be allocated
+static int heap_ranges(ErlNifEnv* env, heap_range_t** rp, size_t* np)
+{
+    heap_range_t* r;
+    size_t n;
+
+    *rp = NULL;
+    *np = 0;
+    if ((n = cnif_heap_ranges(env, NULL, 0)) == 0)
+	return 1;
+    if ((r = enif_alloc(n*sizeof(heap_range_t))) == NULL)
+	return 0;
+    cnif_heap_ranges(env, (ERL_NIF_TERM**) r, n);
+    qsort(r, n, sizeof(heap_range_t), range_cmp);
+    *rp = r;
+    *np = n;
+    return 1;
+}
+
+// 0 also when the ranges can not be allocated, callers then copy
+static int env_member(ErlNifEnv* env, ERL_NIF_TERM term)
+{
+    heap_range_t* r;
+    size_t n, hint = 0;
+    wstack_t stack;
+    int member = 1;
+
+    if (!IS_LIST(term) && !IS_BOXED(term))
+	return 1;
+    if (!heap_ranges(env, &r, &n) || (r == NULL))
+	return 0;
+
+    wstack_init(&stack);
+    push_node(&stack, term);
+    while(member && !wstack_is_empty(&stack)) {
+	ERL_NIF_TERM t = wstack_pop(&stack);
+	while(IS_LIST(t)) {
+	    ERL_NIF_TERM* ptr = GET_LIST(t);
+	    if (!range_member(r, n, &hint, ptr)) {
+		member = 0;
+		break;
+	    }
+	    push_node(&stack, ptr[0]);
+	    t = ptr[1];
+	}
+	if (member && IS_BOXED(t)) {
+	    ERL_NIF_TERM* ptr = GET_BOXED(t);
+	    if (!range_member(r, n, &hint, ptr))
+		member = 0;
+	    else
+		push_boxed_terms(&stack, ptr);
+	}
+    }
+    wstack_free(&stack);
+    enif_free(r);
+    return member;
+}
+
+// check that all nodes of term live in the heap of env
+int enif_is_env_term(ErlNifEnv* env, ERL_NIF_TERM term)
+{
+    return env_member(env, term);
+}
+
+// move term from src to dst, src is emptied when the term was adopted
+ERL_NIF_TERM enif_env_transfer_term(ErlNifEnv* dst, ErlNifEnv* src,
+				    ERL_NIF_TERM term)
+{
+    if ((dst != src) && env_member(src, term) && enif_env_adopt(dst, src))
+	return term;
+    return flat_copy(dst, term);
 }
 
 //
-//  Structure copy with repair
+// GC - compact the heap of an env around a set of roots
 //
-ERL_NIF_TERM enif_make_struct_copy(ErlNifEnv* dst_env, ERL_NIF_TERM src_term)
+// A Cheney copy of the nodes reachable from the roots into a scratch
+// block, each copied node in the old heap is overwritten with a forward
+// to its copy so shared sub terms stay shared. A forwarded cons has its
+// car replaced by the new address (header tagged, which a car never is),
+// a forwarded boxed node has its header replaced by the new boxed term.
+// Nodes outside the env heap are left in place and are not scanned.
+// The live block is then moved into one fresh fragment, which also has
+// room for new terms, and the old fragments are freed.
+//
+
+typedef struct {
+    heap_range_t* r;
+    size_t n;
+    size_t hint;
+    ERL_NIF_TERM* to;
+} gc_t;
+
+static inline ERL_NIF_TERM gc_evacuate(gc_t* gc, ERL_NIF_TERM t)
 {
-    return struct_copy(dst_env, src_term);
+    ERL_NIF_TERM* srcp;
+    ERL_NIF_TERM* dstp;
+    ERL_NIF_UINT n;
+
+    if (IS_LIST(t)) {
+	srcp = GET_LIST(t);
+	if (!range_member(gc->r, gc->n, &gc->hint, srcp))
+	    return t;
+	if ((srcp[0] & 3) == TAG_PRIMARY_HEADER)
+	    return MAKE_LIST((ERL_NIF_TERM*) srcp[0]);
+	dstp = flat_node(srcp, 2, &gc->to);
+	srcp[0] = (ERL_NIF_TERM) dstp;
+	return MAKE_LIST(dstp);
+    }
+    if (IS_BOXED(t)) {
+	srcp = GET_BOXED(t);
+	if (!range_member(gc->r, gc->n, &gc->hint, srcp))
+	    return t;
+	if ((srcp[0] & 3) != TAG_PRIMARY_HEADER)
+	    return srcp[0];
+	n = GET_ARITYVAL(srcp[0]) + 1;
+	dstp = flat_node(srcp, n, &gc->to);
+	srcp[0] = MAKE_BOXED(dstp);
+	return MAKE_BOXED(dstp);
+    }
+    return t;
+}
+
+// the next word holding a term after the header at ptr
+static inline ERL_NIF_TERM* gc_skip(ERL_NIF_TERM* ptr)
+{
+    switch(*ptr & _TAG_HEADER_MASK) {
+    case TAG_HEADER_ARITYVAL:
+	return ptr + 1;
+    case TAG_HEADER_SUB_BIN:
+	return (ERL_NIF_TERM*) &((sub_binary_t*) ptr)->orig;
+    case TAG_HEADER_MAP:
+	return (ERL_NIF_TERM*) &((flatmap_t*) ptr)->keys;
+    case TAG_HEADER_REFC_BIN:
+	((refc_binary_t*) ptr)->next = 0;
+	return ptr + GET_ARITYVAL(*ptr) + 1;
+    default:
+	// numbers, heap binaries and other data words
+	return ptr + GET_ARITYVAL(*ptr) + 1;
+    }
+}
+
+// move pointers into [lo,hi) by delta words
+static inline ERL_NIF_TERM gc_relocate(ERL_NIF_TERM t, ERL_NIF_TERM* lo,
+				       ERL_NIF_TERM* hi, ptrdiff_t delta)
+{
+    if (IS_LIST(t) || IS_BOXED(t)) {
+	ERL_NIF_TERM* ptr = GET_PTR(t);
+	if ((ptr >= lo) && (ptr < hi))
+	    return (ERL_NIF_TERM) (ptr + delta) | (t & 3);
+    }
+    return t;
+}
+
+// Keep the terms reachable from roots, rewrite the roots to their new
+// location and release everything else in env. Terms of env not
+// reachable from the roots are invalid after the call, as are interned
+// map shapes. Return 0 and leave env as is if the fragment ranges or the
+// scratch block can not be allocated, should the final move fail env is
+// cleared and the roots are set to INVALID_TERM.
+int enif_env_gc(ErlNifEnv* env, ERL_NIF_TERM roots[], unsigned nroots)
+{
+    ErlNifEnv* fresh;
+    ERL_NIF_TERM* block;
+    ERL_NIF_TERM* scan;
+    ERL_NIF_TERM* dstp;
+    ERL_NIF_UINT bound = 0;
+    ERL_NIF_UINT live;
+    gc_t gc;
+    size_t i;
+
+    if (!heap_ranges(env, &gc.r, &gc.n))
+	return 0;
+    if (gc.r == NULL)  // empty heap, nothing to collect
+	return 1;
+    // set up the new heap before anything is forwarded
+    if ((fresh = enif_alloc_env()) == NULL) {
+	enif_free(gc.r);
+	return 0;
+    }
+    if (!cnif_env_set_allocator(fresh, cnif_env_allocator(env)))
+	goto error;
+    gc.hint = 0;
+    // the live data is never larger than the old heap
+    for (i = 0; i < gc.n; i++)
+	bound += (gc.r[i].hi - gc.r[i].lo);
+    if ((block = enif_alloc(bound*sizeof(ERL_NIF_TERM))) == NULL)
+	goto error;
+    gc.to = block;
+    for (i = 0; i < nroots; i++)
+	roots[i] = gc_evacuate(&gc, roots[i]);
+    scan = block;
+    while(scan < gc.to) {
+	if ((*scan & 3) == TAG_PRIMARY_HEADER)
+	    scan = gc_skip(scan);
+	else {
+	    *scan = gc_evacuate(&gc, *scan);
+	    scan++;
+	}
+    }
+    enif_free(gc.r);
+
+    // move the live block into place in the fresh heap
+    if ((live = gc.to - block) > 0) {
+	ptrdiff_t delta;
+
+	if ((dstp = cnif_heap_alloc(fresh, live)) == NULL) {
+	    for (i = 0; i < nroots; i++)
+		roots[i] = INVALID_TERM;
+	    enif_free(block);
+	    enif_free_env(fresh);
+	    enif_clear_env(env);
+	    return 0;
+	}
+	memcpy(dstp, block, live*sizeof(ERL_NIF_TERM));
+	delta = dstp - block;
+	scan = dstp;
+	while(scan < dstp + live) {
+	    if ((*scan & 3) == TAG_PRIMARY_HEADER)
+		scan = gc_skip(scan);
+	    else {
+		*scan = gc_relocate(*scan, block, gc.to, delta);
+		scan++;
+	    }
+	}
+	for (i = 0; i < nroots; i++)
+	    roots[i] = gc_relocate(roots[i], block, gc.to, delta);
+    }
+    enif_free(block);
+    cnif_heap_free(env);
+    enif_env_adopt(env, fresh);
+    enif_free_env(fresh);
+    return 1;
+error:
+    enif_free(gc.r);
+    enif_free_env(fresh);
+    return 0;
 }
@@ -0,0 +1,463 @@
+//
+// Term hashing
+//
+#include "../include/cnif.h"
+#include "../include/cnif_term.h"
+#include "../include/cnif_misc.h"
+#include "../include/cnif_hash.h"
+#include "../include/cnif_hashmap.h"
+
+#define HASH_K1 UINT64_C(0x9e3779b97f4a7c15)
+#define HASH_K2 UINT64_C(0xbf58476d1ce4e5b9)
+
+// type tags mixed in before each item
+#define HASH_INTEGER  1
+#define HASH_BIGNUM   2
+#define HASH_FLOAT    3
+#define HASH_ATOM     4
+#define HASH_TUPLE    5
+#define HASH_MAP      6
+#define HASH_NIL      7
+#define HASH_LIST     8
+#define HASH_BINARY   9
+#define HASH_OTHER    10
+
+static inline uint64_t hash_mix(uint64_t h, uint64_t x)
+{
+    h ^= x * HASH_K1;
+    h = (h << 31) | (h >> 33);
+    return h * HASH_K2;
+}
+
+static inline uint64_t hash_final(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= UINT64_C(0xff51afd7ed558ccd);
+    h ^= h >> 33;
+    h *= UINT64_C(0xc4ceb9fe1a85ec53);
+    h ^= h >> 33;
+    return h;
+}
+
+static uint64_t hash_bytes(uint64_t h, const uint8_t* ptr, size_t len)
+{
+    uint64_t w;
+
+    h = hash_mix(h, len);
+    while(len >= 8) {
+	memcpy(&w, ptr, 8);
+	h = hash_mix(h, w);
+	ptr += 8;
+	len -= 8;
+    }
+    if (len > 0) {
+	w = 0;
+	memcpy(&w, ptr, len);
+	h = hash_mix(h, w);
+    }
+    return h;
+}
+
+// integers in int64 range and integral floats hash the same
+static inline uint64_t hash_number(uint64_t h, ERL_NIF_TERM term)
+{
+    ErlNifSInt64 i;
+    double f;
+
+    if (enif_get_int64(NULL, term, &i))
+	return hash_mix(hash_mix(h, HASH_INTEGER), (uint64_t) i);
+    if (enif_get_double(NULL, term, &f)) {
+	if ((f >= -9223372036854775808.0) && (f < 9223372036854775808.0) &&
+	    ((double)(ErlNifSInt64) f == f))
+	    return hash_mix(hash_mix(h, HASH_INTEGER),
+			    (uint64_t)(ErlNifSInt64) f);
+	memcpy(&i, &f, sizeof(double));
+	return hash_mix(hash_mix(h, HASH_FLOAT), (uint64_t) i);
+    }
+    else {
+	// bignum outside int64 range, sign is in the header
+	ERL_NIF_TERM* ptr = GET_BOXED(term);
+	ERL_NIF_UINT ari = GET_ARITYVAL(ptr[0]);
+	h = hash_mix(hash_mix(h, HASH_BIGNUM), ptr[0]);
+	return hash_bytes(h, (uint8_t*)(ptr+1), ari*sizeof(ERL_NIF_TERM));
+    }
+}
+
+static uint64_t hash_term(uint64_t h, ERL_NIF_TERM term);
+
+// sum of pair hashes, independent of map representation and order
+static uint64_t hash_map(uint64_t h, ERL_NIF_TERM term)
+{
+    flatmap_t* mp = (flatmap_t*) GET_MAP(term);
+    uint64_t sum = 0;
+    ERL_NIF_UINT i;
+
+    h = hash_mix(hash_mix(h, HASH_MAP), mp->size);
+    if (IS_HASHMAP_PTR(mp)) {
+	ERL_NIF_TERM* leaves = enif_alloc(mp->size*sizeof(ERL_NIF_TERM));
+	cnif_hashmap_leaves(term, leaves);
+	for (i = 0; i < mp->size; i++) {
+	    ERL_NIF_TERM* kv = GET_LIST(leaves[i]);
+	    sum += hash_final(hash_term(hash_term(0, kv[0]), kv[1]));
+	}
+	enif_free(leaves);
+    }
+    else {
+	ERL_NIF_TERM* keys = GET_TUPLE(mp->keys)+1;
+	for (i = 0; i < mp->size; i++)
+	    sum += hash_final(hash_term(hash_term(0, keys[i]), mp->value[i]));
+    }
+    return hash_mix(h, sum);
+}
+
+static uint64_t hash_term(uint64_t h, ERL_NIF_TERM term)
+{
+    wstack_t stack;
+
+    // common map keys, same result as the loop below
+    if (IS_ATOM(term))
+	return hash_mix(hash_mix(h, HASH_ATOM), GET_ATOM(term)->bucket.hvalue);
+    if (IS_SMALL(term))
+	return hash_mix(hash_mix(h, HASH_INTEGER), (uint64_t) GET_SMALL(term));
+
+    wstack_init(&stack);
+    wstack_push(&stack, term);
+    while(!wstack_is_empty(&stack)) {
+	term = wstack_pop(&stack);
+	switch(enif_get_type(term, 0)) {
+	case ENIF_TYPE_INTEGER:
+	case ENIF_TYPE_FLOAT:
+	    h = hash_number(h, term);
+	    break;
+	case ENIF_TYPE_ATOM:
+	    h = hash_mix(hash_mix(h, HASH_ATOM), GET_ATOM(term)->bucket.hvalue);
+	    break;
+	case ENIF_TYPE_NIL:
+	    h = hash_mix(h, HASH_NIL);
+	    break;
+	case ENIF_TYPE_LIST: {
+	    ERL_NIF_TERM* ptr = GET_LIST(term);
+	    h = hash_mix(h, HASH_LIST);
+	    wstack_push(&stack, ptr[1]);
+	    wstack_push(&stack, ptr[0]);
+	    break;
+	}
+	case ENIF_TYPE_TUPLE: {
+	    ERL_NIF_TERM* ptr = GET_TUPLE(term);
+	    ERL_NIF_UINT arity = GET_ARITYVAL(ptr[0]);
+	    h = hash_mix(hash_mix(h, HASH_TUPLE), arity);
+	    while(arity > 0)
+		wstack_push(&stack, ptr[arity--]);
+	    break;
+	}
+	case ENIF_TYPE_MAP:
+	    h = hash_map(h, term);
+	    break;
+	case ENIF_TYPE_BINARY: {
+	    ErlNifBinary bin;
+	    enif_inspect_binary(NULL, term, &bin);
+	    h = hash_bytes(hash_mix(h, HASH_BINARY), bin.data, bin.size);
+	    break;
+	}
+	default:
+	    h = hash_mix(hash_mix(h, HASH_OTHER), term);
+	    break;
+	}
+    }
+    wstack_free(&stack);
+    return h;
+}
+
+uint64_t cnif_hash_term64(ERL_NIF_TERM term, uint64_t salt)
+{
+    return hash_final(hash_term(salt*HASH_K2, term));
+}
+
+uint32_t cnif_hash_term(ERL_NIF_TERM term, uint32_t salt)
+{
+    uint64_t h = cnif_hash_term64(term, salt);
+    return (uint32_t) (h ^ (h >> 32));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// PHASH2
+///////////////////////////////////////////////////////////////////////////////
+
+// The make_hash2 algorithm of erlang:phash2/1, Bob Jenkins lookup2 mixing
+// with a constant per type. Atoms use the hashpjw value cached in the
+// atom bucket, which is the same as the emulator atom hash for latin1 names.
+
+#define HCONST    0x9e3779b9U
+#define HCONST_2  0x3c6ef372U  // HCONST * 2
+#define HCONST_3  0xdaa66d2bU  // HCONST * 3
+#define HCONST_4  0x78dde6e4U  // HCONST * 4
+#define HCONST_9  0x8ff34781U  // HCONST * 9
+#define HCONST_10 0x2e2ac13aU  // HCONST * 10
+#define HCONST_11 0xcc623af3U  // HCONST * 11
+#define HCONST_12 0x6a99b4acU  // HCONST * 12
+#define HCONST_13 0x08d12e65U  // HCONST * 13
+#define HCONST_16 0xe3779b90U  // HCONST * 16
+#define HCONST_19 0xbe1e08bbU  // HCONST * 19
+#define HCONST_22 0x98c475e6U  // HCONST * 22
+
+#define MIX(a,b,c) do {				\
+	a -= b; a -= c; a ^= (c>>13);		\
+	b -= c; b -= a; b ^= (a<<8);		\
+	c -= a; c -= b; c ^= (b>>13);		\
+	a -= b; a -= c; a ^= (c>>12);		\
+	b -= c; b -= a; b ^= (a<<16);		\
+	c -= a; c -= b; c ^= (b>>5);		\
+	a -= b; a -= c; a ^= (c>>3);		\
+	b -= c; b -= a; b ^= (a<<10);		\
+	c -= a; c -= b; c ^= (b>>15);		\
+    } while(0)
+
+#define UINT32_HASH_2(e1, e2, k) do {		\
+	uint32_t a = (k) + (uint32_t) (e1);	\
+	uint32_t b = (k) + (uint32_t) (e2);	\
+	MIX(a, b, hash);			\
+    } while(0)
+
+#define UINT32_HASH(e, k) UINT32_HASH_2(e, 0, k)
+
+// negative numbers are mixed twice, as in the emulator
+#define SINT32_HASH(e, k) do {			\
+	int32_t y = (int32_t) (e);		\
+	if (y < 0)				\
+	    UINT32_HASH(-y, k);			\
+	UINT32_HASH(y, k);			\
+    } while(0)
+
+#define IS_SSMALL28(x) (((x) >= -(INT64_C(1) << 27)) && ((x) < (INT64_C(1) << 27)))
+
+#define NIL_HASH 3468870702U
+#define NIL_EXT  106         // external format tag, mixed for a nested []
+
+// stack markers, header words are never terms
+#define PHASH2_MAP_PAIR MAKE_ARITYVAL(1)
+#define PHASH2_MAP_TAIL MAKE_ARITYVAL(2)
+
+static uint32_t block_hash(const uint8_t* k, size_t length, uint32_t initval)
+{
+    uint32_t a = HCONST, b = HCONST, c = initval;
+    size_t len = length;
+
+    while(len >= 12) {
+	a += (k[0] + ((uint32_t)k[1]<<8) + ((uint32_t)k[2]<<16) +
+	      ((uint32_t)k[3]<<24));
+	b += (k[4] + ((uint32_t)k[5]<<8) + ((uint32_t)k[6]<<16) +
+	      ((uint32_t)k[7]<<24));
+	c += (k[8] + ((uint32_t)k[9]<<8) + ((uint32_t)k[10]<<16) +
+	      ((uint32_t)k[11]<<24));
+	MIX(a,b,c);
+	k += 12;
+	len -= 12;
+    }
+    c += (uint32_t) length;
+    switch(len) {  // all cases fall through
+    case 11: c += ((uint32_t)k[10]<<24);
+    case 10: c += ((uint32_t)k[9]<<16);
+    case 9 : c += ((uint32_t)k[8]<<8);
+    case 8 : b += ((uint32_t)k[7]<<24);
+    case 7 : b += ((uint32_t)k[6]<<16);
+    case 6 : b += ((uint32_t)k[5]<<8);
+    case 5 : b += k[4];
+    case 4 : a += ((uint32_t)k[3]<<24);
+    case 3 : a += ((uint32_t)k[2]<<16);
+    case 2 : a += ((uint32_t)k[1]<<8);
+    case 1 : a += k[0];
+    }
+    MIX(a,b,c);
+    return c;
+}
+
+// integer magnitude in 32 bit digit pairs, low digits first
+static uint32_t phash2_bignum(uint32_t hash, ERL_NIF_TERM term)
+{
+    ERL_NIF_TERM* ptr = GET_BOXED(term);
+    ERL_NIF_UINT i, ari = GET_ARITYVAL(ptr[0]);
+    uint32_t con = IS_NEG_BIGVAL(ptr[0]) ? HCONST_10 : HCONST_11;
+
+#if WORDSIZE == 64
+    for (i = 1; i <= ari; i++)
+	UINT32_HASH_2(ptr[i], ptr[i] >> 32, con);
+#else
+    for (i = 1; i <= ari; i += 2)
+	UINT32_HASH_2(ptr[i], (i < ari) ? ptr[i+1] : 0, con);
+#endif
+    return hash;
+}
+
+static uint32_t phash2_int64(uint32_t hash, ErlNifSInt64 x)
+{
+    if (IS_SSMALL28(x))
+	SINT32_HASH(x, HCONST);
+    else {
+	uint64_t u = (x < 0) ? -(uint64_t) x : (uint64_t) x;
+	uint32_t con = (x < 0) ? HCONST_10 : HCONST_11;
+	UINT32_HASH_2(u, u >> 32, con);
+    }
+    return hash;
+}
+
+uint32_t cnif_phash2(ERL_NIF_TERM term)
+{
+    wstack_t stack;
+    uint32_t hash = 0;
+    uint32_t hash_xor_pairs = 0;
+
+    // common immediates, same result as the loop below
+    if (IS_ATOM(term))
+	return GET_ATOM(term)->bucket.hvalue;
+    if (IS_SMALL(term))
+	return phash2_int64(0, GET_SMALL(term));
+
+    wstack_init(&stack);
+    while(1) {
+	switch(enif_get_type(term, 0)) {
+	case ENIF_TYPE_INTEGER: {
+	    ErlNifSInt64 x;
+	    if (enif_get_int64(NULL, term, &x))
+		hash = phash2_int64(hash, x);
+	    else
+		hash = phash2_bignum(hash, term);
+	    break;
+	}
+	case ENIF_TYPE_FLOAT: {
+	    double f;
+	    uint64_t w;
+	    enif_get_double(NULL, term, &f);
+	    if (f == 0.0)  // positive zero
+		f = 0.0;
+	    memcpy(&w, &f, sizeof(double));
+	    UINT32_HASH_2(w >> 32, w, HCONST_12);
+	    break;
+	}
+	case ENIF_TYPE_ATOM:
+	    if (hash == 0)
+		hash = GET_ATOM(term)->bucket.hvalue;
+	    else
+		UINT32_HASH(GET_ATOM(term)->bucket.hvalue, HCONST_3);
+	    break;
+	case ENIF_TYPE_NIL:
+	    if (hash == 0)
+		hash = NIL_HASH;
+	    else
+		UINT32_HASH(NIL_EXT, HCONST_2);
+	    break;
+	case ENIF_TYPE_LIST: {
+	    // runs of bytes are mixed four at a time, as strings
+	    ERL_NIF_TERM* ptr = GET_LIST(term);
+	    uint32_t sh = 0;
+	    int c = 0;
+	    while(IS_SMALL(ptr[0]) && ((ERL_NIF_UINT) GET_SMALL(ptr[0]) < 256)) {
+		sh = (sh << 8) + (uint32_t) GET_SMALL(ptr[0]);
+		if (c == 3) {
+		    UINT32_HASH(sh, HCONST_4);
+		    c = 0;
+		    sh = 0;
+		}
+		else
+		    c++;
+		term = ptr[1];
+		if (!IS_LIST(term))
+		    break;
+		ptr = GET_LIST(term);
+	    }
+	    if (c > 0)
+		UINT32_HASH(sh, HCONST_4);
+	    if (IS_LIST(term)) {
+		wstack_push(&stack, ptr[1]);
+		term = ptr[0];
+	    }
+	    continue;
+	}
+	case ENIF_TYPE_TUPLE: {
+	    ERL_NIF_TERM* ptr = GET_TUPLE(term);
+	    ERL_NIF_UINT i, arity = GET_ARITYVAL(ptr[0]);
+	    UINT32_HASH(arity, HCONST_9);
+	    if (arity == 0)
+		break;
+	    for (i = arity; i > 1; i--)
+		wstack_push(&stack, ptr[i]);
+	    term = ptr[1];
+	    continue;
+	}
+	case ENIF_TYPE_MAP: {
+	    // xor of the pair hashes, independent of the key order
+	    flatmap_t* mp = (flatmap_t*) GET_MAP(term);
+	    ERL_NIF_UINT i, n = mp->size;
+	    UINT32_HASH(n, HCONST_16);
+	    if (n == 0)
+		break;
+	    wstack_push(&stack, hash_xor_pairs);
+	    wstack_push(&stack, hash);
+	    wstack_push(&stack, PHASH2_MAP_TAIL);
+	    hash = 0;
+	    hash_xor_pairs = 0;
+	    if (IS_HASHMAP_PTR(mp)) {
+		ERL_NIF_TERM* leaves = enif_alloc(n*sizeof(ERL_NIF_TERM));
+		cnif_hashmap_leaves(term, leaves);
+		for (i = 0; i < n; i++) {
+		    ERL_NIF_TERM* kv = GET_LIST(leaves[i]);
+		    wstack_push(&stack, PHASH2_MAP_PAIR);
+		    wstack_push(&stack, kv[1]);
+		    wstack_push(&stack, kv[0]);
+		}
+		enif_free(leaves);
+	    }
+	    else {
+		ERL_NIF_TERM* keys = GET_TUPLE(mp->keys)+1;
+		for (i = n; i > 0; i--) {
+		    wstack_push(&stack, PHASH2_MAP_PAIR);
+		    wstack_push(&stack, mp->value[i-1]);
+		    wstack_push(&stack, keys[i-1]);
+		}
+	    }
+	    break;
+	}
+	case ENIF_TYPE_BINARY: {
+	    ErlNifBinary bin;
+	    uint32_t con;
+	    enif_inspect_binary(NULL, term, &bin);
+	    con = HCONST_13 + hash;
+	    hash = (bin.size == 0) ? con : block_hash(bin.data, bin.size, con);
+	    break;
+	}
+	default:
+	    UINT32_HASH(term, HCONST_22);
+	    break;
+	}
+	// hash holds the value of the previous term, compounded or not
+	while(1) {
+	    if (wstack_is_empty(&stack)) {
+		wstack_free(&stack);
+		return hash;
+	    }
+	    term = wstack_pop(&stack);
+	    if (term == PHASH2_MAP_TAIL) {
+		hash = (uint32_t) wstack_pop(&stack);
+		UINT32_HASH(hash_xor_pairs, HCONST_19);
+		hash_xor_pairs = (uint32_t) wstack_pop(&stack);
+	    }
+	    else if (term == PHASH2_MAP_PAIR) {
+		hash_xor_pairs ^= hash;
+		hash = 0;
+	    }
+	    else
+		break;
+	}
+    }
+}
+
+ErlNifUInt64 enif_hash(ErlNifHash type, ERL_NIF_TERM term, ErlNifUInt64 salt)
+{
+    switch(type) {
+    case ERL_NIF_INTERNAL_HASH:
+	return cnif_hash_term64(term, salt);
+    case ERL_NIF_PHASH2:
+	return cnif_phash2(term) & ((1 << 27) - 1);
+    default:
+	return 0;
+    }
+}
@@ -0,0 +1,622 @@
+//
+// Hash array mapped trie maps
+//
+// A node is a tuple {Bitmap, Child...} with one child per set bit of
+// the 16 bit bitmap, children are sub nodes or leaf cells [Key|Value].
+// Each level consumes 4 bits of the key hash, starting with the most
+// significant bits. When the 32 bits are used up the key is rehashed
+// with the next salt. At HAMT_MAX_DEPTH a node is a collision node,
+// a plain list of leaves (bitmap 0) searched linearly.
+//
+#include <stdlib.h>
+
+#include "../include/cnif.h"
+#include "../include/cnif_term.h"
+#include "../include/cnif_sort.h"
+#include "../include/cnif_hash.h"
+#include "../include/cnif_hashmap.h"
+
+#define HAMT_BITS       4
+#define HAMT_WIDTH      (1 << HAMT_BITS)
+#define HAMT_LEVELS     (32 / HAMT_BITS)  // levels per hash value
+#define HAMT_MAX_SALT   4
+#define HAMT_MAX_DEPTH  (HAMT_MAX_SALT*HAMT_LEVELS)
+
+#define NODE_SIZE(ptr)   (GET_ARITYVAL((ptr)[0])-1)
+#define NODE_BITMAP(ptr) ((unsigned) GET_SMALL((ptr)[1]))
+#define NODE_CHILD(ptr)  ((ptr)+2)
+
+static inline unsigned popcount(unsigned x)
+{
+#if defined(__GNUC__)
+    return __builtin_popcount(x);
+#else
+    unsigned n = 0;
+    while(x) { x &= (x-1); n++; }
+    return n;
+#endif
+}
+
+// key with the hash for the current salt
+typedef struct {
+    ERL_NIF_TERM key;
+    uint32_t hash;
+    uint32_t salt;
+} hkey_t;
+
+static inline void hkey_init(hkey_t* hk, ERL_NIF_TERM key)
+{
+    hk->key  = key;
+    hk->hash = cnif_hash_term(key, 0);
+    hk->salt = 0;
+}
+
+static inline unsigned hash_index(uint32_t hash, unsigned depth)
+{
+    return (hash >> (32 - HAMT_BITS*(1 + depth % HAMT_LEVELS))) &
+	(HAMT_WIDTH-1);
+}
+
+static inline unsigned hkey_index(hkey_t* hk, unsigned depth)
+{
+    uint32_t salt = depth / HAMT_LEVELS;
+    if (salt != hk->salt) {
+	hk->hash = cnif_hash_term(hk->key, salt);
+	hk->salt = salt;
+    }
+    return hash_index(hk->hash, depth);
+}
+
+static inline ERL_NIF_TERM* make_node(ErlNifEnv* env, unsigned bitmap,
+				      unsigned n)
+{
+    ERL_NIF_TERM* ptr = cnif_heap_alloc(env, n+2);
+    if (ptr == NULL)
+	return NULL;
+    ptr[0] = MAKE_ARITYVAL(n+1);
+    ptr[1] = MAKE_SMALL((ERL_NIF_TERM) bitmap);
+    return ptr;
+}
+
+static inline ERL_NIF_TERM make_leaf(ErlNifEnv* env, ERL_NIF_TERM key,
+				     ERL_NIF_TERM value)
+{
+    ERL_NIF_TERM* ptr = cnif_heap_alloc(env, 2);
+    if (ptr == NULL)
+	return INVALID_TERM;
+    ptr[0] = key;
+    ptr[1] = value;
+    return MAKE_LIST(ptr);
+}
+
+static ERL_NIF_TERM make_map(ErlNifEnv* env, ERL_NIF_UINT size,
+			     ERL_NIF_TERM root)
+{
+    hashmap_t* hp = (hashmap_t*) cnif_heap_alloc(env, NWORDS(sizeof(hashmap_t)));
+    if ((hp == NULL) || (root == INVALID_TERM))
+	return INVALID_TERM;
+    hp->header = MAKE_MAPVAL(NWORDS(sizeof(hashmap_t))-1);
+    hp->size   = size;
+    hp->marker = HASHMAP_MARKER;
+    hp->root   = root;
+    return MAKE_MAP(hp);
+}
+
+// copy of node with child at pos replaced, inserted or deleted,
+// INVALID_TERM when the heap is exhausted
+static ERL_NIF_TERM node_replace(ErlNifEnv* env, ERL_NIF_TERM* ptr,
+				 unsigned pos, ERL_NIF_TERM child)
+{
+    unsigned n = NODE_SIZE(ptr);
+    ERL_NIF_TERM* dst;
+
+    if ((child == INVALID_TERM) ||
+	((dst = make_node(env, NODE_BITMAP(ptr), n)) == NULL))
+	return INVALID_TERM;
+    memcpy(NODE_CHILD(dst), NODE_CHILD(ptr), n*sizeof(ERL_NIF_TERM));
+    NODE_CHILD(dst)[pos] = child;
+    return MAKE_TUPLE(dst);
+}
+
+static ERL_NIF_TERM node_insert(ErlNifEnv* env, ERL_NIF_TERM* ptr,
+				unsigned bitmap, unsigned pos,
+				ERL_NIF_TERM child)
+{
+    unsigned n = NODE_SIZE(ptr);
+    ERL_NIF_TERM* dst;
+
+    if ((child == INVALID_TERM) ||
+	((dst = make_node(env, bitmap, n+1)) == NULL))
+	return INVALID_TERM;
+    memcpy(NODE_CHILD(dst), NODE_CHILD(ptr), pos*sizeof(ERL_NIF_TERM));
+    NODE_CHILD(dst)[pos] = child;
+    memcpy(NODE_CHILD(dst)+pos+1, NODE_CHILD(ptr)+pos,
+	   (n-pos)*sizeof(ERL_NIF_TERM));
+    return MAKE_TUPLE(dst);
+}
+
+static ERL_NIF_TERM node_delete(ErlNifEnv* env, ERL_NIF_TERM* ptr,
+				unsigned bitmap, unsigned pos)
+{
+    unsigned n = NODE_SIZE(ptr);
+    ERL_NIF_TERM* dst = make_node(env, bitmap, n-1);
+
+    if (dst == NULL)
+	return INVALID_TERM;
+    memcpy(NODE_CHILD(dst), NODE_CHILD(ptr), pos*sizeof(ERL_NIF_TERM));
+    memcpy(NODE_CHILD(dst)+pos, NODE_CHILD(ptr)+pos+1,
+	   (n-pos-1)*sizeof(ERL_NIF_TERM));
+    return MAKE_TUPLE(dst);
+}
+
+// position of key in a collision node or -1
+static int collision_find(ERL_NIF_TERM* ptr, ERL_NIF_TERM key)
+{
+    unsigned n = NODE_SIZE(ptr);
+    unsigned i;
+    for (i = 0; i < n; i++) {
+	if (cnif_map_key_compare(GET_LIST(NODE_CHILD(ptr)[i])[0], key) == 0)
+	    return i;
+    }
+    return -1;
+}
+
+int cnif_hashmap_get(ERL_NIF_TERM map, ERL_NIF_TERM key, ERL_NIF_TERM* value)
+{
+    hashmap_t* hp = (hashmap_t*) GET_MAP(map);
+    ERL_NIF_TERM* ptr = GET_TUPLE(hp->root);
+    unsigned depth = 0;
+    hkey_t hk;
+
+    hkey_init(&hk, key);
+    while(depth < HAMT_MAX_DEPTH) {
+	unsigned bitmap = NODE_BITMAP(ptr);
+	unsigned bit = 1 << hkey_index(&hk, depth);
+	ERL_NIF_TERM child;
+
+	if (!(bitmap & bit))
+	    return 0;
+	child = NODE_CHILD(ptr)[popcount(bitmap & (bit-1))];
+	if (IS_LIST(child)) {
+	    ERL_NIF_TERM* kv = GET_LIST(child);
+	    if (cnif_map_key_compare(kv[0], key) != 0)
+		return 0;
+	    *value = kv[1];
+	    return 1;
+	}
+	ptr = GET_TUPLE(child);
+	depth++;
+    }
+    {
+	int i = collision_find(ptr, key);
+	if (i < 0)
+	    return 0;
+	*value = GET_LIST(NODE_CHILD(ptr)[i])[1];
+	return 1;
+    }
+}
+
+// node holding two leaves with different keys
+static ERL_NIF_TERM make_pair(ErlNifEnv* env, ERL_NIF_TERM leaf1, hkey_t* hk1,
+			      ERL_NIF_TERM leaf2, hkey_t* hk2, unsigned depth)
+{
+    ERL_NIF_TERM* ptr;
+
+    if (leaf2 == INVALID_TERM)
+	return INVALID_TERM;
+    if (depth < HAMT_MAX_DEPTH) {
+	unsigned i1 = hkey_index(hk1, depth);
+	unsigned i2 = hkey_index(hk2, depth);
+	if (i1 == i2) {
+	    ERL_NIF_TERM sub = make_pair(env, leaf1, hk1, leaf2, hk2, depth+1);
+	    if ((sub == INVALID_TERM) ||
+		((ptr = make_node(env, 1 << i1, 1)) == NULL))
+		return INVALID_TERM;
+	    NODE_CHILD(ptr)[0] = sub;
+	}
+	else {
+	    if ((ptr = make_node(env, (1 << i1) | (1 << i2), 2)) == NULL)
+		return INVALID_TERM;
+	    NODE_CHILD(ptr)[(i1 > i2)] = leaf1;
+	    NODE_CHILD(ptr)[(i2 > i1)] = leaf2;
+	}
+    }
+    else {
+	if ((ptr = make_node(env, 0, 2)) == NULL)
+	    return INVALID_TERM;
+	NODE_CHILD(ptr)[0] = leaf1;
+	NODE_CHILD(ptr)[1] = leaf2;
+    }
+    return MAKE_TUPLE(ptr);
+}
+
+// Return the updated node, node itself when nothing changed or
+// INVALID_TERM when update is set and the key is missing.
+static ERL_NIF_TERM node_put(ErlNifEnv* env, ERL_NIF_TERM node, hkey_t* hk,
+			     ERL_NIF_TERM value, unsigned depth, int update,
+			     int* grew)
+{
+    ERL_NIF_TERM* ptr = GET_TUPLE(node);
+    unsigned bitmap, bit, pos;
+    ERL_NIF_TERM child;
+    hkey_t hk1;
+
+    if (depth == HAMT_MAX_DEPTH) {
+	int i = collision_find(ptr, hk->key);
+	if (i >= 0) {
+	    if (GET_LIST(NODE_CHILD(ptr)[i])[1] == value)
+		return node;
+	    return node_replace(env, ptr, i, make_leaf(env, hk->key, value));
+	}
+	if (update)
+	    return INVALID_TERM;
+	*grew = 1;
+	return node_insert(env, ptr, 0, NODE_SIZE(ptr),
+			   make_leaf(env, hk->key, value));
+    }
+    bitmap = NODE_BITMAP(ptr);
+    bit = 1 << hkey_index(hk, depth);
+    pos = popcount(bitmap & (bit-1));
+    if (!(bitmap & bit)) {
+	if (update)
+	    return INVALID_TERM;
+	*grew = 1;
+	return node_insert(env, ptr, bitmap | bit, pos,
+			   make_leaf(env, hk->key, value));
+    }
+    child = NODE_CHILD(ptr)[pos];
+    if (IS_LIST(child)) {
+	ERL_NIF_TERM* kv = GET_LIST(child);
+	if (cnif_map_key_compare(kv[0], hk->key) == 0) {
+	    if (kv[1] == value)
+		return node;
+	    return node_replace(env, ptr, pos, make_leaf(env, kv[0], value));
+	}
+	if (update)
+	    return INVALID_TERM;
+	*grew = 1;
+	hkey_init(&hk1, kv[0]);
+	child = make_pair(env, child, &hk1, make_leaf(env, hk->key, value),
+			  hk, depth+1);
+    }
+    else {
+	ERL_NIF_TERM sub = node_put(env, child, hk, value, depth+1,
+				    update, grew);
+	if (sub == INVALID_TERM)
+	    return INVALID_TERM;
+	if (sub == child)
+	    return node;
+	child = sub;
+    }
+    return node_replace(env, ptr, pos, child);
+}
+
+int cnif_hashmap_put(ErlNifEnv* env, ERL_NIF_TERM map, ERL_NIF_TERM key,
+		     ERL_NIF_TERM value, int update, ERL_NIF_TERM* map_out)
+{
+    hashmap_t* hp = (hashmap_t*) GET_MAP(map);
+    ERL_NIF_TERM root;
+    int grew = 0;
+    hkey_t hk;
+
+    hkey_init(&hk, key);
+    root = node_put(env, hp->root, &hk, value, 0, update, &grew);
+    if (root == INVALID_TERM)
+	return 0;
+    if (root == hp->root)
+	*map_out = map;
+    else
+	*map_out = make_map(env, hp->size + grew, root);
+    return (*map_out != INVALID_TERM);
+}
+
+// Return the updated node, INVALID_TERM when the key is missing,
+// MAKE_NIL when the node became empty or a leaf when a sub node is
+// left with a single leaf.
+static ERL_NIF_TERM node_remove(ErlNifEnv* env, ERL_NIF_TERM node,
+				hkey_t* hk, unsigned depth)
+{
+    ERL_NIF_TERM* ptr = GET_TUPLE(node);
+    unsigned n = NODE_SIZE(ptr);
+    unsigned bitmap, bit, pos;
+    ERL_NIF_TERM child;
+
+    if (depth == HAMT_MAX_DEPTH) {
+	int i = collision_find(ptr, hk->key);
+	if (i < 0)
+	    return INVALID_TERM;
+	if (n == 1)
+	    return MAKE_NIL;
+	if (n == 2)
+	    return NODE_CHILD(ptr)[1-i];
+	return node_delete(env, ptr, 0, i);
+    }
+    bitmap = NODE_BITMAP(ptr);
+    bit = 1 << hkey_index(hk, depth);
+    pos = popcount(bitmap & (bit-1));
+    if (!(bitmap & bit))
+	return INVALID_TERM;
+    child = NODE_CHILD(ptr)[pos];
+    if (IS_LIST(child)) {
+	if (cnif_map_key_compare(GET_LIST(child)[0], hk->key) != 0)
+	    return INVALID_TERM;
+	child = MAKE_NIL;
+    }
+    else if ((child = node_remove(env, child, hk, depth+1)) == INVALID_TERM)
+	return INVALID_TERM;
+
+    if (child == MAKE_NIL) {
+	if (n == 1)
+	    return MAKE_NIL;
+	if ((n == 2) && (depth > 0) && IS_LIST(NODE_CHILD(ptr)[1-pos]))
+	    return NODE_CHILD(ptr)[1-pos];
+	return node_delete(env, ptr, bitmap & ~bit, pos);
+    }
+    if ((n == 1) && (depth > 0) && IS_LIST(child))
+	return child;
+    return node_replace(env, ptr, pos, child);
+}
+
+int cnif_hashmap_remove(ErlNifEnv* env, ERL_NIF_TERM map, ERL_NIF_TERM key,
+			ERL_NIF_TERM* map_out)
+{
+    hashmap_t* hp = (hashmap_t*) GET_MAP(map);
+    ERL_NIF_TERM root;
+    hkey_t hk;
+
+    hkey_init(&hk, key);
+    if ((root = node_remove(env, hp->root, &hk, 0)) == INVALID_TERM)
+	return 0;
+    if (root == MAKE_NIL) {
+	ERL_NIF_TERM* ptr = make_node(env, 0, 0);
+	root = ptr ? MAKE_TUPLE(ptr) : INVALID_TERM;
+    }
+    *map_out = make_map(env, hp->size - 1, root);
+    return (*map_out != INVALID_TERM);
+}
+
+//
+// Bulk build, sort the keys on hash and build the trie bottom up
+//
+
+typedef struct {
+    uint32_t hash;
+    unsigned ix;   // index into keys and values
+} hentry_t;
+
+static int hentry_cmp(const void* a, const void* b)
+{
+    const hentry_t* x = a;
+    const hentry_t* y = b;
+    if (x->hash != y->hash)
+	return (x->hash < y->hash) ? -1 : 1;
+    return (x->ix < y->ix) ? -1 : (x->ix > y->ix);
+}
+
+typedef struct {
+    ErlNifEnv* env;
+    const ERL_NIF_TERM* keys;
+    const ERL_NIF_TERM* values;
+    ERL_NIF_UINT size;
+} hbuild_t;
+
+static ERL_NIF_TERM build_leaf(hbuild_t* b, hentry_t* e)
+{
+    b->size++;
+    return make_leaf(b->env, b->keys[e->ix], b->values[e->ix]);
+}
+
+// build node from the n entries in e, all sharing the hash bits above depth
+static ERL_NIF_TERM build_node(hbuild_t* b, hentry_t* e, unsigned n,
+			       unsigned depth)
+{
+    ERL_NIF_TERM child[HAMT_WIDTH];
+    ERL_NIF_TERM* ptr;
+    unsigned bitmap = 0;
+    unsigned nc = 0;
+    unsigned i, j;
+
+    if (depth == HAMT_MAX_DEPTH) {
+	// equal hashes for every salt, only duplicate keys get here,
+	// entries are in input order and the last one wins
+	ERL_NIF_TERM* leaf = enif_alloc(n*sizeof(ERL_NIF_TERM));
+	if (leaf == NULL)
+	    return INVALID_TERM;
+	for (i = 0; i < n; i++) {
+	    ERL_NIF_TERM key = b->keys[e[i].ix];
+	    for (j = 0; j < nc; j++)
+		if (cnif_map_key_compare(GET_LIST(leaf[j])[0], key) == 0)
+		    break;
+	    if (j < nc)
+		b->size--;
+	    if ((leaf[j] = build_leaf(b, &e[i])) == INVALID_TERM)
+		break;
+	    if (j == nc)
+		nc++;
+	}
+	if (i < n)
+	    child[0] = INVALID_TERM;
+	else if (nc == 1)
+	    child[0] = leaf[0];
+	else if ((ptr = make_node(b->env, 0, nc)) == NULL)
+	    child[0] = INVALID_TERM;
+	else {
+	    memcpy(NODE_CHILD(ptr), leaf, nc*sizeof(ERL_NIF_TERM));
+	    child[0] = MAKE_TUPLE(ptr);
+	}
+	enif_free(leaf);
+	return child[0];
+    }
+    if ((depth > 0) && (depth % HAMT_LEVELS == 0)) {
+	for (i = 0; i < n; i++)
+	    e[i].hash = cnif_hash_term(b->keys[e[i].ix], depth / HAMT_LEVELS);
+	qsort(e, n, sizeof(hentry_t), hentry_cmp);
+    }
+    for (i = 0; i < n; i = j) {
+	unsigned ix = hash_index(e[i].hash, depth);
+	for (j = i+1; (j < n) && (hash_index(e[j].hash, depth) == ix); j++)
+	    ;
+	if (j - i == 1)
+	    child[nc] = build_leaf(b, &e[i]);
+	else
+	    child[nc] = build_node(b, e+i, j-i, depth+1);
+	if (child[nc++] == INVALID_TERM)
+	    return INVALID_TERM;
+	bitmap |= (1 << ix);
+    }
+    // a sub node with a single leaf is replaced by the leaf
+    if ((depth > 0) && (nc == 1) && IS_LIST(child[0]))
+	return child[0];
+    if ((ptr = make_node(b->env, bitmap, nc)) == NULL)
+	return INVALID_TERM;
+    memcpy(NODE_CHILD(ptr), child, nc*sizeof(ERL_NIF_TERM));
+    return MAKE_TUPLE(ptr);
+}
+
+// build a hashmap, the last of duplicate keys is kept
+ERL_NIF_TERM cnif_hashmap_from_arrays(ErlNifEnv* env, const ERL_NIF_TERM keys[],
+				      const ERL_NIF_TERM values[], unsigned cnt)
+{
+    hentry_t* e = enif_alloc(cnt*sizeof(hentry_t));
+    ERL_NIF_TERM root;
+    hbuild_t b;
+    unsigned i;
+
+    if (e == NULL)
+	return INVALID_TERM;
+    for (i = 0; i < cnt; i++) {
+	e[i].hash = cnif_hash_term(keys[i], 0);
+	e[i].ix = i;
+    }
+    qsort(e, cnt, sizeof(hentry_t), hentry_cmp);
+    b.env = env;
+    b.keys = keys;
+    b.values = values;
+    b.size = 0;
+    root = build_node(&b, e, cnt, 0);
+    enif_free(e);
+    return make_map(env, b.size, root);
+}
+
+// store the leaf cells of map in leaves, in trie order
+ERL_NIF_UINT cnif_hashmap_leaves(ERL_NIF_TERM map, ERL_NIF_TERM* leaves)
+{
+    hashmap_t* hp = (hashmap_t*) GET_MAP(map);
+    ERL_NIF_UINT n = 0;
+    wstack_t stack;
+
+    wstack_init(&stack);
+    wstack_push(&stack, hp->root);
+    while(!wstack_is_empty(&stack)) {
+	ERL_NIF_TERM* ptr = GET_TUPLE(wstack_pop(&stack));
+	unsigned i = NODE_SIZE(ptr);
+	// push in reverse to visit children in order
+	while(i > 0) {
+	    ERL_NIF_TERM child = NODE_CHILD(ptr)[--i];
+	    if (IS_LIST(child))
+		leaves[n++] = child;
+	    else
+		wstack_push(&stack, child);
+	}
+    }
+    wstack_free(&stack);
+    return n;
+}
+
+// Set keys and values to the map content sorted on key. bufp is set
+// to an allocated buffer the caller must free or NULL for a flatmap.
+// Return 0 if the buffer could not be allocated.
+int cnif_map_sorted_arrays(ERL_NIF_TERM map, ERL_NIF_TERM** keys,
+			   ERL_NIF_TERM** values, void** bufp)
+{
+    flatmap_t* mp = (flatmap_t*) GET_MAP(map);
+    ERL_NIF_TERM* buf;
+    ERL_NIF_UINT i, n;
+
+    *bufp = NULL;
+    if (!IS_HASHMAP_PTR(mp)) {
+	*keys = GET_TUPLE(mp->keys)+1;
+	*values = mp->value;
+	return 1;
+    }
+    n = mp->size;
+    if ((buf = enif_alloc(2*n*sizeof(ERL_NIF_TERM))) == NULL)
+	return 0;
+    cnif_hashmap_leaves(map, buf+n);
+    for (i = 0; i < n; i++) {
+	ERL_NIF_TERM* kv = GET_LIST(buf[n+i]);
+	buf[i] = kv[0];
+	buf[n+i] = kv[1];
+    }
+    if (n > 1)
+	cnif_merge_sort_aux(buf, buf+n, n, cnif_map_key_compare);
+    *keys = buf;
+    *values = buf+n;
+    *bufp = buf;
+    return 1;
+}
+
+// store the key value pairs of map in keys and values, unsorted
+ERL_NIF_UINT cnif_map_entries(ERL_NIF_TERM map, ERL_NIF_TERM* keys,
+			      ERL_NIF_TERM* values)
+{
+    flatmap_t* mp = (flatmap_t*) GET_MAP(map);
+    ERL_NIF_UINT i, n = mp->size;
+
+    if (!IS_HASHMAP_PTR(mp)) {
+	memcpy(keys, GET_TUPLE(mp->keys)+1, n*sizeof(ERL_NIF_TERM));
+	memcpy(values, mp->value, n*sizeof(ERL_NIF_TERM));
+	return n;
+    }
+    cnif_hashmap_leaves(map, keys);
+    for (i = 0; i < n; i++) {
+	ERL_NIF_TERM* kv = GET_LIST(keys[i]);
+	keys[i] = kv[0];
+	values[i] = kv[1];
+    }
+    return n;
+}
+
+// flatmap from sorted unique keys, immediate keys share an interned
+// keys tuple otherwise the keys tuple follows the map in the same heap block
+ERL_NIF_TERM cnif_make_flatmap(ErlNifEnv* env, const ERL_NIF_TERM keys[],
+			       const ERL_NIF_TERM values[], unsigned cnt)
+{
+    size_t n = NWORDS(sizeof(flatmap_t));
+    ERL_NIF_TERM ktuple = cnif_intern_keys(env, keys, cnt);
+    ERL_NIF_TERM* ptr;
+    flatmap_t* mp;
+
+    if (ktuple) {
+	if ((ptr = cnif_heap_alloc(env, n+cnt)) == NULL)
+	    return INVALID_TERM;
+    }
+    else {
+	ERL_NIF_TERM* tp;
+	if ((ptr = cnif_heap_alloc(env, n+cnt + 1+cnt)) == NULL)
+	    return INVALID_TERM;
+	tp = ptr + n+cnt;
+	tp[0] = MAKE_ARITYVAL(cnt);
+	if (cnt > 0)
+	    memcpy(tp+1, keys, cnt*sizeof(ERL_NIF_TERM));
+	ktuple = MAKE_TUPLE(tp);
+    }
+    mp = (flatmap_t*) ptr;
+    mp->header = MAKE_MAPVAL(n+cnt-1);
+    mp->size = cnt;
+    mp->keys = ktuple;
+    if (cnt > 0)  // keys and values may be NULL for the empty map
+	memcpy(mp->value, values, cnt*sizeof(ERL_NIF_TERM));
+    return MAKE_MAP(mp);
+}
+
+// map from sorted unique keys, a hashmap above the size limit
+ERL_NIF_TERM cnif_make_map_from_sorted(ErlNifEnv* env,
+				       const ERL_NIF_TERM keys[],
+				       const ERL_NIF_TERM values[],
+				       unsigned cnt)
+{
+    if (cnt > MAP_SMALL_MAP_LIMIT)
+	return cnif_hashmap_from_arrays(env, keys, values, cnt);
+    return cnif_make_flatmap(env, keys, values, cnt);
+}
@@ -17,6 +17,7 @@
 #define DEF_BIN_SIZE   64
 #define INC_BIN_SIZE   1024
 #define ERROR 0
+#define IO_KEEP        8    // chars kept for push back over a refill
 
 static char* string_dup(char* str)
 {
@@ -35,15 +36,42 @@ int enif_io_push(enif_io_t* p, void* iarg, char* ifile, int line,
     p->state[p->sp].oarg = oarg;
     p->state[p->sp].line = line;
     p->state[p->sp].error = 0;
+    p->state[p->sp].buf = enif_alloc(IO_KEEP + ENIF_IO_BUF_SIZE);
+    p->state[p->sp].ptr = p->state[p->sp].buf;
+    p->state[p->sp].end = p->state[p->sp].buf;
+    p->state[p->sp].base = NULL;
+    p->state[p->sp].ext = NULL;
+    return 0;
+}
+
+// scan len bytes at data in place, the data must stay valid until the
+// state is popped
+int enif_io_push_buffer(enif_io_t* p, const char* data, size_t len,
+			char* ifile, int line, void* oarg, char* ofile)
+{
+    p->sp++;
+    p->state[p->sp].ifile = string_dup(ifile);
+    p->state[p->sp].iarg = NULL;
+    p->state[p->sp].ofile = string_dup(ofile);
+    p->state[p->sp].oarg = oarg;
+    p->state[p->sp].line = line;
+    p->state[p->sp].error = 0;
+    p->state[p->sp].buf = NULL;
+    p->state[p->sp].ptr = data;
+    p->state[p->sp].end = data + len;
+    p->state[p->sp].base = data;
+    p->state[p->sp].ext = NULL;
     return 0;
 }
 
 int enif_io_pop(enif_io_t* p)
 {
-    p->meth->close(p, p->state[p->sp].iarg);
+    if (p->state[p->sp].buf != NULL)
+	p->meth->close(p, p->state[p->sp].iarg);
     enif_free(p->state[p->sp].ifile);
     p->meth->close(p, p->state[p->sp].oarg);
     enif_free(p->state[p->sp].ofile);
+    enif_free(p->state[p->sp].buf);
     p->sp--;
     return 0;
 }
@@ -56,6 +84,7 @@ enif_io_t* enif_io_alloc(ErlNifEnv* env, enif_io_methods_t* meth, void* data)
     p->data  = data;
     p->meth  = meth;
     p->base  = 10;
+    p->callback = NULL;
     return p;
 }
 
@@ -71,6 +100,38 @@ void enif_io_set_error(enif_io_t* p, char* err)
     p->state[p->sp].error = err;
 }
 
+// builders return 0 when the env heap is exhausted
+static inline ERL_NIF_TERM built(enif_io_t* p, ERL_NIF_TERM t)
+{
+    if (t == ERROR)
+	enif_io_set_error(p, "heap exhausted");
+    return t;
+}
+
+// Read the next block, the last IO_KEEP chars of the window are moved
+// in front of it so they can still be pushed back. Return the next char
+// or EOF.
+int enif_io_fill(enif_io_t* p)
+{
+    enif_io_state_t* sp = &p->state[p->sp];
+    char* data = sp->buf + IO_KEEP;
+    size_t keep;
+    ssize_t n;
+
+    if (sp->buf == NULL)
+	return EOF;
+    keep = sp->end - sp->buf;
+    if (keep > IO_KEEP)
+	keep = IO_KEEP;
+    memmove(data - keep, sp->end - keep, keep);
+    sp->ptr = data;
+    sp->end = data;
+    if ((n = p->meth->read(p, sp->iarg, data, ENIF_IO_BUF_SIZE)) <= 0)
+	return EOF;
+    sp->end = data + n;
+    return (unsigned char) *sp->ptr++;
+}
+
 char* enif_io_parser_error(enif_io_t* p)
 {
     if (p->state[p->sp].error)
@@ -161,6 +222,21 @@ static ERL_NIF_TERM parse_number(enif_io_t* p, int sign, int c)
     int       ds = 0;
     int       i = 0;
 
+    if (c != 0) {
+	// a decimal integer ending inside the window is read in place
+	enif_io_state_t* sp = &p->state[p->sp];
+	const char* q = sp->ptr;
+	int64_t v = c - '0';
+
+	while((q < sp->end) && isdigit((unsigned char) *q) &&
+	      (q - sp->ptr < 17))
+	    v = v*10 + (*q++ - '0');
+	if ((q < sp->end) && !isalnum((unsigned char) *q) &&
+	    (*q != '.') && (*q != '#') && (*q != '_')) {
+	    sp->ptr = q;
+	    return built(p, enif_make_int64(p->env, (sign < 0) ? -v : v));
+	}
+    }
     if (sign) {
 	buf[i++] = (sign < 0) ? '-' : '+';
     }
@@ -262,12 +338,12 @@ return_float: {
 	    enif_io_set_error(p, "illegal float");
 	    return ERROR;
 	}
-	return enif_make_double(p->env, fnum);
+	return built(p, enif_make_double(p->env, fnum));
     }
 
 return_integer:
     if (sign < 0) num = -num;
-    return enif_make_int64(p->env, num);    
+    return built(p, enif_make_int64(p->env, num));
 }
 
 
@@ -335,12 +411,25 @@ static int parse_quoted_string_buf(enif_io_t* p, char* buf,
 // SEEN " parse until "
 static ERL_NIF_TERM parse_quoted_string(enif_io_t* p)
 {
+    enif_io_state_t* sp = &p->state[p->sp];
+    const char* q = sp->ptr;
     char buf[MAX_STRING_LEN];
     int i = 0;
 
+    // without escapes and inside the window the string is read in place
+    while((q < sp->end) && (*q != '"') && (*q != '\\') &&
+	  (q - sp->ptr < MAX_STRING_LEN))
+	q++;
+    if ((q < sp->end) && (*q == '"')) {
+	const char* ptr = sp->ptr;
+	sp->ptr = q+1;
+	return built(p, enif_make_string_len(p->env, ptr, q - ptr,
+					     ERL_NIF_LATIN1));
+    }
+
     if (!parse_quoted_string_buf(p, buf, 0, MAX_STRING_LEN, &i)) 
 	return ERROR;
-    return enif_make_string_len(p->env, buf, i, ERL_NIF_LATIN1);
+    return built(p, enif_make_string_len(p->env, buf, i, ERL_NIF_LATIN1));
 }
 
 // ' (chars)* '
@@ -393,7 +482,7 @@ static ERL_NIF_TERM parse_tuple(enif_io_t* p)
     enif_io_set_error(p, "tuple too long");
     return ERROR;
 build:
-    return enif_make_tuple_from_array(p->env, elems, i);
+    return built(p, enif_make_tuple_from_array(p->env, elems, i));
 }
 
 // SEEN '['  parse '[' [ element ([(',' element)]* '|' element) ]  ']'
@@ -417,7 +506,8 @@ static ERL_NIF_TERM parse_list(enif_io_t* p)
 	ERL_NIF_TERM e;
 	if (!(e = parse_element(p)))
 	    return ERROR;
-	acc = enif_make_list_cell(p->env, e, acc);
+	if (!(acc = built(p, enif_make_list_cell(p->env, e, acc))))
+	    return ERROR;
 	if ((c = skip_blank(p)) == ']')
 	    tail = enif_make_list0(p->env);
 	else if (c == '|') {
@@ -454,6 +544,31 @@ static ERL_NIF_TERM parse_binary(enif_io_t* p)
 	return ERROR;
     }
 
+    if (p->state[p->sp].ext != NULL) {
+	// <<"chars">> without escapes references the buffer
+	enif_io_state_t* sp = &p->state[p->sp];
+	const char* s = sp->ptr;
+	const char* q;
+
+	while((s < sp->end) && ((*s == ' ') || (*s == '\t')))
+	    s++;
+	if ((s < sp->end) && (*s == '"')) {
+	    q = ++s;
+	    while((q < sp->end) && (*q != '"') && (*q != '\\') && (*q != '\n'))
+		q++;
+	    if ((q < sp->end) && (*q == '"')) {
+		const char* e = q + 1;
+		while((e < sp->end) && ((*e == ' ') || (*e == '\t')))
+		    e++;
+		if ((e+1 < sp->end) && (e[0] == '>') && (e[1] == '>')) {
+		    sp->ptr = e + 2;
+		    return built(p, cnif_make_external_binary(p->env, sp->ext,
+							  s - sp->base, q - s));
+		}
+	    }
+	}
+    }
+
     if (!enif_alloc_binary(size, &bin)) {
 	enif_io_set_error(p, "allocation error");
 	return ERROR;
@@ -521,7 +636,8 @@ build:
 	enif_io_set_error(p, "re-allocation error");
 	goto error;
     }
-    return enif_make_binary(p->env, &bin);
+    if (built(p, enif_make_binary(p->env, &bin)) != ERROR)
+	return bin.bin_term;
 error:
     enif_release_binary(&bin);
     return ERROR;
@@ -567,15 +683,27 @@ static ERL_NIF_TERM parse_map(enif_io_t* p)
     enif_io_set_error(p, "map too long");
     return ERROR;
 build:
-    return enif_make_map_from_arrays(p->env, key, value, i);
+    return built(p, enif_make_map_from_arrays(p->env, key, value, i));
 }
 
 // [a-z]([a-zA-Z0-9_])*
 static ERL_NIF_TERM parse_atom(enif_io_t* p, int c)
 {
+    enif_io_state_t* sp = &p->state[p->sp];
+    const char* q = sp->ptr;
     char buf[MAX_ATOM_LEN];
     int i = 0;
 
+    // c is still in the window, read the name in place when it ends there
+    while((q < sp->end) && (q - sp->ptr < MAX_ATOM_LEN-1) &&
+	  (isalnum((unsigned char) *q) || (*q == '_') || (*q == '@')))
+	q++;
+    if ((q < sp->end) && !isalnum((unsigned char) *q) &&
+	(*q != '_') && (*q != '@')) {
+	const char* ptr = sp->ptr - 1;
+	sp->ptr = q;
+	return enif_make_atom_len(p->env, ptr, q - ptr);
+    }
     buf[i++] = c;
 
     while((c = enif_io_getc(p)) >= 0) {
@@ -646,12 +774,18 @@ static ERL_NIF_TERM parse_element(enif_io_t* p)
 // 
 //  (element '.')*
 //
+// each form is parsed speculatively, the terms of a form that fails
+// to parse are rewound from the heap
 int enif_io_scan_forms(enif_io_t* p)
 {
     int r = 0;
     while(r >= 0) {
+	cnif_heap_mark_t mark;
 	ERL_NIF_TERM e;
+
+	cnif_heap_begin(p->env, &mark);
 	if (!(e = parse_element(p))) {
+	    cnif_heap_rewind(p->env, &mark);
 	    if (!p->state[p->sp].error) {
 		if (p->sp == 0)
 		    return 1;
@@ -661,9 +795,11 @@ int enif_io_scan_forms(enif_io_t* p)
 	    break;
 	}
 	if (skip_blank(p) != '.') {
+	    cnif_heap_rewind(p->env, &mark);
 	    enif_io_set_error(p, "missing '.'");
 	    break;
 	}
+	cnif_heap_commit(p->env, &mark);
 	if (p->callback)
 	    r = p->callback(p, e);
     }
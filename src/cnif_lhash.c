@@ -196,7 +196,8 @@ void* lhash_put(lhash_t* lh, void* tmpl)
 	    return (void*) b;
 	b = b->next;
     }
-    b = (lhash_bucket_t*) lh->fn->alloc(tmpl);
+    if ((b = (lhash_bucket_t*) lh->fn->alloc(tmpl)) == NULL)
+	return NULL;
     b->hvalue = hval;
     b->next = *bpp;
     *bpp = b;
@@ -252,3 +253,18 @@ void* lhash_erase(lhash_t* lh, void* tmpl)
     }
     return NULL;    
 }
+
+// Call fun(item, arg) for all items, the table must not change meanwhile
+void lhash_each(lhash_t* lh, heach_fun_t fun, void* arg)
+{
+    int i;
+
+    for (i = 0; i < lh->nactive; i++) {
+	lhash_bucket_t* b = BUCKET(lh, i);
+	while(b != (lhash_bucket_t*) 0) {
+	    lhash_bucket_t* next = b->next;
+	    fun((void*) b, arg);
+	    b = next;
+	}
+    }
+}
@@ -6,6 +6,7 @@
 #include "../include/cnif_term.h"
 #include "../include/cnif_sort.h"
 #include "../include/cnif_misc.h"
+#include "../include/cnif_hashmap.h"
 
 int enif_is_float(ErlNifEnv* env, ERL_NIF_TERM term)
 {
@@ -17,24 +18,341 @@ int enif_is_integer(ErlNifEnv* env, ERL_NIF_TERM term)
     return IS_SMALL(term) || IS_BIGNUM(term);
 }
 
+// Build a map from key and value arrays, the arrays are not modified.
+// The last value of a duplicate key wins, as in maps:from_list/1.
 ERL_NIF_TERM enif_make_map_from_arrays(ErlNifEnv* env,
 				       ERL_NIF_TERM key[],
 				       ERL_NIF_TERM value[],
 				       unsigned int cnt)
 {
-    int i;
-    size_t n = NWORDS(sizeof(flatmap_t));
+    ERL_NIF_TERM* buf;
+    ERL_NIF_TERM map;
+    unsigned n = cnt;
+
+    if (cnt > MAP_SMALL_MAP_LIMIT) {
+	map = cnif_hashmap_from_arrays(env, key, value, cnt);
+	// unless duplicate keys brought it down to a small map
+	if ((map == INVALID_TERM) ||
+	    (((hashmap_t*) GET_MAP(map))->size > MAP_SMALL_MAP_LIMIT))
+	    return map;
+    }
+    if ((buf = enif_alloc(2*n*sizeof(ERL_NIF_TERM)+1)) == NULL)
+	return INVALID_TERM;
+    memcpy(buf, key, n*sizeof(ERL_NIF_TERM));
+    memcpy(buf+n, value, n*sizeof(ERL_NIF_TERM));
+    cnt = cnif_merge_usort_last_aux(buf, buf+n, n, cnif_map_key_compare);
+    map = cnif_make_flatmap(env, buf, buf+n, cnt);
+    enif_free(buf);
+    return map;
+}
+
+// Merge sorted unique runs, on equal keys the second run wins.
+// Return number of elements stored in keys and values.
+static unsigned merge_runs(ERL_NIF_TERM* keys, ERL_NIF_TERM* values,
+			   const ERL_NIF_TERM* k1, const ERL_NIF_TERM* v1,
+			   unsigned n1,
+			   const ERL_NIF_TERM* k2, const ERL_NIF_TERM* v2,
+			   unsigned n2)
+{
+    unsigned i = 0, j = 0, n = 0;
+
+    while((i < n1) && (j < n2)) {
+	int r = cnif_map_key_compare(k1[i], k2[j]);
+	if (r < 0) {
+	    keys[n] = k1[i]; values[n] = v1[i]; i++;
+	}
+	else {
+	    keys[n] = k2[j]; values[n] = v2[j]; j++;
+	    if (r == 0) i++;
+	}
+	n++;
+    }
+    for (; i < n1; i++, n++) {
+	keys[n] = k1[i]; values[n] = v1[i];
+    }
+    for (; j < n2; j++, n++) {
+	keys[n] = k2[j]; values[n] = v2[j];
+    }
+    return n;
+}
+
+// Map from the entries of map followed by cnt pairs, the later
+// pairs win. Rebuilds the trie in one pass over all keys.
+static ERL_NIF_TERM map_rebuild(ErlNifEnv* env, ERL_NIF_TERM map,
+				const ERL_NIF_TERM keys[],
+				const ERL_NIF_TERM values[], unsigned cnt)
+{
+    ERL_NIF_UINT size = ((flatmap_t*) GET_MAP(map))->size;
+    ERL_NIF_UINT n = size + cnt;
+    ERL_NIF_TERM* buf = enif_alloc(2*n*sizeof(ERL_NIF_TERM)+1);
+
+    cnif_map_entries(map, buf, buf+n);
+    memcpy(buf+size, keys, cnt*sizeof(ERL_NIF_TERM));
+    memcpy(buf+n+size, values, cnt*sizeof(ERL_NIF_TERM));
+    map = enif_make_map_from_arrays(env, buf, buf+n, n);
+    enif_free(buf);
+    return map;
+}
+
+// a hashmap is updated per key when the change is small compared to
+// its size, otherwise rebuilt
+#define MAP_REBUILD_RATIO 8
+
+// Merge map1 and map2, map2 values win, as maps:merge/2
+int enif_make_map_merge(ErlNifEnv* env, ERL_NIF_TERM map1, ERL_NIF_TERM map2,
+			ERL_NIF_TERM* map_out)
+{
+    flatmap_t* mp1;
+    flatmap_t* mp2;
+
+    if (!IS_MAP(map1) || !IS_MAP(map2))
+	return 0;
+    mp1 = (flatmap_t*) GET_MAP(map1);
+    mp2 = (flatmap_t*) GET_MAP(map2);
+    if (mp2->size == 0)
+	*map_out = map1;
+    else if (mp1->size == 0)
+	*map_out = map2;
+    else if (!IS_HASHMAP_PTR(mp1) && !IS_HASHMAP_PTR(mp2)) {
+	unsigned cap = mp1->size + mp2->size;
+	ERL_NIF_TERM* buf = enif_alloc(2*cap*sizeof(ERL_NIF_TERM));
+	unsigned n = merge_runs(buf, buf+cap,
+				GET_TUPLE(mp1->keys)+1, mp1->value, mp1->size,
+				GET_TUPLE(mp2->keys)+1, mp2->value, mp2->size);
+	*map_out = cnif_make_map_from_sorted(env, buf, buf+cap, n);
+	enif_free(buf);
+    }
+    else if (mp2->size*MAP_REBUILD_RATIO < mp1->size) {
+	ErlNifMapIterator iter;
+	ERL_NIF_TERM k, v;
+	if (!enif_map_iterator_create(env, map2, &iter,
+				      ERL_NIF_MAP_ITERATOR_FIRST))
+	    return 0;
+	while(enif_map_iterator_next(env, &iter)) {
+	    enif_map_iterator_get_pair(env, &iter, &k, &v);
+	    if (!enif_make_map_put(env, map1, k, v, &map1)) {
+		map1 = INVALID_TERM;
+		break;
+	    }
+	}
+	enif_map_iterator_destroy(env, &iter);
+	*map_out = map1;
+    }
+    else if (mp1->size*MAP_REBUILD_RATIO < mp2->size) {
+	ErlNifMapIterator iter;
+	ERL_NIF_TERM k, v, v2;
+	if (!enif_map_iterator_create(env, map1, &iter,
+				      ERL_NIF_MAP_ITERATOR_FIRST))
+	    return 0;
+	while(enif_map_iterator_next(env, &iter)) {
+	    enif_map_iterator_get_pair(env, &iter, &k, &v);
+	    if (!enif_get_map_value(env, map2, k, &v2) &&
+		!enif_make_map_put(env, map2, k, v, &map2)) {
+		map2 = INVALID_TERM;
+		break;
+	    }
+	}
+	enif_map_iterator_destroy(env, &iter);
+	*map_out = map2;
+    }
+    else {
+	ERL_NIF_UINT n = mp2->size;
+	ERL_NIF_TERM* buf = enif_alloc(2*n*sizeof(ERL_NIF_TERM));
+	cnif_map_entries(map2, buf, buf+n);
+	*map_out = map_rebuild(env, map1, buf, buf+n, n);
+	enif_free(buf);
+    }
+    return (*map_out != INVALID_TERM);
+}
+
+// Put cnt key value pairs into map, the last of duplicate keys wins
+int enif_make_map_put_many(ErlNifEnv* env, ERL_NIF_TERM map_in,
+			   ERL_NIF_TERM keys[], ERL_NIF_TERM values[],
+			   unsigned cnt, ERL_NIF_TERM* map_out)
+{
     flatmap_t* mp;
+    ERL_NIF_TERM* buf;
+    ERL_NIF_TERM* res;
+    unsigned i, n, cap;
 
-    if (!cnif_is_usorted(key, cnt))
-	cnt = cnif_quick_usort_aux(key, value, key, value, 0, cnt-1);
-    mp =  (flatmap_t*) cnif_heap_alloc(env, n+cnt);
-    mp->header = MAKE_MAPVAL(n+cnt-1);
-    mp->size = cnt;
-    mp->keys = enif_make_tuple_from_array(env, key, cnt);
-    for (i = 0; i < cnt; i++)
-	mp->value[i] = value[i];
-    return MAKE_MAP(mp);
+    if (!IS_MAP(map_in))
+	return 0;
+    mp = (flatmap_t*) GET_MAP(map_in);
+    if (IS_HASHMAP_PTR(mp)) {
+	if (cnt*MAP_REBUILD_RATIO < mp->size) {
+	    for (i = 0; i < cnt; i++) {
+		if (!cnif_hashmap_put(env, map_in, keys[i], values[i], 0,
+				      &map_in)) {
+		    map_in = INVALID_TERM;
+		    break;
+		}
+	    }
+	    *map_out = map_in;
+	}
+	else
+	    *map_out = map_rebuild(env, map_in, keys, values, cnt);
+	return (*map_out != INVALID_TERM);
+    }
+    cap = mp->size + cnt;
+    if (cap > MAP_SMALL_MAP_LIMIT) {
+	// the result is likely a hashmap that does not need sorted keys
+	*map_out = map_rebuild(env, map_in, keys, values, cnt);
+	return (*map_out != INVALID_TERM);
+    }
+    // sort the new pairs, at buf, and merge them with the sorted map
+    // keys, into res
+    buf = enif_alloc(2*((size_t)cnt+cap)*sizeof(ERL_NIF_TERM)+1);
+    res = buf + 2*cnt;
+    memcpy(buf, keys, cnt*sizeof(ERL_NIF_TERM));
+    memcpy(buf+cnt, values, cnt*sizeof(ERL_NIF_TERM));
+    n = cnif_merge_usort_last_aux(buf, buf+cnt, cnt, cnif_map_key_compare);
+    n = merge_runs(res, res+cap,
+		   GET_TUPLE(mp->keys)+1, mp->value, mp->size,
+		   buf, buf+cnt, n);
+    *map_out = cnif_make_map_from_sorted(env, res, res+cap, n);
+    enif_free(buf);
+    return (*map_out != INVALID_TERM);
+}
+
+// Remove cnt keys from map, keys not in the map are ignored
+int enif_make_map_remove_many(ErlNifEnv* env, ERL_NIF_TERM map_in,
+			      ERL_NIF_TERM keys[], unsigned cnt,
+			      ERL_NIF_TERM* map_out)
+{
+    flatmap_t* mp;
+    ERL_NIF_TERM* buf;
+    const ERL_NIF_TERM* mkeys;
+    unsigned i, j, n;
+
+    if (!IS_MAP(map_in))
+	return 0;
+    mp = (flatmap_t*) GET_MAP(map_in);
+    if (IS_HASHMAP_PTR(mp)) {
+	ERL_NIF_TERM v;
+	// a present key that can not be removed means the heap is full
+	for (i = 0; i < cnt; i++) {
+	    if (enif_get_map_value(env, map_in, keys[i], &v) &&
+		!enif_make_map_remove(env, map_in, keys[i], &map_in)) {
+		map_in = INVALID_TERM;
+		break;
+	    }
+	}
+	*map_out = map_in;
+	return (*map_out != INVALID_TERM);
+    }
+    // walk the sorted map keys and the sorted keys to remove together
+    buf = enif_alloc((cnt + 2*mp->size)*sizeof(ERL_NIF_TERM)+1);
+    memcpy(buf, keys, cnt*sizeof(ERL_NIF_TERM));
+    cnif_merge_sort_aux(buf, NULL, cnt, cnif_map_key_compare);
+    mkeys = GET_TUPLE(mp->keys)+1;
+    for (i = 0, j = 0, n = 0; i < mp->size; i++) {
+	int r = 1;
+	while((j < cnt) && ((r = cnif_map_key_compare(buf[j], mkeys[i])) < 0))
+	    j++;
+	if ((j < cnt) && (r == 0))
+	    continue;
+	buf[cnt+n] = mkeys[i];
+	buf[cnt+mp->size+n] = mp->value[i];
+	n++;
+    }
+    if (n == mp->size)
+	*map_out = map_in;
+    else
+	*map_out = cnif_make_flatmap(env, buf+cnt, buf+cnt+mp->size, n);
+    enif_free(buf);
+    return (*map_out != INVALID_TERM);
+}
+
+//
+// Map index, an open addressing table from key term to position in
+// the keys tuple. Keys are matched by identity, which is exact for
+// atoms and smalls. Any other key falls back to a normal lookup.
+//
+
+struct _ErlNifMapIndex {
+    ERL_NIF_TERM keys;      // keys tuple the index is valid for
+    unsigned size;          // number of keys
+    unsigned shift;         // 64 - log2(number of slots)
+    unsigned mask;          // slots-1
+    struct {
+	ERL_NIF_TERM key;   // 0 for an empty slot
+	unsigned pos;
+    } slot[];
+};
+
+static inline unsigned index_slot(const ErlNifMapIndex* index,
+				  ERL_NIF_TERM key)
+{
+    return (unsigned)(((uint64_t)key * UINT64_C(0x9e3779b97f4a7c15)) >>
+		      index->shift);
+}
+
+ErlNifMapIndex* enif_map_index_create(ErlNifEnv* env, ERL_NIF_TERM map)
+{
+    ErlNifMapIndex* index;
+    flatmap_t* mp;
+    ERL_NIF_TERM* keys;
+    unsigned bits = 1;
+    unsigned i;
+
+    if (!IS_MAP(map) || IS_HASHMAP_PTR(mp = (flatmap_t*) GET_MAP(map)))
+	return NULL;
+    // at most half full
+    while((1U << bits) < 2*mp->size)
+	bits++;
+    index = enif_alloc(sizeof(ErlNifMapIndex) +
+		       (1U << bits)*sizeof(index->slot[0]));
+    if (index == NULL)
+	return NULL;
+    index->keys = mp->keys;
+    index->size = mp->size;
+    index->shift = 64 - bits;
+    index->mask = (1U << bits) - 1;
+    for (i = 0; i <= index->mask; i++)
+	index->slot[i].key = 0;
+    keys = GET_TUPLE(mp->keys)+1;
+    for (i = 0; i < mp->size; i++) {
+	unsigned j = index_slot(index, keys[i]);
+	while(index->slot[j].key != 0)
+	    j = (j+1) & index->mask;
+	index->slot[j].key = keys[i];
+	index->slot[j].pos = i;
+    }
+    return index;
+}
+
+void enif_map_index_destroy(ErlNifMapIndex* index)
+{
+    enif_free(index);
+}
+
+// Lookup key in map using index when map has the indexed keys tuple.
+// The keys tuple may be a new one at the address of the indexed one
+// after the env was cleared, so a hit is checked against the map and
+// a miss falls back to a normal lookup.
+int enif_get_map_value_indexed(ErlNifEnv* env, const ErlNifMapIndex* index,
+			       ERL_NIF_TERM map, ERL_NIF_TERM key,
+			       ERL_NIF_TERM* value)
+{
+    flatmap_t* mp;
+
+    if (IS_MAP(map) && ((mp = (flatmap_t*) GET_MAP(map))->keys == index->keys)) {
+	unsigned j = index_slot(index, key);
+	ERL_NIF_TERM k;
+	while((k = index->slot[j].key) != 0) {
+	    if (k == key) {
+		unsigned pos = index->slot[j].pos;
+		if ((pos < mp->size) && (pos < index->size) &&
+		    (GET_TUPLE(mp->keys)[pos+1] == key)) {
+		    *value = mp->value[pos];
+		    return 1;
+		}
+		break;
+	    }
+	    j = (j+1) & index->mask;
+	}
+    }
+    return enif_get_map_value(env, map, key, value);
 }
 
 static int binary_byte_size(ERL_NIF_TERM term, size_t* sizep)
@@ -145,43 +463,49 @@ enif_type_t enif_get_type(ERL_NIF_TERM term, int number)
     return ENIF_TYPE_INVALID;
 }
 
+// nested lists are walked with an explicit stack of pending tails
 static int iolist_size(ERL_NIF_TERM term, size_t* sizep)
 {
+    wstack_t stack;
     size_t n = 0;
+    size_t m;
 
-    while (IS_LIST(term)) {
-    	ERL_NIF_TERM* ptr = GET_LIST(term);
-	if (IS_SMALL(ptr[0])) {
-	    if ((ptr[0] >> TAG_IMMED1_SIZE) > 255)
-		return 0;
-	    n++;
-	}
-	else if (IS_LIST(ptr[0])) {
-	    size_t m;
-	    if (!iolist_size(ptr[0],&m))
-		return 0;
-	    n += m;
+    wstack_init(&stack);
+    while(1) {
+	while (IS_LIST(term)) {
+	    ERL_NIF_TERM* ptr = GET_LIST(term);
+	    ERL_NIF_TERM  hd  = ptr[0];
+	    term = ptr[1];
+	    PREFETCH(GET_PTR(term));
+	    if (IS_SMALL(hd)) {
+		if ((hd >> TAG_IMMED1_SIZE) > 255)
+		    goto error;
+		n++;
+	    }
+	    else if (IS_LIST(hd)) {
+		wstack_push(&stack, term);
+		term = hd;
+	    }
+	    else if (hd == MAKE_NIL)
+		continue;
+	    else if (binary_byte_size(hd, &m))
+		n += m;
+	    else
+		goto error;
 	}
-	else if (IS_BINARY(ptr[0])) {
-	    size_t m;
-	    if (!binary_byte_size(ptr[0], &m))
-		return 0;
+	if (binary_byte_size(term, &m))
 	    n += m;
-	}
-	else
-	    return 0;
-	term = ptr[1];
-    }
-    if (IS_BINARY(term)) {
-	size_t m;
-	if (!binary_byte_size(term, &m))
-	    *sizep = n + m;
-	return 1;
-    }
-    else if (term == MAKE_NIL) {
-	*sizep = n;
-	return 1;
+	else if (term != MAKE_NIL)
+	    goto error;
+	if (wstack_is_empty(&stack))
+	    break;
+	term = wstack_pop(&stack);
     }
+    wstack_free(&stack);
+    *sizep = n;
+    return 1;
+error:
+    wstack_free(&stack);
     return 0;
 }
 
@@ -190,6 +514,31 @@ int enif_iolist_size(ErlNifEnv* env, ERL_NIF_TERM term, size_t* sizep)
     return iolist_size(term, sizep);
 }
 
+// length of list and check that it is a latin1 string in one pass
+int enif_get_string_length(ErlNifEnv* env, ERL_NIF_TERM list, unsigned* len,
+			   ErlNifCharEncoding code)
+{
+    unsigned n = 0;
+
+    while(IS_LIST(list)) {
+	ERL_NIF_TERM* ptr = GET_LIST(list);
+	// cons cells laid out back to back are scanned as an array
+	while(1) {
+	    if (!IS_SMALL(ptr[0]) || ((ptr[0] >> TAG_IMMED1_SIZE) > 255))
+		return 0;
+	    n++;
+	    if (ptr[1] != MAKE_LIST(ptr+2))
+		break;
+	    ptr += 2;
+	}
+	list = ptr[1];
+    }
+    if (list != MAKE_NIL)
+	return 0;
+    *len = n;
+    return 1;
+}
+
 int enif_inline_reverse_list(ErlNifEnv* env, ERL_NIF_TERM term,
 			     ERL_NIF_TERM tail, ERL_NIF_TERM *list)
 {
@@ -231,3 +580,385 @@ int enif_each_element(ErlNifEnv* env,
     }
     return 0;
 }
+
+//
+// Bulk list construction from C arrays. All cons cells and the boxed
+// numbers they refer to are allocated in one heap block, cells first.
+//
+
+// number of words needed to box v, 0 if v fits in a small
+static inline unsigned int64_words(ErlNifSInt64 v)
+{
+    if (IS_SSMALL(v))
+	return 0;
+#if WORDSIZE == 32
+    {
+	uint64_t u = (v < 0) ? -(uint64_t)v : (uint64_t)v;
+	return (u >> 32) ? 3 : 2;
+    }
+#else
+    return 2;
+#endif
+}
+
+// store v at ptr, a boxed integer when int64_words(v) > 0
+static inline ERL_NIF_TERM store_int64(ERL_NIF_TERM* ptr, ErlNifSInt64 v,
+				       unsigned words)
+{
+    uint64_t u;
+    int ari = words - 1;
+
+    if (words == 0)
+	return MAKE_SMALL((ERL_NIF_TERM) v);
+    u = (v < 0) ? -(uint64_t)v : (uint64_t)v;
+    ptr[0] = (v < 0) ? MAKE_NEG_BIGVAL(ari) : MAKE_POS_BIGVAL(ari);
+    ptr[1] = (ERL_NIF_TERM) u;
+#if WORDSIZE == 32
+    if (ari == 2)
+	ptr[2] = (ERL_NIF_TERM) (u >> 32);
+#endif
+    return MAKE_BIGNUM(ptr);
+}
+
+ERL_NIF_TERM enif_make_list_from_int64_array(ErlNifEnv* env,
+					     const ErlNifSInt64 arr[],
+					     unsigned cnt)
+{
+    ERL_NIF_TERM* ptr;
+    ERL_NIF_TERM* bp;
+    size_t nbig = 0;
+    unsigned i;
+
+    if (cnt == 0)
+	return MAKE_NIL;
+    for (i = 0; i < cnt; i++)
+	nbig += int64_words(arr[i]);
+    if ((ptr = cnif_heap_alloc(env, 2*(size_t)cnt + nbig)) == NULL)
+	return INVALID_TERM;
+    bp = ptr + 2*(size_t)cnt;
+    for (i = 0; i < cnt; i++) {
+	ErlNifSInt64 v = arr[i];
+	if (IS_SSMALL(v))
+	    ptr[2*i] = MAKE_SMALL((ERL_NIF_TERM) v);
+	else {
+	    unsigned words = int64_words(v);
+	    ptr[2*i] = store_int64(bp, v, words);
+	    bp += words;
+	}
+	ptr[2*i+1] = MAKE_LIST(&ptr[2*i+2]);
+    }
+    ptr[2*cnt-1] = MAKE_NIL;
+    return MAKE_LIST(ptr);
+}
+
+ERL_NIF_TERM enif_make_list_from_double_array(ErlNifEnv* env,
+					      const double arr[],
+					      unsigned cnt)
+{
+    const unsigned arity = sizeof(double)/sizeof(ERL_NIF_TERM);
+    ERL_NIF_TERM* ptr;
+    ERL_NIF_TERM* fp;
+    unsigned i;
+
+    if (cnt == 0)
+	return MAKE_NIL;
+    if ((ptr = cnif_heap_alloc(env, (2+1+arity)*(size_t)cnt)) == NULL)
+	return INVALID_TERM;
+    fp = ptr + 2*(size_t)cnt;
+    for (i = 0; i < cnt; i++) {
+	fp[0] = MAKE_FLOATVAL(arity);
+	memcpy(fp+1, &arr[i], sizeof(double));
+	ptr[2*i] = MAKE_FLOAT(fp);
+	ptr[2*i+1] = MAKE_LIST(&ptr[2*i+2]);
+	fp += (1+arity);
+    }
+    ptr[2*cnt-1] = MAKE_NIL;
+    return MAKE_LIST(ptr);
+}
+
+ERL_NIF_TERM enif_make_list_from_uint8_array(ErlNifEnv* env,
+					     const uint8_t arr[],
+					     unsigned cnt)
+{
+    ERL_NIF_TERM* ptr;
+    unsigned i;
+
+    if (cnt == 0)
+	return MAKE_NIL;
+    if ((ptr = cnif_heap_alloc(env, 2*(size_t)cnt)) == NULL)
+	return INVALID_TERM;
+    for (i = 0; i < cnt; i++) {
+	ptr[2*i] = MAKE_SMALL((ERL_NIF_TERM) arr[i]);
+	ptr[2*i+1] = MAKE_LIST(&ptr[2*i+2]);
+    }
+    ptr[2*cnt-1] = MAKE_NIL;
+    return MAKE_LIST(ptr);
+}
+
+//
+// Compact lists
+//
+
+// View of the contiguous cells at the head of list, which must be a
+// cons. Return the tail following the last contiguous cell.
+static ERL_NIF_TERM list_prefix_view(ERL_NIF_TERM list, ErlNifListView* view)
+{
+    ERL_NIF_TERM* start = GET_LIST(list);
+    ERL_NIF_TERM* ptr = start;
+
+    // a sequential scan, no pointer chasing
+    while(ptr[1] == MAKE_LIST(ptr+2))
+	ptr += 2;
+    view->elem = start;
+    view->size = (unsigned)((ptr - start)/2) + 1;
+    view->stride = 2;
+    return ptr[1];
+}
+
+// Get an array view of a proper compact list, return 0 if the list
+// is not proper or its cells are not contiguous.
+int enif_get_list_view(ErlNifEnv* env, ERL_NIF_TERM list, ErlNifListView* view)
+{
+    (void) env;
+    if (list == MAKE_NIL) {
+	view->elem = NULL;
+	view->size = 0;
+	view->stride = 2;
+	return 1;
+    }
+    if (!IS_LIST(list))
+	return 0;
+    return list_prefix_view(list, view) == MAKE_NIL;
+}
+
+// Return list itself if it is already compact, otherwise a copy of
+// the cells in one block. Elements are shared, not copied.
+int enif_make_compact_list(ErlNifEnv* env, ERL_NIF_TERM list,
+			   ERL_NIF_TERM* compact)
+{
+    ErlNifListView view;
+    ERL_NIF_TERM tail;
+    ERL_NIF_TERM* ptr;
+    ERL_NIF_TERM* dst;
+    ERL_NIF_TERM* src;
+    wstack_t elems;
+    size_t len;
+
+    if ((list == MAKE_NIL) || !IS_LIST(list)) {
+	*compact = list;
+	return (list == MAKE_NIL);
+    }
+    tail = list_prefix_view(list, &view);
+    if (tail == MAKE_NIL) {
+	*compact = list;
+	return 1;
+    }
+    // chase the scattered cells once, collecting the elements
+    wstack_init(&elems);
+    while(IS_LIST(tail)) {
+	ERL_NIF_TERM* cell = GET_LIST(tail);
+	wstack_push(&elems, cell[0]);
+	tail = cell[1];
+    }
+    if (tail != MAKE_NIL) {
+	wstack_free(&elems);
+	return 0;
+    }
+    len = view.size + (elems.sp - elems.start);
+    if ((ptr = cnif_heap_alloc(env, 2*len)) == NULL) {
+	wstack_free(&elems);
+	return 0;
+    }
+    memcpy(ptr, view.elem, 2*(size_t)view.size*sizeof(ERL_NIF_TERM));
+    dst = ptr + 2*(size_t)view.size;
+    for (src = elems.start; src < elems.sp; src++, dst += 2)
+	dst[0] = *src;
+    wstack_free(&elems);
+    for (dst = ptr; dst < ptr + 2*(len-1); dst += 2)
+	dst[1] = MAKE_LIST(dst+2);
+    dst[1] = MAKE_NIL;
+    *compact = MAKE_LIST(ptr);
+    return 1;
+}
+
+// Sorted copy of a proper list, stable like lists:sort/1, or on tuple
+// element (opts & ENIF_SORT_KEY_MASK) like lists:keysort/2. With
+// ENIF_SORT_UNIQUE the first of equal elements (or keys) is kept as in
+// lists:usort/1 and lists:ukeysort/2. The cells are built in one block.
+int enif_make_sorted_list(ErlNifEnv* env, ERL_NIF_TERM list, unsigned opts,
+			  ERL_NIF_TERM* sorted)
+{
+    unsigned pos = opts & ENIF_SORT_KEY_MASK;
+    ERL_NIF_TERM* buf;
+    ERL_NIF_TERM* ptr;
+    unsigned len;
+    size_t i, j, n;
+
+    if (!enif_get_list_length(env, list, &len))
+	return 0;
+    if (len == 0) {
+	*sorted = MAKE_NIL;
+	return 1;
+    }
+    if ((buf = enif_alloc(len*sizeof(ERL_NIF_TERM))) == NULL)
+	return 0;
+    for (i = 0; i < len; i++) {
+	ERL_NIF_TERM* cell = GET_LIST(list);
+	buf[i] = cell[0];
+	list = cell[1];
+    }
+    if (pos == 0)
+	cnif_merge_sort_aux(buf, NULL, len, enif_compare);
+    else if (!cnif_keysort(buf, len, pos)) {
+	enif_free(buf);
+	return 0;
+    }
+    n = len;
+    if (opts & ENIF_SORT_UNIQUE) {
+	for (i = 0, j = 1; j < len; j++) {
+	    int r = pos ?
+		enif_compare(GET_TUPLE(buf[i])[pos], GET_TUPLE(buf[j])[pos]) :
+		enif_compare(buf[i], buf[j]);
+	    if (r != 0)
+		buf[++i] = buf[j];
+	}
+	n = i+1;
+    }
+    if ((ptr = cnif_heap_alloc(env, 2*n)) == NULL) {
+	enif_free(buf);
+	return 0;
+    }
+    for (i = 0; i < n; i++) {
+	ptr[2*i] = (opts & ENIF_SORT_REVERSE) ? buf[n-1-i] : buf[i];
+	ptr[2*i+1] = MAKE_LIST(&ptr[2*i+2]);
+    }
+    ptr[2*n-1] = MAKE_NIL;
+    enif_free(buf);
+    *sorted = MAKE_LIST(ptr);
+    return 1;
+}
+
+//
+// Bulk extraction from list or tuple into C arrays.
+// Fail if an element has the wrong type or there are more than len.
+//
+
+typedef struct {
+    const ERL_NIF_TERM* tp;  // tuple elements or compact list prefix
+    unsigned arity;
+    unsigned stride;
+    unsigned i;
+    unsigned j;              // index into tp
+    ERL_NIF_TERM list;       // list after the compact prefix
+} elem_iter_t;
+
+static inline int elem_iter_init(elem_iter_t* it, ERL_NIF_TERM term)
+{
+    it->i = 0;
+    it->j = 0;
+    if (IS_TUPLE(term)) {
+	ERL_NIF_TERM* ptr = GET_TUPLE(term);
+	it->tp = ptr+1;
+	it->arity = GET_ARITYVAL(ptr[0]);
+	it->stride = 1;
+	it->list = MAKE_NIL;
+	return 1;
+    }
+    if (IS_LIST(term)) {
+	ErlNifListView view;
+	it->list = list_prefix_view(term, &view);
+	it->tp = view.elem;
+	it->arity = view.size;
+	it->stride = 2;
+	return 1;
+    }
+    it->tp = NULL;
+    it->arity = 0;
+    it->stride = 1;
+    it->list = term;
+    return (term == MAKE_NIL);
+}
+
+static inline int elem_iter_next(elem_iter_t* it, ERL_NIF_TERM* elem)
+{
+    if (it->j < it->arity) {
+	*elem = it->tp[it->j*it->stride];
+	it->j++;
+	it->i++;
+	return 1;
+    }
+    if (IS_LIST(it->list)) {
+	ERL_NIF_TERM* ptr = GET_LIST(it->list);
+	*elem = ptr[0];
+	it->list = ptr[1];
+	it->i++;
+	return 1;
+    }
+    return 0;
+}
+
+// all elements consumed and list was proper
+static inline int elem_iter_done(elem_iter_t* it)
+{
+    return (it->list == MAKE_NIL);
+}
+
+int enif_get_int64_array(ErlNifEnv* env, ERL_NIF_TERM term,
+			 ErlNifSInt64* arr, unsigned len, unsigned* cnt)
+{
+    elem_iter_t it;
+    ERL_NIF_TERM e;
+
+    if (!elem_iter_init(&it, term))
+	return 0;
+    while(elem_iter_next(&it, &e)) {
+	if (it.i > len)
+	    return 0;
+	if (IS_SMALL(e))
+	    arr[it.i-1] = GET_SMALL(e);
+	else if (!enif_get_int64(env, e, &arr[it.i-1]))
+	    return 0;
+    }
+    if (!elem_iter_done(&it))
+	return 0;
+    *cnt = it.i;
+    return 1;
+}
+
+int enif_get_double_array(ErlNifEnv* env, ERL_NIF_TERM term,
+			  double* arr, unsigned len, unsigned* cnt)
+{
+    elem_iter_t it;
+    ERL_NIF_TERM e;
+
+    if (!elem_iter_init(&it, term))
+	return 0;
+    while(elem_iter_next(&it, &e)) {
+	if ((it.i > len) || !IS_FLOAT(e))
+	    return 0;
+	memcpy(&arr[it.i-1], GET_FLOAT(e)+1, sizeof(double));
+    }
+    if (!elem_iter_done(&it))
+	return 0;
+    *cnt = it.i;
+    return 1;
+}
+
+int enif_get_uint8_array(ErlNifEnv* env, ERL_NIF_TERM term,
+			 uint8_t* arr, unsigned len, unsigned* cnt)
+{
+    elem_iter_t it;
+    ERL_NIF_TERM e;
+
+    if (!elem_iter_init(&it, term))
+	return 0;
+    while(elem_iter_next(&it, &e)) {
+	if ((it.i > len) || !IS_SMALL(e) || ((e >> TAG_IMMED1_SIZE) > 255))
+	    return 0;
+	arr[it.i-1] = (e >> TAG_IMMED1_SIZE);
+    }
+    if (!elem_iter_done(&it))
+	return 0;
+    *cnt = it.i;
+    return 1;
+}
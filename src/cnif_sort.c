@@ -2,9 +2,18 @@
 // Sorting functions
 //
 
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
 #include "../include/cnif.h"
+#include "../include/cnif_term.h"
+#include "../include/cnif_hashmap.h"
 #include "../include/cnif_sort.h"
 
+static int sort_kernel(ERL_NIF_TERM* src1, ERL_NIF_TERM* src2, size_t n,
+		       cnif_compare_t cmp, int stable);
+
 int cnif_is_sorted(const ERL_NIF_TERM* arr, size_t n)
 {
     int i;
@@ -25,38 +34,20 @@ int cnif_is_usorted(const ERL_NIF_TERM* arr, size_t n)
     return 1;
 }
 
-static inline void swap(ERL_NIF_TERM* arr, int i, int j)
+static inline void swap(ERL_NIF_TERM* arr, size_t i, size_t j)
 {
     ERL_NIF_TERM tmp = arr[i];
     arr[i] = arr[j];
     arr[j] = tmp;
 }
 
-// inline quick sort
+// inline quick sort, pattern defeating quick sort in term order
 void cnif_inline_quick_sort_aux(ERL_NIF_TERM* src1,ERL_NIF_TERM* src2,
 				int left,int right)
 {
-    int i=left, j=right;
-    ERL_NIF_TERM tmp;
-    ERL_NIF_TERM pivot = src1[(left+right)/2];
-
-    // partition
-    while (i <= j) {
-	while(enif_compare(src1[i],pivot) < 0)
-	    i++;
-	while(enif_compare(src1[j],pivot) > 0)
-	    j--;
-	if (i <= j) {
-	    swap(src1, i, j);
-	    if (src2) swap(src2, i, j);
-	    i++;
-	    j--;
-	}
-    };
-    if (left < j)
-	cnif_inline_quick_sort_aux(src1,src2,left,j);
-    if (i < right)
-	cnif_inline_quick_sort_aux(src1,src2,i,right);
+    if (left < right)
+	cnif_pdq_sort_aux(src1+left, src2 ? src2+left : NULL,
+			  right-left+1, enif_compare);
 }
 
 // remove duplicates from src1 and corresponding element in src2
@@ -84,7 +75,7 @@ int cnif_inline_quick_usort_aux(ERL_NIF_TERM* src1,ERL_NIF_TERM* src2,
 }
 
 
-// first partition quick sort and move to destination
+// move to destination and sort there
 void cnif_quick_sort_aux(ERL_NIF_TERM* src1,ERL_NIF_TERM* src2,
 			 ERL_NIF_TERM* dst1,ERL_NIF_TERM* dst2,
 			 int left, int right)
@@ -92,55 +83,13 @@ void cnif_quick_sort_aux(ERL_NIF_TERM* src1,ERL_NIF_TERM* src2,
     if (src1 == dst1) dst1 = NULL;
     if (src2 == dst2) dst2 = NULL;
     if (src1 && dst1) {
-	int i=left, j=right;
-	ERL_NIF_TERM tmp;
-	ERL_NIF_TERM pivot = src1[(left+right)/2];
-	if (src2 && dst2) {
-	    // partition & copy
-	    while (i <= j) {
-		while(enif_compare(src1[i],pivot) < 0) {
-		    dst1[i] = src1[i];
-		    dst2[i] = src2[i];
-		    i++;
-		}
-		while(enif_compare(src1[j],pivot) > 0) {
-		    dst1[j] = src1[j];
-		    dst2[j] = src2[j];
-		    j--;
-		}
-		if (i <= j) {
-		    dst1[i] = src1[j];
-		    dst1[j] = src1[i];
-		    dst2[i] = src2[j];
-		    dst2[j] = src2[i];
-		    i++;
-		    j--;
-		}
-	    }
-	}
-	else {
-	    // partition & copy
-	    while (i <= j) {
-		while(enif_compare(src1[i],pivot) < 0) {
-		    dst1[i] = src1[i];
-		    i++;
-		}
-		while(enif_compare(src1[j],pivot) > 0) {
-		    dst1[j] = src1[j];
-		    j--;
-		}
-		if (i <= j) {
-		    dst1[i] = src1[j];
-		    dst1[j] = src1[i];
-		    i++;
-		    j--;
-		}
-	    }
-	}
-	if (left < j)
-	    cnif_inline_quick_sort_aux(dst1,dst2,left,j);
-	if (i < right)
-	    cnif_inline_quick_sort_aux(dst1,dst2,i,right);
+	size_t n = (left <= right) ? right-left+1 : 0;
+	memcpy(dst1+left, src1+left, n*sizeof(ERL_NIF_TERM));
+	if (src2 && dst2)
+	    memcpy(dst2+left, src2+left, n*sizeof(ERL_NIF_TERM));
+	else
+	    dst2 = src2;
+	cnif_inline_quick_sort_aux(dst1,dst2,left,right);
     }
     else if (src1)
 	cnif_inline_quick_sort_aux(src1,src2,left,right);
@@ -166,3 +115,1005 @@ int cnif_quick_usort(ERL_NIF_TERM* src1,ERL_NIF_TERM* dst1,int left,int right)
 {
     return cnif_quick_usort_aux(src1, NULL, dst1, NULL, left, right);
 }
+
+//
+// Stable merge sort of src1 with src2 (may be NULL) moved along,
+// ordered by cmp (enif_compare or a map key order)
+//
+
+#define MERGE_SORT_INSERTION 16
+
+static void insertion_sort_aux(ERL_NIF_TERM* src1, ERL_NIF_TERM* src2,
+			       size_t n, cnif_compare_t cmp)
+{
+    size_t i, j;
+    for (i = 1; i < n; i++) {
+	ERL_NIF_TERM k = src1[i];
+	ERL_NIF_TERM v = src2 ? src2[i] : 0;
+	for (j = i; (j > 0) && (cmp(src1[j-1], k) > 0); j--) {
+	    src1[j] = src1[j-1];
+	    if (src2) src2[j] = src2[j-1];
+	}
+	src1[j] = k;
+	if (src2) src2[j] = v;
+    }
+}
+
+// tmp1 and tmp2 must hold n/2 elements
+static void merge_sort_aux(ERL_NIF_TERM* src1, ERL_NIF_TERM* src2,
+			   ERL_NIF_TERM* tmp1, ERL_NIF_TERM* tmp2, size_t n,
+			   cnif_compare_t cmp)
+{
+    size_t mid = n/2;
+    size_t i = 0, j = mid, k = 0;
+
+    if (n <= MERGE_SORT_INSERTION) {
+	insertion_sort_aux(src1, src2, n, cmp);
+	return;
+    }
+    merge_sort_aux(src1, src2, tmp1, tmp2, mid, cmp);
+    merge_sort_aux(src1+mid, src2 ? src2+mid : NULL, tmp1, tmp2, n-mid,
+		   cmp);
+    // runs already in order, common for sorted input
+    if (cmp(src1[mid-1], src1[mid]) <= 0)
+	return;
+    // merge the left run, moved out to tmp, with the right run in place
+    memcpy(tmp1, src1, mid*sizeof(ERL_NIF_TERM));
+    if (src2) memcpy(tmp2, src2, mid*sizeof(ERL_NIF_TERM));
+    while((i < mid) && (j < n)) {
+	// take from the right run only when strictly less, keeps it stable
+	if (cmp(src1[j], tmp1[i]) < 0) {
+	    src1[k] = src1[j];
+	    if (src2) src2[k] = src2[j];
+	    j++;
+	}
+	else {
+	    src1[k] = tmp1[i];
+	    if (src2) src2[k] = tmp2[i];
+	    i++;
+	}
+	k++;
+    }
+    memcpy(src1+k, tmp1+i, (mid-i)*sizeof(ERL_NIF_TERM));
+    if (src2) memcpy(src2+k, tmp2+i, (mid-i)*sizeof(ERL_NIF_TERM));
+}
+
+// reverse [i,j) of src1 and src2 (may be NULL)
+static void reverse_aux(ERL_NIF_TERM* src1, ERL_NIF_TERM* src2,
+			size_t i, size_t j)
+{
+    while(i + 1 < j) {
+	j--;
+	swap(src1, i, j);
+	if (src2) swap(src2, i, j);
+	i++;
+    }
+}
+
+// [a,m) and [m,b) trade places
+static void rotate_aux(ERL_NIF_TERM* src1, ERL_NIF_TERM* src2,
+		       size_t a, size_t m, size_t b)
+{
+    reverse_aux(src1, src2, a, m);
+    reverse_aux(src1, src2, m, b);
+    reverse_aux(src1, src2, a, b);
+}
+
+// Stable merge of the sorted runs [a,m) and [m,b) without a buffer
+// (SymMerge, Kim and Kutzner). The runs are split so that rotating the
+// middle parts leaves two smaller merges, recursion depth is O(log n).
+static void sym_merge(ERL_NIF_TERM* src1, ERL_NIF_TERM* src2,
+		      size_t a, size_t m, size_t b, cnif_compare_t cmp)
+{
+    size_t mid, n, lo, hi, end;
+
+    if ((a >= m) || (m >= b))
+	return;
+    if (m - a == 1) {
+	// move src1[a] past the right run elements less than it
+	for (lo = m, hi = b; lo < hi; ) {
+	    size_t c = lo + (hi - lo)/2;
+	    if (cmp(src1[c], src1[a]) < 0) lo = c+1; else hi = c;
+	}
+	rotate_aux(src1, src2, a, m, lo);
+	return;
+    }
+    if (b - m == 1) {
+	// move src1[m] before the left run elements greater than it
+	for (lo = a, hi = m; lo < hi; ) {
+	    size_t c = lo + (hi - lo)/2;
+	    if (cmp(src1[m], src1[c]) >= 0) lo = c+1; else hi = c;
+	}
+	rotate_aux(src1, src2, lo, m, b);
+	return;
+    }
+    mid = a + (b - a)/2;
+    n = mid + m;
+    if (m > mid) {
+	lo = n - b;
+	hi = mid;
+    }
+    else {
+	lo = a;
+	hi = m;
+    }
+    while(lo < hi) {
+	size_t c = lo + (hi - lo)/2;
+	if (cmp(src1[n-1-c], src1[c]) >= 0) lo = c+1; else hi = c;
+    }
+    end = n - lo;
+    if ((lo < m) && (m < end))
+	rotate_aux(src1, src2, lo, m, end);
+    sym_merge(src1, src2, a, lo, mid, cmp);
+    sym_merge(src1, src2, mid, end, b, cmp);
+}
+
+// bottom up merge sort without a buffer, O(n log^2 n), used when the
+// merge buffer can not be allocated
+static void merge_sort_inplace(ERL_NIF_TERM* src1, ERL_NIF_TERM* src2,
+			       size_t n, cnif_compare_t cmp)
+{
+    size_t a, w;
+
+    for (a = 0; a < n; a += MERGE_SORT_INSERTION) {
+	size_t m = (n - a < MERGE_SORT_INSERTION) ? n - a :
+	    MERGE_SORT_INSERTION;
+	insertion_sort_aux(src1+a, src2 ? src2+a : NULL, m, cmp);
+    }
+    for (w = MERGE_SORT_INSERTION; w < n; w *= 2) {
+	for (a = 0; a + w < n; a += 2*w)
+	    sym_merge(src1, src2, a, a+w, (n - a > 2*w) ? a+2*w : n, cmp);
+    }
+}
+
+static void merge_sort(ERL_NIF_TERM* src1, ERL_NIF_TERM* src2, size_t n,
+		       cnif_compare_t cmp)
+{
+    ERL_NIF_TERM* tmp;
+    size_t half = n/2;
+
+    if (n <= MERGE_SORT_INSERTION) {
+	insertion_sort_aux(src1, src2, n, cmp);
+	return;
+    }
+    tmp = enif_alloc((src2 ? 2*half : half)*sizeof(ERL_NIF_TERM));
+    if (tmp == NULL) {
+	merge_sort_inplace(src1, src2, n, cmp);
+	return;
+    }
+    merge_sort_aux(src1, src2, tmp, src2 ? tmp+half : NULL, n, cmp);
+    enif_free(tmp);
+}
+
+void cnif_merge_sort_aux(ERL_NIF_TERM* src1, ERL_NIF_TERM* src2, size_t n,
+			 cnif_compare_t cmp)
+{
+    if (!sort_kernel(src1, src2, n, cmp, 1))
+	merge_sort(src1, src2, n, cmp);
+}
+
+// stable sort then keep the last of equal elements, return new size,
+// unlike the other usorts which keep the first; used where a later
+// duplicate key replaces an earlier one
+size_t cnif_merge_usort_last_aux(ERL_NIF_TERM* src1, ERL_NIF_TERM* src2,
+				 size_t n, cnif_compare_t cmp)
+{
+    size_t i, j;
+
+    cnif_merge_sort_aux(src1, src2, n, cmp);
+    if (n == 0)
+	return 0;
+    for (i = 0, j = 1; j < n; j++) {
+	if (cmp(src1[i], src1[j]) != 0)
+	    i++;
+	src1[i] = src1[j];
+	if (src2) src2[i] = src2[j];
+    }
+    return i+1;
+}
+
+// Stable sort of tuples on element pos (1 based) like lists:keysort/2.
+// The keys are extracted once and sorted with the tuples moved along.
+// Return 0 if an element is not a tuple with at least pos elements or
+// if the keys can not be allocated, arr is then left as is.
+int cnif_keysort(ERL_NIF_TERM* arr, size_t n, unsigned pos)
+{
+    ERL_NIF_TERM* keys;
+    size_t i;
+
+    if (pos == 0)
+	return 0;
+    if ((keys = enif_alloc(n*sizeof(ERL_NIF_TERM)+1)) == NULL)
+	return 0;
+    for (i = 0; i < n; i++) {
+	ERL_NIF_TERM* tp;
+	if (!IS_TUPLE(arr[i]) ||
+	    (GET_ARITYVAL((tp = GET_TUPLE(arr[i]))[0]) < pos)) {
+	    enif_free(keys);
+	    return 0;
+	}
+	keys[i] = tp[pos];
+    }
+    cnif_merge_sort_aux(keys, arr, n, enif_compare);
+    enif_free(keys);
+    return 1;
+}
+
+//
+// Pattern defeating quick sort (Orson Peters) of src1 with src2 (may
+// be NULL) moved along. Not stable, O(n log n) worst case by falling
+// back to heap sort, linear on sorted, reversed and equal runs.
+//
+
+#define PDQ_INSERTION     24    // insertion sort below this
+#define PDQ_NINTHER       128   // pseudo median of nine above this
+#define PDQ_PARTIAL_LIMIT 8     // moves allowed in a partial insertion sort
+
+static inline void swap2(ERL_NIF_TERM* src1, ERL_NIF_TERM* src2,
+			 size_t i, size_t j)
+{
+    swap(src1, i, j);
+    if (src2) swap(src2, i, j);
+}
+
+static inline void sort2(ERL_NIF_TERM* src1, ERL_NIF_TERM* src2,
+			 size_t a, size_t b, cnif_compare_t cmp)
+{
+    if (cmp(src1[b], src1[a]) < 0)
+	swap2(src1, src2, a, b);
+}
+
+static inline void sort3(ERL_NIF_TERM* src1, ERL_NIF_TERM* src2,
+			 size_t a, size_t b, size_t c, cnif_compare_t cmp)
+{
+    sort2(src1, src2, a, b, cmp);
+    sort2(src1, src2, b, c, cmp);
+    sort2(src1, src2, a, b, cmp);
+}
+
+// insertion sort that gives up after PDQ_PARTIAL_LIMIT moves
+static int partial_insertion_sort(ERL_NIF_TERM* src1, ERL_NIF_TERM* src2,
+				  size_t begin, size_t end,
+				  cnif_compare_t cmp)
+{
+    size_t moved = 0;
+    size_t i, j;
+
+    for (i = begin+1; i < end; i++) {
+	if (cmp(src1[i], src1[i-1]) < 0) {
+	    ERL_NIF_TERM k = src1[i];
+	    ERL_NIF_TERM v = src2 ? src2[i] : 0;
+	    for (j = i; (j > begin) && (cmp(k, src1[j-1]) < 0); j--) {
+		src1[j] = src1[j-1];
+		if (src2) src2[j] = src2[j-1];
+	    }
+	    src1[j] = k;
+	    if (src2) src2[j] = v;
+	    moved += i - j;
+	    if (moved > PDQ_PARTIAL_LIMIT)
+		return 0;
+	}
+    }
+    return 1;
+}
+
+static void sift_down(ERL_NIF_TERM* src1, ERL_NIF_TERM* src2,
+		      size_t i, size_t n, cnif_compare_t cmp)
+{
+    size_t c;
+    while((c = 2*i+1) < n) {
+	if ((c+1 < n) && (cmp(src1[c], src1[c+1]) < 0))
+	    c++;
+	if (cmp(src1[i], src1[c]) >= 0)
+	    return;
+	swap2(src1, src2, i, c);
+	i = c;
+    }
+}
+
+static void heap_sort_aux(ERL_NIF_TERM* src1, ERL_NIF_TERM* src2,
+			  size_t n, cnif_compare_t cmp)
+{
+    size_t i;
+    for (i = n/2; i > 0; i--)
+	sift_down(src1, src2, i-1, n, cmp);
+    for (i = n-1; i > 0; i--) {
+	swap2(src1, src2, 0, i);
+	sift_down(src1, src2, 0, i, cmp);
+    }
+}
+
+// partition [begin,end) around the pivot in src1[begin], elements equal
+// to the pivot go right. set *done if no elements had to be swapped.
+static size_t partition_right(ERL_NIF_TERM* src1, ERL_NIF_TERM* src2,
+			      size_t begin, size_t end, int* done,
+			      cnif_compare_t cmp)
+{
+    ERL_NIF_TERM pivot = src1[begin];
+    ERL_NIF_TERM pv = src2 ? src2[begin] : 0;
+    size_t first = begin;
+    size_t last = end;
+
+    // the median selection guarantees an element >= pivot on the right
+    while(cmp(src1[++first], pivot) < 0)
+	;
+    if (first-1 == begin) {
+	while((first < last) && (cmp(src1[--last], pivot) >= 0))
+	    ;
+    }
+    else {
+	while(cmp(src1[--last], pivot) >= 0)
+	    ;
+    }
+    *done = (first >= last);
+    while(first < last) {
+	swap2(src1, src2, first, last);
+	while(cmp(src1[++first], pivot) < 0)
+	    ;
+	while(cmp(src1[--last], pivot) >= 0)
+	    ;
+    }
+    first--;
+    src1[begin] = src1[first];
+    src1[first] = pivot;
+    if (src2) {
+	src2[begin] = src2[first];
+	src2[first] = pv;
+    }
+    return first;
+}
+
+// partition with elements equal to the pivot to the left, used when
+// the pivot equals the element before the range so all of them can be
+// skipped. returns the last position holding an equal element.
+static size_t partition_left(ERL_NIF_TERM* src1, ERL_NIF_TERM* src2,
+			     size_t begin, size_t end, cnif_compare_t cmp)
+{
+    ERL_NIF_TERM pivot = src1[begin];
+    ERL_NIF_TERM pv = src2 ? src2[begin] : 0;
+    size_t first = begin;
+    size_t last = end;
+
+    while(cmp(pivot, src1[--last]) < 0)
+	;
+    if (last+1 == end) {
+	while((first < last) && (cmp(pivot, src1[++first]) >= 0))
+	    ;
+    }
+    else {
+	while(cmp(pivot, src1[++first]) >= 0)
+	    ;
+    }
+    while(first < last) {
+	swap2(src1, src2, first, last);
+	while(cmp(pivot, src1[--last]) < 0)
+	    ;
+	while(cmp(pivot, src1[++first]) >= 0)
+	    ;
+    }
+    src1[begin] = src1[last];
+    src1[last] = pivot;
+    if (src2) {
+	src2[begin] = src2[last];
+	src2[last] = pv;
+    }
+    return last;
+}
+
+// break up patterns in a badly partitioned range
+static void pdq_shuffle(ERL_NIF_TERM* src1, ERL_NIF_TERM* src2,
+			size_t begin, size_t end)
+{
+    size_t n = end - begin;
+    size_t q = n/4;
+
+    if (n < PDQ_INSERTION)
+	return;
+    swap2(src1, src2, begin, begin+q);
+    swap2(src1, src2, end-1, end-q);
+    if (n > PDQ_NINTHER) {
+	swap2(src1, src2, begin+1, begin+q+1);
+	swap2(src1, src2, begin+2, begin+q+2);
+	swap2(src1, src2, end-2, end-q-1);
+	swap2(src1, src2, end-3, end-q-2);
+    }
+}
+
+static void pdq_loop(ERL_NIF_TERM* src1, ERL_NIF_TERM* src2,
+		     size_t begin, size_t end, int bad_allowed, int leftmost,
+		     cnif_compare_t cmp)
+{
+    while(1) {
+	size_t size = end - begin;
+	size_t half = size/2;
+	size_t pivot_pos;
+	size_t l_size, r_size;
+	int done;
+
+	if (size < PDQ_INSERTION) {
+	    insertion_sort_aux(src1+begin, src2 ? src2+begin : NULL, size,
+			       cmp);
+	    return;
+	}
+	// pivot selection, the median ends up in src1[begin]
+	if (size > PDQ_NINTHER) {
+	    sort3(src1, src2, begin, begin+half, end-1, cmp);
+	    sort3(src1, src2, begin+1, begin+half-1, end-2, cmp);
+	    sort3(src1, src2, begin+2, begin+half+1, end-3, cmp);
+	    sort3(src1, src2, begin+half-1, begin+half, begin+half+1, cmp);
+	    swap2(src1, src2, begin, begin+half);
+	}
+	else
+	    sort3(src1, src2, begin+half, begin, end-1, cmp);
+
+	// pivot equal to the element before the range, which is <= all
+	// elements in the range, skip the run of equal elements
+	if (!leftmost && (cmp(src1[begin-1], src1[begin]) >= 0)) {
+	    begin = partition_left(src1, src2, begin, end, cmp) + 1;
+	    continue;
+	}
+
+	pivot_pos = partition_right(src1, src2, begin, end, &done, cmp);
+	l_size = pivot_pos - begin;
+	r_size = end - (pivot_pos + 1);
+
+	if ((l_size < size/8) || (r_size < size/8)) {
+	    if (--bad_allowed == 0) {
+		heap_sort_aux(src1+begin, src2 ? src2+begin : NULL, size, cmp);
+		return;
+	    }
+	    pdq_shuffle(src1, src2, begin, pivot_pos);
+	    pdq_shuffle(src1, src2, pivot_pos+1, end);
+	}
+	else if (done &&
+		 partial_insertion_sort(src1, src2, begin, pivot_pos, cmp) &&
+		 partial_insertion_sort(src1, src2, pivot_pos+1, end, cmp))
+	    return;
+
+	// recurse into the left part, loop on the right part
+	pdq_loop(src1, src2, begin, pivot_pos, bad_allowed, leftmost, cmp);
+	begin = pivot_pos + 1;
+	leftmost = 0;
+    }
+}
+
+static void pdq_sort(ERL_NIF_TERM* src1, ERL_NIF_TERM* src2, size_t n,
+		     cnif_compare_t cmp)
+{
+    int bad_allowed = 0;
+    size_t m;
+
+    for (m = n; m > 1; m >>= 1)
+	bad_allowed++;
+    pdq_loop(src1, src2, 0, n, bad_allowed+1, 1, cmp);
+}
+
+void cnif_pdq_sort_aux(ERL_NIF_TERM* src1, ERL_NIF_TERM* src2, size_t n,
+		       cnif_compare_t cmp)
+{
+    if (!sort_kernel(src1, src2, n, cmp, 0))
+	pdq_sort(src1, src2, n, cmp);
+}
+
+// sort then keep the first of equal elements, return new size
+size_t cnif_pdq_usort_aux(ERL_NIF_TERM* src1, ERL_NIF_TERM* src2, size_t n,
+			  cnif_compare_t cmp)
+{
+    size_t i, j;
+
+    cnif_pdq_sort_aux(src1, src2, n, cmp);
+    if (n == 0)
+	return 0;
+    for (i = 0, j = 1; j < n; j++) {
+	if (cmp(src1[i], src1[j]) != 0) {
+	    i++;
+	    src1[i] = src1[j];
+	    if (src2) src2[i] = src2[j];
+	}
+    }
+    return i+1;
+}
+
+//
+// Kernels for arrays holding one kind of term. In term order (and in map
+// key order, which only differs between integers and floats) the keys
+// map to unsigned 64 bit values in the same order and are radix sorted.
+// Radix sort is stable, so the kernels serve both the merge sort and the
+// quick sort entry points.
+//
+
+#define SORT_KERNEL_MIN 64   // generic sort below this
+
+typedef enum {
+    SORT_MIXED,
+    SORT_SMALL,
+    SORT_FLOAT,
+    SORT_ATOM,
+    SORT_BINARY
+} sort_kind_t;
+
+static sort_kind_t sort_kind(const ERL_NIF_TERM* src1, size_t n)
+{
+    size_t i;
+
+    if (IS_SMALL(src1[0])) {
+	for (i = 1; i < n; i++)
+	    if (!IS_SMALL(src1[i])) return SORT_MIXED;
+	return SORT_SMALL;
+    }
+    else if (IS_ATOM(src1[0])) {
+	for (i = 1; i < n; i++)
+	    if (!IS_ATOM(src1[i])) return SORT_MIXED;
+	return SORT_ATOM;
+    }
+    else if (IS_FLOAT(src1[0])) {
+	for (i = 1; i < n; i++)
+	    if (!IS_FLOAT(src1[i])) return SORT_MIXED;
+	return SORT_FLOAT;
+    }
+    else if (IS_BINARY(src1[0])) {
+	for (i = 1; i < n; i++)
+	    if (!IS_BINARY(src1[i])) return SORT_MIXED;
+	return SORT_BINARY;
+    }
+    return SORT_MIXED;
+}
+
+#define RADIX_SPLIT_MIN (1 << 16)  // split large arrays on the top digit
+
+// LSD radix sort of key on the digits below dmax, eight bits per pass,
+// with src1 and src2 (both may be NULL) moved along. tkey, t1 and t2 are
+// scratch space of n elements, the result ends up in key, src1 and src2.
+// Passes where all keys share the digit are skipped.
+static void radix_lsd(uint64_t* key, ERL_NIF_TERM* src1, ERL_NIF_TERM* src2,
+		      uint64_t* tkey, ERL_NIF_TERM* t1, ERL_NIF_TERM* t2,
+		      size_t n, int dmax)
+{
+    size_t count[8][256];
+    uint64_t* k0 = key;
+    ERL_NIF_TERM* s1 = src1;
+    ERL_NIF_TERM* s2 = src2;
+    ERL_NIF_TERM* tmp;
+    uint64_t* ktmp;
+    size_t i;
+    int d;
+
+    if (n < 2)
+	return;
+    memset(count, 0, dmax*sizeof(count[0]));
+    for (i = 0; i < n; i++) {
+	uint64_t k = key[i];
+	for (d = 0; d < dmax; d++)
+	    count[d][(k >> (8*d)) & 0xff]++;
+    }
+    for (d = 0; d < dmax; d++) {
+	size_t* c = count[d];
+	size_t sum = 0;
+	int b;
+
+	if (c[(key[0] >> (8*d)) & 0xff] == n)
+	    continue;
+	for (b = 0; b < 256; b++) {
+	    size_t x = c[b];
+	    c[b] = sum;
+	    sum += x;
+	}
+	for (i = 0; i < n; i++) {
+	    size_t j = c[(key[i] >> (8*d)) & 0xff]++;
+	    tkey[j] = key[i];
+	    if (src1) t1[j] = src1[i];
+	    if (src2) t2[j] = src2[i];
+	}
+	ktmp = key; key = tkey; tkey = ktmp;
+	tmp = src1; src1 = t1; t1 = tmp;
+	tmp = src2; src2 = t2; t2 = tmp;
+    }
+    // odd number of passes, result is in the scratch arrays
+    if (key != k0) {
+	memcpy(k0, key, n*sizeof(uint64_t));
+	if (s1) memcpy(s1, src1, n*sizeof(ERL_NIF_TERM));
+	if (s2) memcpy(s2, src2, n*sizeof(ERL_NIF_TERM));
+    }
+}
+
+// Stable radix sort on key with src1 and src2 (both may be NULL) moved
+// along. Large arrays are first split on the highest digit that varies,
+// the LSD passes then run on buckets that fit in cache. Return 0, with
+// nothing moved, if the scratch space can not be allocated.
+static int radix_sort_aux(uint64_t* key, ERL_NIF_TERM* src1,
+			  ERL_NIF_TERM* src2, size_t n)
+{
+    uint64_t* kbuf = enif_alloc(n*sizeof(uint64_t));
+    ERL_NIF_TERM* tbuf = src1 ?
+	enif_alloc((src2 ? 2*n : n)*sizeof(ERL_NIF_TERM)) : NULL;
+    ERL_NIF_TERM* t1 = tbuf;
+    ERL_NIF_TERM* t2 = src2 ? tbuf+n : NULL;
+    size_t count[256];
+    uint64_t diff = 0;
+    size_t i, offs;
+    int d, b;
+
+    if ((kbuf == NULL) || (src1 && (tbuf == NULL))) {
+	if (kbuf) enif_free(kbuf);
+	if (tbuf) enif_free(tbuf);
+	return 0;
+    }
+    if (n < RADIX_SPLIT_MIN) {
+	radix_lsd(key, src1, src2, kbuf, t1, t2, n, 8);
+	goto done;
+    }
+    for (i = 1; i < n; i++)
+	diff |= key[i] ^ key[0];
+    if (diff == 0)
+	goto done;
+    for (d = 7; (diff >> (8*d)) == 0; d--)
+	;
+    memset(count, 0, sizeof(count));
+    for (i = 0; i < n; i++)
+	count[(key[i] >> (8*d)) & 0xff]++;
+    for (offs = 0, b = 0; b < 256; b++) {
+	size_t x = count[b];
+	count[b] = offs;
+	offs += x;
+    }
+    for (i = 0; i < n; i++) {
+	size_t j = count[(key[i] >> (8*d)) & 0xff]++;
+	kbuf[j] = key[i];
+	if (src1) t1[j] = src1[i];
+	if (src2) t2[j] = src2[i];
+    }
+    // count[b] is now the end of bucket b
+    for (offs = 0, b = 0; b < 256; b++) {
+	size_t m = count[b] - offs;
+	radix_lsd(kbuf+offs, t1 ? t1+offs : NULL, t2 ? t2+offs : NULL,
+		  key+offs, src1 ? src1+offs : NULL, src2 ? src2+offs : NULL,
+		  m, d);
+	offs = count[b];
+    }
+    memcpy(key, kbuf, n*sizeof(uint64_t));
+    if (src1) memcpy(src1, t1, n*sizeof(ERL_NIF_TERM));
+    if (src2) memcpy(src2, t2, n*sizeof(ERL_NIF_TERM));
+done:
+    enif_free(kbuf);
+    if (tbuf) enif_free(tbuf);
+    return 1;
+}
+
+// identical atoms share the term, group them by term value, rank the
+// groups by name and sort on the rank. Return 0 if out of memory, src1
+// may then be grouped already, which keeps equal atoms in input order.
+static int atom_keys(ERL_NIF_TERM* src1, ERL_NIF_TERM* src2, uint64_t* key,
+		     size_t n)
+{
+    ERL_NIF_TERM* head;
+    ERL_NIF_TERM* group;
+    size_t i, j, m;
+
+    for (i = 0; i < n; i++)
+	key[i] = src1[i];
+    if (!radix_sort_aux(key, src1, src2, n))
+	return 0;
+    for (m = 1, i = 1; i < n; i++)
+	m += (src1[i] != src1[i-1]);
+    if ((head = enif_alloc(2*m*sizeof(ERL_NIF_TERM))) == NULL)
+	return 0;
+    group = head + m;
+    head[0] = src1[0];
+    group[0] = 0;
+    for (j = 1, i = 1; i < n; i++) {
+	if (src1[i] != src1[i-1]) {
+	    head[j] = src1[i];
+	    group[j] = j;
+	    j++;
+	}
+    }
+    pdq_sort(head, group, m, enif_compare);
+    // head now holds the rank of each group
+    for (j = 0; j < m; j++)
+	head[group[j]] = j;
+    key[0] = head[0];
+    for (j = 0, i = 1; i < n; i++) {
+	if (src1[i] != src1[i-1])
+	    j++;
+	key[i] = head[j];
+    }
+    enif_free(head);
+    return 1;
+}
+
+// sort key is the first eight bytes, zero padded, big endian
+static uint64_t binary_prefix(ERL_NIF_TERM t)
+{
+    ErlNifBinary bin;
+    uint64_t k = 0;
+    size_t i;
+
+    enif_inspect_binary(NULL, t, &bin);
+    for (i = 0; i < 8; i++)
+	k = (k << 8) | ((i < bin.size) ? bin.data[i] : 0);
+    return k;
+}
+
+static int sort_kernel(ERL_NIF_TERM* src1, ERL_NIF_TERM* src2, size_t n,
+		       cnif_compare_t cmp, int stable)
+{
+    sort_kind_t kind;
+    uint64_t* key;
+    size_t i, j;
+
+    if ((n < SORT_KERNEL_MIN) ||
+	((cmp != enif_compare) && (cmp != cnif_map_key_compare)))
+	return 0;
+    if ((kind = sort_kind(src1, n)) == SORT_MIXED)
+	return 0;
+
+    if ((key = enif_alloc(n*sizeof(uint64_t))) == NULL)
+	return 0;
+    switch(kind) {
+    case SORT_SMALL:
+	for (i = 0; i < n; i++)
+	    key[i] = ((uint64_t) GET_SMALL(src1[i])) ^ (UINT64_C(1) << 63);
+	break;
+    case SORT_FLOAT:
+	for (i = 0; i < n; i++) {
+	    double f;
+	    uint64_t k;
+	    enif_get_double(NULL, src1[i], &f);
+	    if (f == 0.0) f = 0.0;  // -0.0 == 0.0
+	    memcpy(&k, &f, sizeof(k));
+	    // negative floats reverse, positive ones go above them
+	    key[i] = (k & (UINT64_C(1) << 63)) ? ~k : k ^ (UINT64_C(1) << 63);
+	}
+	break;
+    case SORT_ATOM:
+	if (!atom_keys(src1, src2, key, n))
+	    goto error;
+	break;
+    case SORT_BINARY:
+	for (i = 0; i < n; i++)
+	    key[i] = binary_prefix(src1[i]);
+	break;
+    default:
+	break;
+    }
+    if ((kind == SORT_SMALL) && !src2) {
+	// the key is the value, no need to move the terms along
+	if (!radix_sort_aux(key, NULL, NULL, n))
+	    goto error;
+	for (i = 0; i < n; i++)
+	    src1[i] = MAKE_SMALL((ERL_NIF_INT) (key[i] ^ (UINT64_C(1) << 63)));
+    }
+    else if (!radix_sort_aux(key, src1, src2, n))
+	goto error;
+
+    // binaries with equal prefix are ordered by the generic comparator
+    if (kind == SORT_BINARY) {
+	for (i = 0; i < n; i = j) {
+	    for (j = i+1; (j < n) && (key[j] == key[i]); j++)
+		;
+	    if (j - i > 1) {
+		if (stable)
+		    merge_sort(src1+i, src2 ? src2+i : NULL, j-i, cmp);
+		else
+		    pdq_sort(src1+i, src2 ? src2+i : NULL, j-i, cmp);
+	    }
+	}
+    }
+    enif_free(key);
+    return 1;
+error:
+    // the caller falls back to a comparison sort
+    enif_free(key);
+    return 0;
+}
+
+//
+// Parallel stable sort. The array is cut in one chunk per thread and the
+// chunks are sorted with cnif_merge_sort_aux. Sorted runs are then merged
+// pairwise, every merge round is split on output position (merge path)
+// so all threads take part until the last merge.
+//
+
+#define PARALLEL_SORT_MIN   65536  // sort in the calling thread below this
+#define PARALLEL_MAX_THREADS 64
+
+typedef struct {
+    ERL_NIF_TERM* src1;
+    ERL_NIF_TERM* src2;
+    ERL_NIF_TERM* dst1;
+    ERL_NIF_TERM* dst2;
+    size_t lo;        // run [lo,mid) is merged with run [mid,hi)
+    size_t mid;
+    size_t hi;
+    size_t k0;        // output positions [k0,k1) relative to lo
+    size_t k1;
+    cnif_compare_t cmp;
+} sort_job_t;
+
+static void* sort_chunk(void* arg)
+{
+    sort_job_t* jp = (sort_job_t*) arg;
+    cnif_merge_sort_aux(jp->src1+jp->lo, jp->src2 ? jp->src2+jp->lo : NULL,
+			jp->hi - jp->lo, jp->cmp);
+    return NULL;
+}
+
+// number of elements taken from a in the first k elements of the stable
+// merge of a and b
+static size_t merge_corank(const ERL_NIF_TERM* a, size_t la,
+			   const ERL_NIF_TERM* b, size_t lb, size_t k,
+			   cnif_compare_t cmp)
+{
+    size_t lo = (k > lb) ? k - lb : 0;
+    size_t hi = (k < la) ? k : la;
+
+    while(lo < hi) {
+	size_t i = (lo + hi)/2;
+	size_t j = k - i;
+	if ((j > 0) && (cmp(b[j-1], a[i]) >= 0))
+	    lo = i+1;
+	else
+	    hi = i;
+    }
+    return lo;
+}
+
+static void* merge_part(void* arg)
+{
+    sort_job_t* jp = (sort_job_t*) arg;
+    ERL_NIF_TERM* a1 = jp->src1 + jp->lo;
+    ERL_NIF_TERM* b1 = jp->src1 + jp->mid;
+    ERL_NIF_TERM* a2 = jp->src2 ? jp->src2 + jp->lo : NULL;
+    ERL_NIF_TERM* b2 = jp->src2 ? jp->src2 + jp->mid : NULL;
+    size_t la = jp->mid - jp->lo;
+    size_t lb = jp->hi - jp->mid;
+    size_t i = merge_corank(a1, la, b1, lb, jp->k0, jp->cmp);
+    size_t j = jp->k0 - i;
+    size_t i1 = merge_corank(a1, la, b1, lb, jp->k1, jp->cmp);
+    size_t j1 = jp->k1 - i1;
+    size_t k = jp->lo + jp->k0;
+
+    while((i < i1) && (j < j1)) {
+	if (jp->cmp(b1[j], a1[i]) < 0) {
+	    jp->dst1[k] = b1[j];
+	    if (a2) jp->dst2[k] = b2[j];
+	    j++;
+	}
+	else {
+	    jp->dst1[k] = a1[i];
+	    if (a2) jp->dst2[k] = a2[i];
+	    i++;
+	}
+	k++;
+    }
+    memcpy(jp->dst1+k, a1+i, (i1-i)*sizeof(ERL_NIF_TERM));
+    if (a2) memcpy(jp->dst2+k, a2+i, (i1-i)*sizeof(ERL_NIF_TERM));
+    k += (i1-i);
+    memcpy(jp->dst1+k, b1+j, (j1-j)*sizeof(ERL_NIF_TERM));
+    if (a2) memcpy(jp->dst2+k, b2+j, (j1-j)*sizeof(ERL_NIF_TERM));
+    return NULL;
+}
+
+// run jobs in threads of their own, the first one in the calling thread.
+// a job that could not get a thread also runs in the calling thread.
+static void run_jobs(void* (*fun)(void*), sort_job_t* job, int njobs)
+{
+    pthread_t tid[2*PARALLEL_MAX_THREADS];
+    int started[2*PARALLEL_MAX_THREADS];
+    int i;
+
+    for (i = 1; i < njobs; i++)
+	started[i] = (pthread_create(&tid[i], NULL, fun, &job[i]) == 0);
+    fun(&job[0]);
+    for (i = 1; i < njobs; i++) {
+	if (started[i])
+	    pthread_join(tid[i], NULL);
+	else
+	    fun(&job[i]);
+    }
+}
+
+int cnif_sort_threads(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) return 1;
+    return (n > PARALLEL_MAX_THREADS) ? PARALLEL_MAX_THREADS : n;
+}
+
+// nthreads <= 0 uses one thread per online processor
+void cnif_parallel_sort_aux(ERL_NIF_TERM* src1, ERL_NIF_TERM* src2, size_t n,
+			    cnif_compare_t cmp, int nthreads)
+{
+    sort_job_t job[2*PARALLEL_MAX_THREADS];
+    size_t bound[PARALLEL_MAX_THREADS+1];
+    ERL_NIF_TERM* tmp;
+    ERL_NIF_TERM *s1, *s2, *d1, *d2, *t;
+    int nruns, i;
+
+    if (nthreads <= 0)
+	nthreads = cnif_sort_threads();
+    if (nthreads > PARALLEL_MAX_THREADS)
+	nthreads = PARALLEL_MAX_THREADS;
+    // without the merge buffer the sort runs in the calling thread
+    if ((nthreads == 1) || (n < PARALLEL_SORT_MIN) ||
+	((tmp = enif_alloc((src2 ? 2*n : n)*sizeof(ERL_NIF_TERM))) == NULL)) {
+	cnif_merge_sort_aux(src1, src2, n, cmp);
+	return;
+    }
+
+    for (i = 0; i <= nthreads; i++)
+	bound[i] = (n * i) / nthreads;
+    for (i = 0; i < nthreads; i++) {
+	job[i].src1 = src1;
+	job[i].src2 = src2;
+	job[i].lo   = bound[i];
+	job[i].hi   = bound[i+1];
+	job[i].cmp  = cmp;
+    }
+    run_jobs(sort_chunk, job, nthreads);
+
+    s1 = src1; s2 = src2;
+    d1 = tmp;  d2 = src2 ? tmp+n : NULL;
+    nruns = nthreads;
+    while(nruns > 1) {
+	int njobs = 0;
+	int r;
+
+	for (r = 0; r < nruns; r += 2) {
+	    size_t lo = bound[r];
+	    size_t mid = bound[r+1];  // a last odd run is just copied
+	    size_t hi = (r+1 < nruns) ? bound[r+2] : bound[r+1];
+	    // split the merge so each thread gets about n/nthreads outputs
+	    int parts = (int) (((hi - lo) * nthreads + n - 1) / n);
+	    int p;
+
+	    if (parts < 1) parts = 1;
+	    for (p = 0; p < parts; p++) {
+		sort_job_t* jp = &job[njobs++];
+		jp->src1 = s1;
+		jp->src2 = s2;
+		jp->dst1 = d1;
+		jp->dst2 = d2;
+		jp->lo   = lo;
+		jp->mid  = mid;
+		jp->hi   = hi;
+		jp->k0   = ((hi - lo) * p) / parts;
+		jp->k1   = ((hi - lo) * (p+1)) / parts;
+		jp->cmp  = cmp;
+	    }
+	}
+	run_jobs(merge_part, job, njobs);
+	// every other bound goes away
+	for (r = 0; 2*r < nruns; r++)
+	    bound[r] = bound[2*r];
+	bound[r] = n;
+	nruns = r;
+	t = s1; s1 = d1; d1 = t;
+	t = s2; s2 = d2; d2 = t;
+    }
+    if (s1 != src1) {
+	memcpy(src1, s1, n*sizeof(ERL_NIF_TERM));
+	if (src2) memcpy(src2, s2, n*sizeof(ERL_NIF_TERM));
+    }
+    enif_free(tmp);
+}
+
+// parallel sort then keep the first of equal elements, like
+// cnif_quick_usort, return new size
+size_t cnif_parallel_usort_aux(ERL_NIF_TERM* src1, ERL_NIF_TERM* src2,
+			       size_t n, cnif_compare_t cmp, int nthreads)
+{
+    size_t i, j;
+
+    cnif_parallel_sort_aux(src1, src2, n, cmp, nthreads);
+    if (n == 0)
+	return 0;
+    for (i = 0, j = 1; j < n; j++) {
+	if (cmp(src1[i], src1[j]) != 0) {
+	    i++;
+	    src1[i] = src1[j];
+	    if (src2) src2[i] = src2[j];
+	}
+    }
+    return i+1;
+}
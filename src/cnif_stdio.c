@@ -1,19 +1,48 @@
 #include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "../include/cnif_io.h"
+#include "../include/cnif_stdio.h"
 
 static int stdio_format(enif_io_t* p, void* arg, char* fmt, va_list ap)
 {
     return vfprintf((FILE*) arg, fmt, ap);
 }
 
-static int stdio_getc(enif_io_t* p, void* arg)
+// Through stdio so input already buffered in the stream is seen.
+// Regular files are read in blocks. On a pipe or a terminal fread would
+// wait for len bytes, there the read stops after a newline so a term is
+// parsed as soon as its line has arrived.
+static ssize_t stdio_read(enif_io_t* p, void* arg, char* buf, size_t len)
 {
-    return fgetc((FILE*)arg);
-}
+    FILE* f = (FILE*) arg;
+    int fd = fileno(f);
+    struct stat st;
+    size_t n = 0;
+    int c;
 
-static int stdio_ungetc(enif_io_t* p, int c, void* arg)
-{
-    return ungetc(c, (FILE*)arg);
+    if ((fd < 0) || (fstat(fd, &st) < 0) || S_ISREG(st.st_mode))
+	return fread(buf, 1, len, f);
+    flockfile(f);
+    while(n < len) {
+	if ((c = getc_unlocked(f)) == EOF) {
+	    if ((n == 0) && ferror(f) && (errno == EINTR)) {
+		clearerr(f);
+		continue;
+	    }
+	    break;
+	}
+	buf[n++] = c;
+	if (c == '\n')
+	    break;
+    }
+    funlockfile(f);
+    if ((n == 0) && ferror(f))
+	return -1;
+    return n;
 }
 
 static int stdio_putc(enif_io_t* p, int c, void* arg)
@@ -33,8 +62,7 @@ enif_io_methods_t stdio_meth =
 {
     .putc     = stdio_putc,
     .format   = stdio_format,
-    .getc     = stdio_getc,
-    .ungetc   = stdio_ungetc,
+    .read     = stdio_read,
     .close    = stdio_close,
 };
 
@@ -42,3 +70,68 @@ enif_io_t* enif_stdio_alloc(ErlNifEnv* env, void* data)
 {
     return enif_io_alloc(env, &stdio_meth, data);
 }
+
+// parse all forms in len bytes at data, callback is called with each
+// term. return the scan result
+int enif_io_parse_buffer(ErlNifEnv* env, const char* data, size_t len,
+			 enif_io_callback_t callback, void* cb_data)
+{
+    enif_io_t* p = enif_stdio_alloc(env, cb_data);
+    int r;
+
+    enif_io_set_callback(p, callback);
+    enif_io_push_buffer(p, data, len, "*buffer*", 1, stdout, "*stdout*");
+    r = enif_io_scan_forms(p);
+    enif_io_free(p);
+    return r;
+}
+
+static void unmap_release(void* data, size_t size, void* arg)
+{
+    munmap(data, size);
+}
+
+// parse a file mapped into memory. binaries written as <<"chars">>
+// reference the mapping, it is unmapped when the envs holding such
+// binaries are cleared. return 0 if the file can not be mapped
+int enif_io_parse_file_mmap(ErlNifEnv* env, const char* path,
+			    enif_io_callback_t callback, void* cb_data)
+{
+    enif_io_t* p;
+    cnif_external_t* ext;
+    struct stat st;
+    void* addr;
+    int fd;
+    int r;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+	return 0;
+    if (fstat(fd, &st) < 0) {
+	close(fd);
+	return 0;
+    }
+    if (st.st_size == 0) {
+	close(fd);
+	return enif_io_parse_buffer(env, "", 0, callback, cb_data);
+    }
+    addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED)
+	return 0;
+#ifdef MADV_SEQUENTIAL
+    madvise(addr, st.st_size, MADV_SEQUENTIAL);
+#endif
+    if ((ext = cnif_external_new(addr, st.st_size, unmap_release, NULL)) == NULL) {
+	munmap(addr, st.st_size);
+	return 0;
+    }
+    p = enif_stdio_alloc(env, cb_data);
+    enif_io_set_callback(p, callback);
+    enif_io_push_buffer(p, addr, st.st_size, (char*) path, 1,
+			stdout, "*stdout*");
+    p->state[p->sp].ext = ext;
+    r = enif_io_scan_forms(p);
+    enif_io_free(p);
+    cnif_external_release(ext);
+    return r;
+}
@@ -0,0 +1,314 @@
+//
+// Term keyed hash table on lhash
+//
+#include "../include/cnif.h"
+#include "../include/cnif_term.h"
+#include "../include/cnif_lhash.h"
+#include "../include/cnif_hash.h"
+#include "../include/cnif_hashmap.h"
+#include "../include/cnif_misc.h"
+#include "../include/cnif_termtab.h"
+#include "../include/cnif_alloc.h"
+
+// the env is compacted when updates and erases have left it more than
+// half garbage and the garbage is at least this many words
+#define TERMTAB_COMPACT_MIN 4096
+
+typedef struct {
+    lhash_bucket_t bucket;
+    ERL_NIF_TERM key;
+    ERL_NIF_TERM value;
+} termtab_item_t;
+
+struct _cnif_termtab_t {
+    lhash_t hash;
+    ErlNifEnv* env;     // owns keys and values
+    size_t live;        // heap words of the stored copies
+    size_t garbage;     // heap words of copies replaced or erased
+};
+
+// the hash is computed once per operation and passed in the template
+static lhash_value_t item_hash(void* a)
+{
+    return ((termtab_item_t*) a)->bucket.hvalue;
+}
+
+static int item_cmp(void* a, void* b)
+{
+    return !enif_is_identical(((termtab_item_t*) a)->key,
+			      ((termtab_item_t*) b)->key);
+}
+
+static void* item_alloc(void* a)
+{
+    termtab_item_t* ip = enif_alloc(sizeof(termtab_item_t));
+    if (ip == NULL)
+	return NULL;
+    ip->key   = ((termtab_item_t*) a)->key;
+    ip->value = ((termtab_item_t*) a)->value;
+    return ip;
+}
+
+static void item_free(void* a)
+{
+    enif_free(a);
+}
+
+static const lhash_methods_t termtab_funcs =
+{
+    item_hash,
+    item_cmp,
+    item_alloc,
+    item_free
+};
+
+cnif_termtab_t* cnif_termtab_new(void)
+{
+    cnif_termtab_t* tab;
+
+    if ((tab = enif_alloc(sizeof(cnif_termtab_t))) == NULL)
+	return NULL;
+    if ((tab->env = enif_alloc_env()) == NULL) {
+	enif_free(tab);
+	return NULL;
+    }
+    lhash_init(&tab->hash, "termtab", 3, &termtab_funcs);
+    tab->live = 0;
+    tab->garbage = 0;
+    return tab;
+}
+
+void cnif_termtab_free(cnif_termtab_t* tab)
+{
+    lhash_free(&tab->hash);
+    enif_free_env(tab->env);
+    enif_free(tab);
+}
+
+ErlNifEnv* cnif_termtab_env(cnif_termtab_t* tab)
+{
+    return tab->env;
+}
+
+size_t cnif_termtab_size(cnif_termtab_t* tab)
+{
+    return tab->hash.nitems;
+}
+
+static inline void item_init(termtab_item_t* tmpl, ERL_NIF_TERM key)
+{
+    tmpl->bucket.hvalue = cnif_hash_term(key, 0);
+    tmpl->key = key;
+}
+
+int cnif_termtab_get(cnif_termtab_t* tab, ERL_NIF_TERM key,
+		     ERL_NIF_TERM* value)
+{
+    termtab_item_t tmpl;
+    termtab_item_t* ip;
+
+    item_init(&tmpl, key);
+    if ((ip = lhash_get(&tab->hash, &tmpl)) == NULL)
+	return 0;
+    *value = ip->value;
+    return 1;
+}
+
+typedef struct {
+    termtab_item_t** items;
+    size_t n;
+} collect_arg_t;
+
+static void collect_item(void* item, void* arg)
+{
+    collect_arg_t* ap = (collect_arg_t*) arg;
+    ap->items[ap->n++] = (termtab_item_t*) item;
+}
+
+// copy the live keys and values into a fresh heap and drop the old
+// one, the table is left as is if some copy fails
+static int termtab_compact(cnif_termtab_t* tab)
+{
+    size_t n = tab->hash.nitems;
+    ErlNifEnv* fresh;
+    ERL_NIF_TERM* terms;
+    cnif_heap_stats_t stats;
+    collect_arg_t a;
+    size_t i;
+
+    if ((fresh = enif_alloc_env()) == NULL)
+	return 0;
+    a.items = enif_alloc(n*sizeof(termtab_item_t*) + 2*n*sizeof(ERL_NIF_TERM));
+    if ((a.items == NULL) ||
+	!cnif_env_set_allocator(fresh, cnif_env_allocator(tab->env)))
+	goto error;
+    a.n = 0;
+    lhash_each(&tab->hash, collect_item, &a);
+    terms = (ERL_NIF_TERM*) (a.items + n);
+    cnif_heap_stats(tab->env, &stats);
+    cnif_heap_set_limit(fresh, stats.limit);
+    for (i = 0; i < n; i++) {
+	if (!(terms[2*i] = enif_make_copy(fresh, a.items[i]->key)) ||
+	    !(terms[2*i+1] = enif_make_copy(fresh, a.items[i]->value)))
+	    goto error;
+    }
+    for (i = 0; i < n; i++) {
+	a.items[i]->key = terms[2*i];
+	a.items[i]->value = terms[2*i+1];
+    }
+    enif_free(a.items);
+    enif_clear_env(tab->env);
+    enif_env_adopt(tab->env, fresh);
+    enif_free_env(fresh);
+    tab->garbage = 0;
+    return 1;
+error:
+    enif_free(a.items);
+    enif_free_env(fresh);
+    return 0;
+}
+
+// old copies are left in the env by updates and erases, the words
+// are counted as the copies were made so the check is constant time
+static void termtab_garbage(cnif_termtab_t* tab, size_t words)
+{
+    tab->live -= words;
+    tab->garbage += words;
+    if ((tab->garbage >= TERMTAB_COMPACT_MIN) && (tab->garbage > tab->live))
+	termtab_compact(tab);
+}
+
+// insert or replace, replace only when update is set. Return 0 if the
+// key is present and update is not set or if the copies fail.
+static int termtab_insert(cnif_termtab_t* tab, ERL_NIF_TERM key,
+			  ERL_NIF_TERM value, int update)
+{
+    termtab_item_t tmpl;
+    termtab_item_t* ip;
+
+    item_init(&tmpl, key);
+    if ((ip = lhash_get(&tab->hash, &tmpl)) != NULL) {
+	if (!update)
+	    return 0;
+	if ((value = enif_make_copy(tab->env, value)) == INVALID_TERM)
+	    return 0;
+	tab->live += enif_flat_size(value);
+	key = ip->value;
+	ip->value = value;
+	termtab_garbage(tab, enif_flat_size(key));
+	return 1;
+    }
+    if ((tmpl.key = enif_make_copy(tab->env, key)) == INVALID_TERM)
+	return 0;
+    tab->live += enif_flat_size(tmpl.key);
+    if ((tmpl.value = enif_make_copy(tab->env, value)) == INVALID_TERM) {
+	termtab_garbage(tab, enif_flat_size(tmpl.key));
+	return 0;
+    }
+    tab->live += enif_flat_size(tmpl.value);
+    if (lhash_put(&tab->hash, &tmpl) == NULL) {
+	termtab_garbage(tab, enif_flat_size(tmpl.key) +
+			enif_flat_size(tmpl.value));
+	return 0;
+    }
+    return 1;
+}
+
+int cnif_termtab_put(cnif_termtab_t* tab, ERL_NIF_TERM key,
+		     ERL_NIF_TERM value)
+{
+    return termtab_insert(tab, key, value, 1);
+}
+
+// insert unless the key is present, return 0 if it was
+int cnif_termtab_put_new(cnif_termtab_t* tab, ERL_NIF_TERM key,
+			 ERL_NIF_TERM value)
+{
+    return termtab_insert(tab, key, value, 0);
+}
+
+int cnif_termtab_erase(cnif_termtab_t* tab, ERL_NIF_TERM key)
+{
+    termtab_item_t tmpl;
+    termtab_item_t* ip;
+    size_t words;
+
+    item_init(&tmpl, key);
+    if ((ip = lhash_get(&tab->hash, &tmpl)) == NULL)
+	return 0;
+    words = enif_flat_size(ip->key) + enif_flat_size(ip->value);
+    lhash_erase(&tab->hash, &tmpl);
+    termtab_garbage(tab, words);
+    return 1;
+}
+
+typedef struct {
+    cnif_termtab_fun_t fun;
+    void* arg;
+} each_arg_t;
+
+static void each_item(void* item, void* arg)
+{
+    termtab_item_t* ip = (termtab_item_t*) item;
+    each_arg_t* ap = (each_arg_t*) arg;
+    ap->fun(ip->key, ip->value, ap->arg);
+}
+
+// call fun(key, value, arg) for all items in no particular order
+void cnif_termtab_each(cnif_termtab_t* tab, cnif_termtab_fun_t fun, void* arg)
+{
+    each_arg_t a;
+
+    a.fun = fun;
+    a.arg = arg;
+    lhash_each(&tab->hash, each_item, &a);
+}
+
+// put all pairs, a later duplicate key replaces the earlier value
+int cnif_termtab_load(cnif_termtab_t* tab, const ERL_NIF_TERM keys[],
+		      const ERL_NIF_TERM values[], size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+	if (!termtab_insert(tab, keys[i], values[i], 1))
+	    return 0;
+    }
+    return 1;
+}
+
+int cnif_termtab_load_map(cnif_termtab_t* tab, ERL_NIF_TERM map)
+{
+    ERL_NIF_TERM* buf;
+    ERL_NIF_UINT n;
+    int r;
+
+    if (!IS_MAP(map))
+	return 0;
+    n = ((flatmap_t*) GET_MAP(map))->size;
+    if ((buf = enif_alloc(2*n*sizeof(ERL_NIF_TERM)+1)) == NULL)
+	return 0;
+    cnif_map_entries(map, buf, buf+n);
+    r = cnif_termtab_load(tab, buf, buf+n, n);
+    enif_free(buf);
+    return r;
+}
+
+// load a property list of {Key,Value} tuples
+int cnif_termtab_load_list(cnif_termtab_t* tab, ERL_NIF_TERM list)
+{
+    while(IS_LIST(list)) {
+	ERL_NIF_TERM* cell = GET_LIST(list);
+	ERL_NIF_TERM* tp;
+
+	if (!IS_TUPLE(cell[0]))
+	    return 0;
+	tp = GET_TUPLE(cell[0]);
+	if (GET_ARITYVAL(tp[0]) != 2)
+	    return 0;
+	if (!termtab_insert(tab, tp[1], tp[2], 1))
+	    return 0;
+	list = cell[1];
+    }
+    return (list == MAKE_NIL);
+}
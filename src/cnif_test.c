@@ -5,11 +5,18 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <memory.h>
+#include <unistd.h>
 
 #include "../include/cnif.h"
+#include "../include/cnif_term.h"
 #include "../include/cnif_io.h"
 #include "../include/cnif_stdio.h"
 #include "../include/cnif_misc.h"
+#include "../include/cnif_sort.h"
+#include "../include/cnif_termtab.h"
+#include "../include/cnif_alloc.h"
+#include "../include/cnif_hash.h"
+#include "../include/cnif_big.h"
 
 #define DBG(...) printf(__VA_ARGS__)
 
@@ -21,7 +28,7 @@ static int term_callback(enif_io_t* p, ERL_NIF_TERM term)
     return 1;
 }
 
-#define ARRAY_SIZE 10
+#define ARRAY_SIZE 11
 #define MAP_SIZE   10
 
 void print_element(ErlNifEnv* env, int i, ERL_NIF_TERM value, void* arg)
@@ -31,6 +38,131 @@ void print_element(ErlNifEnv* env, int i, ERL_NIF_TERM value, void* arg)
     enif_io_putc(iop, '\n');
 }
 
+static void count_item(ERL_NIF_TERM key, ERL_NIF_TERM value, void* arg)
+{
+    (*(size_t*) arg)++;
+}
+
+// add integer terms to the long in the io user data
+static int sum_callback(enif_io_t* p, ERL_NIF_TERM term)
+{
+    long v;
+    if (enif_get_long(p->env, term, &v))
+	*(long*) p->data += v;
+    return 1;
+}
+
+// sum the first term and stop the scan
+static int first_callback(enif_io_t* p, ERL_NIF_TERM term)
+{
+    sum_callback(p, term);
+    return -1;
+}
+
+// keep the terms in the term array in the io user data
+typedef struct {
+    size_t n;
+    ERL_NIF_TERM t[8];
+} keep_t;
+
+static int keep_callback(enif_io_t* p, ERL_NIF_TERM term)
+{
+    keep_t* kp = (keep_t*) p->data;
+    if (kp->n < 8)
+	kp->t[kp->n++] = term;
+    return 1;
+}
+
+// malloc counting allocations in arg
+static void* count_alloc(void* arg, size_t size)
+{
+    ((size_t*) arg)[0]++;
+    return malloc(size);
+}
+
+static void* count_realloc(void* arg, void* ptr, size_t size)
+{
+    return realloc(ptr, size);
+}
+
+static void count_free(void* arg, void* ptr)
+{
+    if (ptr != NULL)
+	((size_t*) arg)[1]++;
+    free(ptr);
+}
+
+// path is mapped into the process
+static int is_mapped(const char* path)
+{
+    FILE* f = fopen("/proc/self/maps", "r");
+    char line[512];
+    int found = 0;
+
+    if (f == NULL)
+	return 0;
+    while(!found && fgets(line, sizeof(line), f))
+	found = (strstr(line, path) != NULL);
+    fclose(f);
+    return found;
+}
+
+static int failures = 0;
+
+// print the outcome of a check, failures set the exit status
+static void report(int ok, const char* name)
+{
+    if (ok)
+	printf("%s ok\n", name);
+    else {
+	fprintf(stderr, "%s FAILED\n", name);
+	failures++;
+    }
+}
+
+// malloc failing once the allocation budget in arg is spent
+static void* budget_alloc(void* arg, size_t size)
+{
+    if (*(size_t*) arg == 0)
+	return NULL;
+    (*(size_t*) arg)--;
+    return malloc(size);
+}
+
+static void* budget_realloc(void* arg, void* ptr, size_t size)
+{
+    if (*(size_t*) arg == 0)
+	return NULL;
+    (*(size_t*) arg)--;
+    return realloc(ptr, size);
+}
+
+static void budget_free(void* arg, void* ptr)
+{
+    free(ptr);
+}
+
+// keys sorted, payload is the original index of its key,
+// with stable set equal keys keep their original order
+static int check_sort(ERL_NIF_TERM* orig, ERL_NIF_TERM* keys,
+		      ERL_NIF_TERM* pos, size_t n, int stable)
+{
+    size_t k;
+    int j0 = -1, j;
+
+    for (k = 0; k < n; k++) {
+	if (!enif_get_int(NULL, pos[k], &j) || (orig[j] != keys[k]))
+	    return 0;
+	if (k > 0) {
+	    int c = enif_compare(keys[k-1], keys[k]);
+	    if ((c > 0) || (stable && (c == 0) && (j0 > j)))
+		return 0;
+	}
+	j0 = j;
+    }
+    return 1;
+}
+
 int main(int argc, char** argv) 
 {
     ErlNifEnv* env = enif_alloc_env();
@@ -159,6 +291,69 @@ int main(int argc, char** argv)
 	}
     }
 
+    // small integer bounds, strings and iolist walkers
+    {
+	ErlNifSInt64 bound[4] = { MAX_SMALL, MAX_SMALL+1,
+				  MIN_SMALL, MIN_SMALL-1 };
+	ErlNifSInt64 iv;
+	ErlNifBinary b;
+	char buf[8];
+	unsigned len;
+	size_t size;
+	int ok = 1;
+
+	for (i = 0; i < 4; i++) {
+	    t = enif_make_int64(env, bound[i]);
+	    if ((enif_is_big(env, t) != (i & 1)) ||
+		!enif_get_int64(env, t, &iv) || (iv != bound[i]))
+		ok = 0;
+	}
+	// the buffer must leave room for the terminating NUL
+	t = enif_make_string(env, "abc", ERL_NIF_LATIN1);
+	if ((enif_get_string(env, t, buf, 3, ERL_NIF_LATIN1) != 0) ||
+	    (enif_get_string(env, t, buf, 4, ERL_NIF_LATIN1) != 3) ||
+	    (strcmp(buf, "abc") != 0))
+	    ok = 0;
+	if (!enif_get_string_length(env, t, &len, ERL_NIF_LATIN1) || (len != 3))
+	    ok = 0;
+	v = enif_make_list(env, 2, enif_make_int(env, 'a'),
+			   enif_make_int(env, 300));
+	w = enif_make_list(env, 2, enif_make_int(env, 'a'),
+			   enif_make_atom(env, "b"));
+	if (enif_get_string(env, v, buf, sizeof(buf), ERL_NIF_LATIN1) ||
+	    enif_get_string(env, w, buf, sizeof(buf), ERL_NIF_LATIN1) ||
+	    enif_get_string_length(env, v, &len, ERL_NIF_LATIN1) ||
+	    enif_get_string_length(env, w, &len, ERL_NIF_LATIN1))
+	    ok = 0;
+	// [<<"ab">>, "c" | <<"de">>]
+	memcpy(enif_make_new_binary(env, 2, &v), "ab", 2);
+	memcpy(enif_make_new_binary(env, 2, &w), "de", 2);
+	t = enif_make_list_cell(env, enif_make_string(env, "c", ERL_NIF_LATIN1),
+				w);
+	t = enif_make_list_cell(env, v, t);
+	if (!enif_iolist_size(env, t, &size) || (size != 5) ||
+	    !enif_inspect_iolist_as_binary(env, t, &b))
+	    ok = 0;
+	else {
+	    if ((b.size != 5) || (memcmp(b.data, "abcde", 5) != 0))
+		ok = 0;
+	    enif_release_binary(&b);
+	}
+	// far deeper than the C stack would allow with recursion
+	t = enif_make_string(env, "x", ERL_NIF_LATIN1);
+	for (i = 0; i < 1000000; i++)
+	    t = enif_make_list_cell(env, t, enif_make_list(env, 0));
+	if (!enif_iolist_size(env, t, &size) || (size != 1) ||
+	    !enif_inspect_iolist_as_binary(env, t, &b))
+	    ok = 0;
+	else {
+	    if ((b.size != 1) || (b.data[0] != 'x'))
+		ok = 0;
+	    enif_release_binary(&b);
+	}
+	report(ok, "string and iolist");
+    }
+
     // create term and copy-recurive/flat/struct
     {
 	ERL_NIF_TERM t_copy;
@@ -186,12 +381,1183 @@ int main(int argc, char** argv)
 	printf("size of t_flat = %lu\n", enif_flat_size(t_flat));
 	enif_io_write(iop, t_flat); printf("\n");
 	printf("size of t_struct = %lu\n", enif_flat_size(t_struct));
+	printf("shared size of t_struct = %lu\n", enif_struct_size(t_struct));
 	enif_io_write(iop, t_struct); printf("\n");
 
 	printf("original t again\n");
 	enif_io_write(iop, t); printf("\n");
     }
 
+    // bulk list build and extract
+    {
+	ErlNifSInt64 ivec[4] = { 1, -2, INT64_C(0x7fffffffffffffff),
+				 -INT64_C(0x7fffffffffffffff) };
+	double dvec[3] = { 1.5, -2.25, 1e100 };
+	uint8_t bvec[5] = { 'h', 'e', 'l', 'l', 'o' };
+	ErlNifSInt64 ivec2[4];
+	double dvec2[3];
+	uint8_t bvec2[5];
+	unsigned n;
+
+	t = enif_make_list_from_int64_array(env, ivec, 4);
+	enif_io_write(iop, t); printf("\n");
+	report(enif_get_int64_array(env, t, ivec2, 4, &n) && (n == 4) &&
+	       (memcmp(ivec, ivec2, sizeof(ivec)) == 0), "int64 array");
+	t = enif_make_list_from_double_array(env, dvec, 3);
+	enif_io_write(iop, t); printf("\n");
+	report(enif_get_double_array(env, t, dvec2, 3, &n) && (n == 3) &&
+	       (memcmp(dvec, dvec2, sizeof(dvec)) == 0), "double array");
+	t = enif_make_list_from_uint8_array(env, bvec, 5);
+	enif_io_write(iop, t); printf("\n");
+	report(enif_get_uint8_array(env, t, bvec2, 5, &n) && (n == 5) &&
+	       (memcmp(bvec, bvec2, sizeof(bvec)) == 0), "uint8 array");
+	// an element above 255 does not fit a byte
+	t = enif_make_list(env, 2, enif_make_int(env, 'a'),
+			   enif_make_int(env, 256));
+	report(!enif_get_uint8_array(env, t, bvec2, 5, &n), "uint8 range");
+    }
+
+    // compact list view
+    {
+	ErlNifListView view;
+	ERL_NIF_TERM c;
+
+	t = enif_make_list(env, 3, arr[0], arr[1], arr[2]);
+	report(enif_get_list_view(env, t, &view) && (view.size == 3) &&
+	       (view.elem[2*view.stride] == arr[2]), "list view");
+	// a term allocated in between separates the new cell from t
+	c = enif_make_tuple(env, 1, arr[0]);
+	t = enif_make_list_cell(env, c, t);
+	report(!enif_get_list_view(env, t, &view) &&
+	       enif_make_compact_list(env, t, &c) &&
+	       enif_get_list_view(env, c, &view) && (view.size == 4) &&
+	       (enif_compare(t, c) == 0), "compact list");
+    }
+
+    // large maps are hashmaps
+    {
+	ERL_NIF_TERM keys[1000];
+	ERL_NIF_TERM vals[1000];
+	ERL_NIF_TERM m1, m2, m3;
+	size_t size;
+	int ok = 1;
+
+	m1 = enif_make_new_map(env);
+	for (i = 0; i < 1000; i++) {
+	    keys[i] = (i & 1) ? enif_make_int(env, i) :
+		enif_make_tuple(env, 2, enif_make_atom(env, "k"),
+				enif_make_int(env, i));
+	    vals[i] = enif_make_int(env, 2*i);
+	    enif_make_map_put(env, m1, keys[i], vals[i], &m1);
+	}
+	m2 = enif_make_map_from_arrays(env, keys, vals, 1000);
+	enif_get_map_size(env, m1, &size);
+	ok = ok && (size == 1000) && (enif_compare(m1, m2) == 0);
+	for (i = 0; ok && (i < 1000); i++)
+	    ok = enif_get_map_value(env, m1, keys[i], &v) && (v == vals[i]);
+	// keys match exact, an integral float is not the integer key
+	ok = ok && !enif_get_map_value(env, m1, enif_make_double(env, 7.0), &v);
+	ok = ok && !enif_make_map_update(env, m1, enif_make_int(env, -1),
+					  vals[0], &m3);
+	m3 = enif_make_copy(env, m1);
+	ok = ok && (enif_compare(m1, m3) == 0);
+	for (i = 0; ok && (i < 990); i++)
+	    ok = enif_make_map_remove(env, m3, keys[i], &m3);
+	enif_get_map_size(env, m3, &size);
+	ok = ok && (size == 10) && (enif_compare(m1, m3) > 0);
+	report(ok, "hashmap");
+	if (ok) {
+	    enif_io_write(iop, m3); printf("\n");
+	}
+
+	// bulk operations agree with per key put and remove
+	m2 = enif_make_new_map(env);
+	enif_make_map_put_many(env, m2, keys, vals, 20, &m2);
+	enif_make_map_put_many(env, m2, keys+20, vals+20, 980, &m2);
+	ok = (enif_compare(m1, m2) == 0);
+	m2 = enif_make_map_from_arrays(env, keys, vals, 500);
+	m3 = enif_make_map_from_arrays(env, keys+500, vals+500, 500);
+	enif_make_map_merge(env, m2, m3, &m2);
+	ok = ok && (enif_compare(m1, m2) == 0);
+	enif_make_map_remove_many(env, m2, keys, 995, &m2);
+	enif_make_map_remove_many(env, m2, keys+995, 2, &m2);
+	enif_get_map_size(env, m2, &size);
+	ok = ok && (size == 3);
+	// last duplicate wins
+	vals[999] = enif_make_atom(env, "last");
+	keys[999] = keys[0];
+	m2 = enif_make_map_from_arrays(env, keys, vals, 1000);
+	ok = ok && enif_get_map_value(env, m2, keys[0], &v) && (v == vals[999]);
+	enif_make_map_put_many(env, m3, keys, vals, 1000, &m2);
+	ok = ok && enif_get_map_value(env, m2, keys[0], &v) && (v == vals[999]);
+	report(ok, "map bulk");
+    }
+
+    // map index shared by maps with the same keys tuple
+    {
+	ErlNifMapIndex* index;
+	ERL_NIF_TERM m1, m2, v2;
+	int ok = 1;
+
+	for (i = 0; i < MAP_SIZE; i++) {
+	    char name[16];
+	    snprintf(name, sizeof(name), "f%u", i);
+	    key[i] = enif_make_atom(env, name);
+	    value[i] = enif_make_int(env, i);
+	}
+	m1 = enif_make_map_from_arrays(env, key, value, MAP_SIZE);
+	enif_make_map_update(env, m1, key[3], enif_make_atom(env, "x"), &m2);
+	index = enif_map_index_create(env, m1);
+	for (i = 0; ok && (i < MAP_SIZE); i++)
+	    ok = enif_get_map_value_indexed(env, index, m2, key[i], &v) &&
+		enif_get_map_value(env, m2, key[i], &v2) && (v == v2);
+	ok = ok && !enif_get_map_value_indexed(env, index, m2,
+					       enif_make_atom(env, "f99"), &v);
+	// other keys tuple falls back to a normal lookup
+	m2 = enif_make_map_from_arrays(env, key, value, 2);
+	ok = ok && enif_get_map_value_indexed(env, index, m2, key[1], &v) &&
+	    (v == value[1]);
+	enif_map_index_destroy(index);
+	// a stale index, another keys tuple may land at the indexed address
+	{
+	    ErlNifEnv* e = enif_alloc_env();
+	    m1 = enif_make_map_from_arrays(e, key, value, MAP_SIZE);
+	    index = enif_map_index_create(e, m1);
+	    enif_clear_env(e);
+	    v2 = key[0];
+	    key[0] = enif_make_atom(e, "g0");
+	    m2 = enif_make_map_from_arrays(e, key, value, MAP_SIZE);
+	    key[0] = v2;
+	    ok = ok && !enif_get_map_value_indexed(e, index, m2, key[0], &v);
+	    ok = ok && enif_get_map_value_indexed(e, index, m2, key[1], &v) &&
+		(v == value[1]);
+	    enif_map_index_destroy(index);
+	    enif_free_env(e);
+	}
+	report(ok, "map index");
+    }
+
+    // maps with the same immediate keys share one keys tuple
+    {
+	ERL_NIF_TERM m1, m2;
+	int ok = 1;
+
+	ok = ok && (cnif_intern_keys(env, key, 4) ==
+		    cnif_intern_keys(env, key, 4));
+	ok = ok && (cnif_intern_keys(env, key, 4) !=
+		    cnif_intern_keys(env, key, 3));
+	m1 = enif_make_map_from_arrays(env, key, value, 4);
+	m2 = enif_make_new_map(env);
+	for (i = 4; i > 0; i--)
+	    enif_make_map_put(env, m2, key[i-1], value[i-1], &m2);
+	ok = ok && enif_is_identical(m1, m2);
+	enif_make_map_update(env, m2, key[2], enif_make_int(env, 100), &m2);
+	ok = ok && (enif_compare(m1, m2) < 0) && (enif_compare(m2, m1) > 0);
+	enif_make_map_remove(env, m2, key[3], &m2);
+	ok = ok && (enif_compare(m1, m2) > 0);
+	report(ok, "map shape");
+    }
+
+    // map order: size, keys in map key order, then values
+    {
+	ERL_NIF_TERM k[3], v[3];
+	ERL_NIF_TERM m1, m2, m3;
+	size_t size;
+	int ok = 1;
+
+	k[0] = enif_make_int(env, 1);
+	k[1] = enif_make_double(env, 1.0);
+	v[0] = v[1] = enif_make_atom(env, "a");
+	m1 = enif_make_map_from_arrays(env, k, v, 1);
+	m2 = enif_make_map_from_arrays(env, k+1, v+1, 1);
+	ok = ok && (enif_compare(m1, m2) < 0) && !enif_is_identical(m1, m2);
+	m3 = enif_make_map_from_arrays(env, k, v, 2);
+	ok = ok && enif_get_map_size(env, m3, &size) && (size == 2);
+	// integer keys come before float keys
+	k[0] = enif_make_int(env, 3);
+	k[1] = enif_make_double(env, 2.0);
+	m1 = enif_make_map_from_arrays(env, k, v, 1);
+	m2 = enif_make_map_from_arrays(env, k+1, v+1, 1);
+	ok = ok && (enif_compare(m1, m2) < 0) && (enif_compare(m2, m1) > 0);
+	// values compare with ==
+	v[2] = enif_make_int(env, 7);
+	m1 = enif_make_map_from_arrays(env, v, v+2, 1);
+	v[2] = enif_make_double(env, 7.0);
+	m2 = enif_make_map_from_arrays(env, v, v+2, 1);
+	ok = ok && (enif_compare(m1, m2) == 0) && !enif_is_identical(m1, m2);
+	// large maps built in different order
+	{
+	    ERL_NIF_TERM hk[100], hv[100], rk[100];
+	    for (i = 0; i < 100; i++) {
+		hk[i] = enif_make_int(env, i);
+		hv[i] = enif_make_int(env, 2*i);
+		rk[99-i] = hk[i];
+	    }
+	    m1 = enif_make_map_from_arrays(env, hk, hv, 100);
+	    for (i = 0; i < 100; i++)
+		hv[i] = enif_make_int(env, 2*(99-i));
+	    m2 = enif_make_map_from_arrays(env, rk, hv, 100);
+	    ok = ok && enif_is_identical(m1, m2);
+	    enif_make_map_update(env, m2, hk[50], hk[0], &m2);
+	    ok = ok && (enif_compare(m1, m2) > 0);
+	}
+	report(ok, "map compare");
+    }
+
+    // term order and deep terms
+    {
+	ERL_NIF_TERM a, b, c;
+	ERL_NIF_TERM nil = enif_make_list(env, 0);
+	int ok = 1;
+
+	a = enif_make_atom(env, "ab");
+	b = enif_make_atom(env, "abc");
+	c = enif_make_atom(env, "b");
+	ok = ok && (enif_compare(a, b) < 0) && (enif_compare(b, c) < 0);
+	memcpy(enif_make_new_binary(env, 3, &a), "abc", 3);
+	memcpy(enif_make_new_binary(env, 4, &b), "abc\xff", 4);
+	ok = ok && (enif_compare(a, b) < 0) && (enif_compare(b, a) > 0);
+	a = enif_make_int64(env, INT64_C(1) << 40);
+	b = enif_make_int64(env, -(INT64_C(1) << 40));
+	ok = ok && (enif_compare(b, a) < 0) && (enif_compare(a, b) > 0);
+	// [1|2] < [1,2] since the tail 2 is a number
+	a = enif_make_list_cell(env, enif_make_int(env, 1), enif_make_int(env, 2));
+	b = enif_make_list2(env, enif_make_int(env, 1), enif_make_int(env, 2));
+	ok = ok && (enif_compare(a, b) < 0) && (enif_compare(b, a) > 0);
+	a = enif_make_tuple2(env, b, enif_make_int(env, 1));
+	c = enif_make_tuple2(env, b, enif_make_double(env, 1.0));
+	ok = ok && (enif_compare(a, c) == 0) && !enif_is_identical(a, c);
+	// deeply nested heads and tuples
+	a = b = nil;
+	for (i = 0; i < 1000000; i++) {
+	    a = enif_make_list_cell(env, enif_make_tuple1(env, a), nil);
+	    b = enif_make_list_cell(env, enif_make_tuple1(env, b), nil);
+	}
+	ok = ok && enif_is_identical(a, b);
+	c = enif_make_list_cell(env, enif_make_tuple1(env, a), nil);
+	ok = ok && (enif_compare(b, c) < 0);
+	report(ok, "compare");
+    }
+
+    // term hashing, phash2 values from erlang:phash2/2 with range 1 bsl 32
+    {
+	ErlNifUInt64 mask = (1 << 27) - 1;
+	ERL_NIF_TERM m1, m2;
+	ERL_NIF_TERM hk[40], hv[40];
+	int ok = 1;
+
+	ok = ok && (enif_hash(ERL_NIF_PHASH2, enif_make_int(env, 0), 0) ==
+		    (3175731469U & mask));
+	ok = ok && (enif_hash(ERL_NIF_PHASH2, enif_make_int(env, -1), 0) ==
+		    (1117813597U & mask));
+	ok = ok && (enif_hash(ERL_NIF_PHASH2, enif_make_int(env, 1<<20), 0) ==
+		    (1477815345U & mask));
+	ok = ok && (enif_hash(ERL_NIF_PHASH2, enif_make_list(env, 0), 0) ==
+		    (3468870702U & mask));
+	{
+	    static const char* forms =
+		"a. {a,b,[]}. \"abcde\". <<\"hello world!!\">>. 1.5. "
+		"1099511627776. #{a => 1, b => []}.";
+	    static const uint32_t phash2[7] = {
+		97U, 1527448637U, 695338535U, 2552201628U, 2023646235U,
+		282329375U, 3494777846U };
+	    ErlNifBignum big;
+	    keep_t keep;
+	    unsigned j;
+
+	    keep.n = 0;
+	    ok = ok && enif_io_parse_buffer(env, forms, strlen(forms),
+					    keep_callback, &keep) &&
+		(keep.n == 7);
+	    for (j = 0; ok && (j < keep.n); j++)
+		ok = (cnif_phash2(keep.t[j]) == phash2[j]);
+	    // -(1 bsl 70)
+	    big.size = 2;
+	    big.sign = 1;
+	    big.asize = 0;
+	    big.digits = big.ds;
+	    big.ds[0] = 0;
+	    big.ds[1] = 64;
+	    ok = ok && (cnif_phash2(enif_make_number(env, &big)) == 4181281985U);
+	}
+	// maps hash the same whatever the representation and build order
+	for (i = 0; i < 40; i++) {
+	    hk[i] = enif_make_int(env, i);
+	    hv[i] = enif_make_tuple1(env, enif_make_int(env, i));
+	}
+	m1 = enif_make_map_from_arrays(env, hk, hv, 40);
+	m2 = enif_make_new_map(env);
+	for (i = 40; i > 0; i--)
+	    enif_make_map_put(env, m2, hk[i-1], hv[i-1], &m2);
+	ok = ok && (enif_hash(ERL_NIF_PHASH2, m1, 0) ==
+		    enif_hash(ERL_NIF_PHASH2, m2, 0));
+	ok = ok && (enif_hash(ERL_NIF_INTERNAL_HASH, m1, 17) ==
+		    enif_hash(ERL_NIF_INTERNAL_HASH, m2, 17));
+	ok = ok && (enif_hash(ERL_NIF_INTERNAL_HASH, m1, 17) !=
+		    enif_hash(ERL_NIF_INTERNAL_HASH, m1, 18));
+	report(ok, "hash");
+    }
+
+    // term table, keys and values outlive the env they came from
+    {
+	ErlNifEnv* env2 = enif_alloc_env();
+	cnif_termtab_t* tab = cnif_termtab_new();
+	ERL_NIF_TERM k[3], map;
+	size_t count = 0;
+	int ok = 1;
+
+	k[0] = enif_make_tuple2(env2, enif_make_atom(env2, "k"),
+				enif_make_int(env2, 1));
+	k[1] = enif_make_int(env2, 1);
+	k[2] = enif_make_double(env2, 1.0);
+	ok = ok && cnif_termtab_put(tab, k[0], enif_make_string(env2, "one",
+								ERL_NIF_LATIN1));
+	ok = ok && cnif_termtab_put(tab, k[1], k[0]);
+	ok = ok && !cnif_termtab_put_new(tab, k[1], k[2]);
+	ok = ok && cnif_termtab_put_new(tab, k[2], k[2]);
+	map = enif_make_map_from_arrays(env2, k, k, 2);
+	ok = ok && cnif_termtab_put(tab, map, map);
+	enif_free_env(env2);
+
+	k[0] = enif_make_tuple2(env, enif_make_atom(env, "k"),
+				enif_make_int(env, 1));
+	k[1] = enif_make_int(env, 1);
+	k[2] = enif_make_double(env, 1.0);
+	ok = ok && (cnif_termtab_size(tab) == 4);
+	ok = ok && cnif_termtab_get(tab, k[1], &v) && enif_is_identical(v, k[0]);
+	ok = ok && cnif_termtab_get(tab, k[2], &v) && enif_is_identical(v, k[2]);
+	ok = ok && cnif_termtab_erase(tab, k[0]) && !cnif_termtab_erase(tab, k[0]);
+	ok = ok && !cnif_termtab_get(tab, k[0], &v);
+	cnif_termtab_each(tab, count_item, &count);
+	ok = ok && (count == 3);
+	// bulk load from a map and a property list, last value wins
+	map = enif_make_map_from_arrays(env, k, k, 3);
+	ok = ok && cnif_termtab_load_map(tab, map);
+	ok = ok && cnif_termtab_load_list(tab,
+		      enif_make_list2(env, enif_make_tuple2(env, k[1], k[1]),
+				      enif_make_tuple2(env, k[1], k[2])));
+	ok = ok && cnif_termtab_get(tab, k[1], &v) && enif_is_identical(v, k[2]);
+	ok = ok && (cnif_termtab_size(tab) == 4);
+	cnif_termtab_free(tab);
+
+	// updates and erases do not grow the table env without bound
+	{
+	    cnif_heap_stats_t s;
+	    const ERL_NIF_TERM* tp;
+	    ERL_NIF_TERM val;
+	    size_t peak = 0;
+	    int j;
+
+	    tab = cnif_termtab_new();
+	    for (i = 0; i < 20000; i++) {
+		val = enif_make_tuple2(env, enif_make_int(env, i),
+				       enif_make_string(env, "value",
+							ERL_NIF_LATIN1));
+		ok = ok && cnif_termtab_put(tab, enif_make_int(env, i % 100),
+					    val);
+		if (((i % 7) == 0) && (i < 19900))
+		    cnif_termtab_erase(tab, enif_make_int(env, (i+50) % 100));
+		cnif_heap_stats(cnif_termtab_env(tab), &s);
+		if (s.used > peak)
+		    peak = s.used;
+	    }
+	    ok = ok && (peak < 20000);
+	    for (i = 19900; i < 20000; i++) {
+		ok = ok && cnif_termtab_get(tab, enif_make_int(env, i % 100),
+					    &v) &&
+		    enif_get_tuple(env, v, &j, &tp) && enif_get_int(env, tp[0], &j) &&
+		    (j == i);
+	    }
+	    // a failed copy is reported and leaves the table as it was
+	    cnif_heap_stats(cnif_termtab_env(tab), &s);
+	    cnif_heap_set_limit(cnif_termtab_env(tab), s.size);
+	    val = enif_make_list(env, 0);
+	    for (i = 0; i < 10000; i++)
+		val = enif_make_list_cell(env, enif_make_int(env, i), val);
+	    ok = ok && !cnif_termtab_put(tab, enif_make_atom(env, "big"), val);
+	    ok = ok && !cnif_termtab_get(tab, enif_make_atom(env, "big"), &v);
+	    ok = ok && !cnif_termtab_load(tab, &val, &val, 1);
+	    ok = ok && (cnif_termtab_size(tab) == 100);
+	    cnif_termtab_free(tab);
+	}
+	report(ok, "termtab");
+    }
+
+    // sorting, random, sorted, reversed, organ pipe and duplicate keys
+    {
+	size_t n = 5000;
+	ERL_NIF_TERM* orig = enif_alloc(3*n*sizeof(ERL_NIF_TERM));
+	ERL_NIF_TERM* keys = orig + n;
+	ERL_NIF_TERM* pos = orig + 2*n;
+	unsigned long r = 12345;
+	int kind, ok = 1;
+	size_t k;
+
+	for (kind = 0; kind < 6; kind++) {
+	    for (k = 0; k < n; k++) {
+		long x;
+		r = r*6364136223846793005UL + 1442695040888963407UL;
+		switch(kind) {
+		case 0: x = (long)(r >> 33); break;
+		case 1: x = k; break;
+		case 2: x = n-k; break;
+		case 3: x = (k < n/2) ? k : n-k; break;
+		case 4: x = (r >> 33) % 4; break;
+		default: x = 7; break;
+		}
+		// mix in floats that compare equal to integers
+		orig[k] = (k & 1) ? enif_make_double(env, (double) x) :
+		    enif_make_long(env, x);
+	    }
+	    memcpy(keys, orig, n*sizeof(ERL_NIF_TERM));
+	    for (k = 0; k < n; k++) pos[k] = enif_make_int(env, k);
+	    cnif_pdq_sort_aux(keys, pos, n, enif_compare);
+	    ok = ok && check_sort(orig, keys, pos, n, 0);
+
+	    memcpy(keys, orig, n*sizeof(ERL_NIF_TERM));
+	    for (k = 0; k < n; k++) pos[k] = enif_make_int(env, k);
+	    cnif_merge_sort_aux(keys, pos, n, enif_compare);
+	    ok = ok && check_sort(orig, keys, pos, n, 1);
+
+	    memcpy(keys, orig, n*sizeof(ERL_NIF_TERM));
+	    cnif_quick_sort(orig, keys, 0, n-1);
+	    ok = ok && cnif_is_sorted(keys, n);
+	    k = cnif_pdq_usort_aux(keys, NULL, n, enif_compare);
+	    ok = ok && cnif_is_usorted(keys, k);
+	}
+	// one kind of term, sorted by the radix kernels
+	for (kind = 0; kind < 4; kind++) {
+	    static char* names[] = { "a", "b", "ab", "abc", "z", "" };
+	    for (k = 0; k < n; k++) {
+		unsigned char data[12];
+		long x;
+		r = r*6364136223846793005UL + 1442695040888963407UL;
+		x = (long)(r >> 40) - (1L << 23);
+		switch(kind) {
+		case 0:
+		    orig[k] = enif_make_long(env, (k & 1) ? x : x % 100);
+		    break;
+		case 1:
+		    orig[k] = enif_make_double(env, (k % 7) ? x/3.0 : -0.0);
+		    break;
+		case 2:
+		    orig[k] = enif_make_atom(env, names[x % 6 + (x < 0)*5]);
+		    break;
+		default:
+		    // long shared prefixes and short zero padded ones
+		    memset(data, 0, sizeof(data));
+		    data[x & 7] = (r >> 8) & 3;
+		    data[8 + (x & 3)] = (r >> 16) & 3;
+		    memcpy(enif_make_new_binary(env, (r >> 24) % 13, &orig[k]),
+			   data, (r >> 24) % 13);
+		    break;
+		}
+	    }
+	    memcpy(keys, orig, n*sizeof(ERL_NIF_TERM));
+	    for (k = 0; k < n; k++) pos[k] = enif_make_int(env, k);
+	    cnif_pdq_sort_aux(keys, pos, n, enif_compare);
+	    ok = ok && check_sort(orig, keys, pos, n, 0);
+
+	    memcpy(keys, orig, n*sizeof(ERL_NIF_TERM));
+	    for (k = 0; k < n; k++) pos[k] = enif_make_int(env, k);
+	    cnif_merge_sort_aux(keys, pos, n, enif_compare);
+	    ok = ok && check_sort(orig, keys, pos, n, 1);
+	}
+	enif_free(orig);
+
+	// large enough to be split on the top digit first
+	n = 100000;
+	orig = enif_alloc(3*n*sizeof(ERL_NIF_TERM));
+	keys = orig + n;
+	pos = orig + 2*n;
+	for (k = 0; k < n; k++) {
+	    r = r*6364136223846793005UL + 1442695040888963407UL;
+	    orig[k] = enif_make_long(env, (long)(r >> 8) >> (k & 31));
+	    keys[k] = orig[k];
+	    pos[k] = enif_make_int(env, k);
+	}
+	cnif_merge_sort_aux(keys, pos, n, enif_compare);
+	ok = ok && check_sort(orig, keys, pos, n, 1);
+	memcpy(keys, orig, n*sizeof(ERL_NIF_TERM));
+	cnif_pdq_sort_aux(keys, NULL, n, enif_compare);
+	ok = ok && cnif_is_sorted(keys, n);
+
+	// parallel sort of integers and floats that compare equal
+	for (kind = 1; kind <= 7; kind += 2) {
+	    for (k = 0; k < n; k++) {
+		long x;
+		r = r*6364136223846793005UL + 1442695040888963407UL;
+		x = (r >> 33) % 1000;
+		orig[k] = (k & 1) ? enif_make_double(env, (double) x) :
+		    enif_make_long(env, x);
+		keys[k] = orig[k];
+		pos[k] = enif_make_int(env, k);
+	    }
+	    cnif_parallel_sort_aux(keys, pos, n, enif_compare, kind);
+	    ok = ok && check_sort(orig, keys, pos, n, 1);
+	    memcpy(keys, orig, n*sizeof(ERL_NIF_TERM));
+	    k = cnif_parallel_usort_aux(keys, NULL, n, enif_compare, kind);
+	    ok = ok && (k == 1000) && cnif_is_usorted(keys, k);
+	}
+	// without scratch memory the merge sort stays stable, in place
+	{
+	    size_t budget = 0;
+	    cnif_allocator_t failing =
+		{ budget_alloc, budget_realloc, budget_free, &budget };
+	    ERL_NIF_TERM l;
+
+	    for (k = 0; k < n; k++) {
+		keys[k] = orig[k];
+		pos[k] = enif_make_int(env, k);
+	    }
+	    l = enif_make_list_from_array(env, orig, 1000);
+	    cnif_set_allocator(&failing);
+	    cnif_merge_sort_aux(keys, pos, n, enif_compare);
+	    ok = ok && !enif_make_sorted_list(env, l, 0, &t);
+	    cnif_set_allocator(NULL);
+	    ok = ok && check_sort(orig, keys, pos, n, 1);
+	    for (k = 0; k < n; k++) {
+		keys[k] = orig[k];
+		pos[k] = enif_make_int(env, k);
+	    }
+	    cnif_set_allocator(&failing);
+	    cnif_parallel_sort_aux(keys, pos, n, enif_compare, 4);
+	    cnif_set_allocator(NULL);
+	    ok = ok && check_sort(orig, keys, pos, n, 1);
+	    // the radix kernels give up at each allocation in turn
+	    for (kind = 0; kind < 2; kind++) {
+		static char* names[] = { "c", "a", "b" };
+		for (k = 0; k < 1000; k++)
+		    orig[k] = kind ? enif_make_atom(env, names[(k*7) % 3]) :
+			enif_make_int(env, (k*7) % 300);
+		for (budget = 0; budget < 4; budget++) {
+		    size_t b = budget;
+		    for (k = 0; k < 1000; k++) {
+			keys[k] = orig[k];
+			pos[k] = enif_make_int(env, k);
+		    }
+		    cnif_set_allocator(&failing);
+		    cnif_merge_sort_aux(keys, pos, 1000, enif_compare);
+		    cnif_set_allocator(NULL);
+		    ok = ok && check_sort(orig, keys, pos, 1000, 1);
+		    budget = b;
+		}
+	    }
+	}
+	enif_free(orig);
+	report(ok, "sort");
+    }
+
+    // flat copy of all term types, and of deep and wide terms
+    {
+	ErlNifEnv* env2 = enif_alloc_env();
+	ERL_NIF_TERM b, sb, m, c, deep, e[8];
+	ErlNifBinary bin;
+	int ok = 1;
+
+	memcpy(enif_make_new_binary(env, 16, &b), "0123456789abcdef", 16);
+	sb = enif_make_sub_binary(env, b, 4, 8);
+	ok = ok && enif_inspect_binary(env, sb, &bin) && (bin.size == 8) &&
+	    (memcmp(bin.data, "456789ab", 8) == 0);
+	sb = enif_make_sub_binary(env, sb, 1, 3);
+	ok = ok && enif_inspect_binary(env, sb, &bin) && (bin.size == 3) &&
+	    (memcmp(bin.data, "567", 3) == 0);
+	ok = ok && !enif_make_sub_binary(env, sb, 1, 3);
+	for (i = 0; i < MAP_SIZE; i++) {
+	    key[i] = enif_make_int(env, i);
+	    value[i] = enif_make_double(env, i/2.0);
+	}
+	m = enif_make_map_from_arrays(env, key, value, MAP_SIZE);
+	for (i = 0; i < 40; i++)
+	    enif_make_map_put(env, m, enif_make_int(env, 100+i), sb, &m);
+	e[0] = sb;
+	e[1] = b;
+	e[2] = m;
+	e[3] = enif_make_map_from_arrays(env, key, value, 5);
+	e[4] = enif_make_int64(env, INT64_C(0x7fffffffffffffff));
+	e[5] = enif_make_double(env, 3.25);
+	e[6] = enif_make_string(env, "abc", ERL_NIF_LATIN1);
+	e[7] = enif_make_tuple2(env, e[0], e[4]);
+	t = enif_make_list_from_array(env, e, 8);
+	c = enif_make_flat_copy(env2, t);
+	ok = ok && c && enif_is_identical(c, t);
+	ok = ok && (enif_flat_size(c) == enif_flat_size(t));
+	ok = ok && enif_get_list_cell(env2, c, &sb, &c) &&
+	    enif_inspect_binary(env2, sb, &bin) && (bin.size == 3) &&
+	    (memcmp(bin.data, "567", 3) == 0);
+
+	// a million levels deep, [[[...]]] and {{{...}}}
+	deep = enif_make_list(env, 0);
+	for (i = 0; i < 1000000; i++)
+	    deep = (i & 1) ? enif_make_list1(env, deep) :
+		enif_make_tuple2(env, deep, key[i % MAP_SIZE]);
+	ok = ok && (enif_flat_size(deep) == 1000000/2*(2+3));
+	c = enif_make_flat_copy(env2, deep);
+	ok = ok && enif_is_identical(c, deep);
+	enif_free_env(env2);
+	report(ok, "flat copy");
+    }
+
+    // struct copy keeps shared sub terms shared and the source intact
+    {
+	ErlNifEnv* env2 = enif_alloc_env();
+	ERL_NIF_TERM d, c, m, e[3];
+	const ERL_NIF_TERM* tp;
+	int arity;
+	int ok = 1;
+
+	// {{..{a,a}..},{..}} 60 levels deep, 2^60 nodes when flattened
+	d = enif_make_tuple1(env, enif_make_atom(env, "a"));
+	for (i = 0; i < 60; i++) {
+	    d = enif_make_tuple2(env, d, d);
+	    if (i == 15) e[0] = d;
+	}
+	ok = ok && (enif_struct_size(d) == 2 + 60*3);
+	c = enif_make_struct_copy(env2, d);
+	ok = ok && (enif_struct_size(c) == 2 + 60*3);
+	ok = ok && enif_get_tuple(env2, c, &arity, &tp) &&
+	    (tp[0] == tp[1]) && (c != d);
+	ok = ok && enif_get_tuple(env, d, &arity, &tp) && (tp[0] == tp[1]);
+	// the visited table can not be set up or can not grow, a list
+	// keeps the work stack within its default size
+	{
+	    size_t budget;
+	    cnif_allocator_t failing =
+		{ budget_alloc, budget_realloc, budget_free, &budget };
+	    ERL_NIF_TERM ivec[100];
+
+	    for (i = 0; i < 100; i++)
+		ivec[i] = enif_make_int(env, i);
+	    c = enif_make_list_from_array(env, ivec, 100);
+	    cnif_set_allocator(&failing);
+	    for (i = 0; i < 2; i++) {
+		budget = i;
+		ok = ok && (enif_struct_size(c) == 0);
+		budget = i;
+		ok = ok && (enif_make_struct_copy(env2, c) == INVALID_TERM);
+	    }
+	    cnif_set_allocator(NULL);
+	    ok = ok && (enif_struct_size(c) == 200);
+	}
+
+	// maps, floats, binaries and a hashmap sharing one list
+	e[1] = enif_make_list3(env, enif_make_double(env, 2.5), e[0],
+			       enif_make_string(env, "abc", ERL_NIF_LATIN1));
+	memcpy(enif_make_new_binary(env, 5, &e[2]), "bytes", 5);
+	for (i = 0; i < MAP_SIZE; i++) {
+	    key[i] = enif_make_int(env, i);
+	    value[i] = (i & 1) ? e[1] : e[2];
+	}
+	m = enif_make_map_from_arrays(env, key, value, MAP_SIZE);
+	for (i = 0; i < 40; i++)
+	    enif_make_map_put(env, m, enif_make_int(env, 100+i), e[1], &m);
+	t = enif_make_tuple4(env, e[1],
+			     enif_make_map_from_arrays(env, key, value, 7),
+			     m, e[0]);
+	c = enif_make_struct_copy(env2, t);
+	ok = ok && (enif_struct_size(c) == enif_struct_size(t));
+	ok = ok && (enif_struct_size(t) < enif_flat_size(t));
+	ok = ok && enif_is_identical(c, t);
+	ok = ok && enif_get_tuple(env2, c, &arity, &tp) &&
+	    enif_get_map_value(env2, tp[2], enif_make_int(env, 139), &v) &&
+	    (v == tp[0]);
+	enif_free_env(env2);
+	ok = ok && (enif_make_struct_copy(env, key[3]) == key[3]);
+	report(ok, "struct copy");
+    }
+
+    // keysort and sorted lists, like lists:keysort/2 and friends
+    {
+	ERL_NIF_TERM e[6], k1, k2, k3, f1, l, s, x;
+	int ok = 1;
+
+	k1 = enif_make_int(env, 1);
+	k2 = enif_make_int(env, 2);
+	k3 = enif_make_int(env, 3);
+	f1 = enif_make_double(env, 1.0);
+	e[0] = enif_make_tuple2(env, k3, enif_make_atom(env, "a"));
+	e[1] = enif_make_tuple2(env, k1, enif_make_atom(env, "b"));
+	e[2] = enif_make_tuple2(env, k2, enif_make_atom(env, "c"));
+	e[3] = enif_make_tuple2(env, f1, enif_make_atom(env, "d"));
+	e[4] = enif_make_tuple2(env, k1, enif_make_atom(env, "e"));
+	e[5] = enif_make_tuple2(env, k2, enif_make_atom(env, "a"));
+	l = enif_make_list_from_array(env, e, 6);
+
+	// [{1,b},{1.0,d},{1,e},{2,c},{2,a},{3,a}]
+	ok = ok && enif_make_sorted_list(env, l, 1, &s);
+	x = enif_make_list6(env, e[1], e[3], e[4], e[2], e[5], e[0]);
+	ok = ok && enif_is_identical(s, x);
+	// [{3,a},{2,c},{1,b}] with ukeysort and reverse
+	ok = ok && enif_make_sorted_list(env, l,
+					 1|ENIF_SORT_UNIQUE|ENIF_SORT_REVERSE,
+					 &s);
+	x = enif_make_list3(env, e[0], e[2], e[1]);
+	ok = ok && enif_is_identical(s, x);
+	// [{1,b},{1.0,d},{1,e},{2,a},{2,c},{3,a}] sorted as whole terms
+	ok = ok && enif_make_sorted_list(env, l, 0, &s);
+	x = enif_make_list6(env, e[1], e[3], e[4], e[5], e[2], e[0]);
+	ok = ok && enif_is_identical(s, x);
+	// sort on the second element, [{3,a},{2,a},{1,b},{2,c},{1.0,d},{1,e}]
+	ok = ok && cnif_keysort(e, 6, 2);
+	x = enif_make_list_from_array(env, e, 6);
+	ok = ok && enif_make_sorted_list(env, l, 2, &s) &&
+	    enif_is_identical(s, x);
+	ok = ok && !cnif_keysort(e, 6, 3);
+	// no memory for the keys, the tuples stay where they are
+	{
+	    size_t budget = 0;
+	    cnif_allocator_t failing =
+		{ budget_alloc, budget_realloc, budget_free, &budget };
+	    ERL_NIF_TERM e2[6];
+
+	    memcpy(e2, e, sizeof(e2));
+	    cnif_set_allocator(&failing);
+	    ok = ok && !cnif_keysort(e2, 6, 1);
+	    cnif_set_allocator(NULL);
+	    ok = ok && (memcmp(e, e2, sizeof(e2)) == 0);
+	}
+	ok = ok && !enif_make_sorted_list(env, enif_make_list2(env, k1, e[0]),
+					  1, &s);
+	ok = ok && enif_make_sorted_list(env, enif_make_list(env, 0), 1, &s) &&
+	    (s == enif_make_list(env, 0));
+	// usort keeps the first of 1 and 1.0
+	ok = ok && enif_make_sorted_list(env,
+					 enif_make_list4(env, k2, f1, k1, f1),
+					 ENIF_SORT_UNIQUE, &s);
+	x = enif_make_list2(env, f1, k2);
+	ok = ok && enif_is_identical(s, x);
+	report(ok, "keysort");
+    }
+
+    // hand terms between envs by adopting the heap
+    {
+	ErlNifEnv* src = enif_alloc_env();
+	ErlNifEnv* dst = enif_alloc_env();
+	ERL_NIF_TERM big, x, y, c, d, mixed;
+	int ok = 1;
+
+	x = enif_make_atom(dst, "x");
+	y = enif_make_tuple2(dst, x, enif_make_int(dst, 1));
+	big = enif_make_list(src, 0);
+	for (i = 0; i < 100000; i++)
+	    big = enif_make_list_cell(src, enif_make_tuple2(src, x, big),
+				      enif_make_int(src, i));
+	c = enif_make_flat_copy(env, big);
+	ok = ok && enif_is_env_term(src, big) && !enif_is_env_term(dst, big);
+	ok = ok && (enif_env_transfer_term(dst, src, big) == big);
+	ok = ok && !enif_is_env_term(src, big) && enif_is_env_term(dst, big);
+	ok = ok && enif_is_env_term(dst, y) && enif_is_identical(big, c);
+	enif_free_env(src);   // now empty
+	ok = ok && enif_is_identical(big, c);
+
+	// a term referencing dst nodes is copied, src is kept
+	src = enif_alloc_env();
+	d = enif_make_double(src, 1.5);
+	mixed = enif_make_list2(src, y, d);
+	c = enif_env_transfer_term(dst, src, mixed);
+	ok = ok && (c != mixed) && enif_is_identical(c, mixed);
+	ok = ok && !enif_is_env_term(src, mixed) && enif_is_env_term(src, d);
+	ok = ok && enif_is_env_term(dst, c);
+	c = enif_make_tuple2(src, x, enif_make_double(src, 2.5));
+	enif_free_env(dst);
+	// adopt into an empty env and allocate after it
+	dst = enif_alloc_env();
+	ok = ok && enif_env_adopt(dst, src) && enif_is_env_term(dst, c);
+	y = enif_make_tuple2(dst, c, c);
+	ok = ok && enif_is_env_term(dst, y) && !enif_env_adopt(dst, dst);
+	enif_free_env(src);
+	enif_free_env(dst);
+	report(ok, "env adopt");
+    }
+
+    // collect a state env that is updated in place
+    {
+	ErlNifEnv* st = enif_alloc_env();
+	ErlNifEnv* other = enif_alloc_env();
+	ERL_NIF_TERM roots[4], c[4], ext, b, e[2];
+	const ERL_NIF_TERM* tp;
+	ERL_NIF_TERM* ranges[2];
+	ErlNifBinary bin;
+	size_t size;
+	int arity, ok = 1;
+
+	ext = enif_make_tuple2(other, enif_make_atom(other, "ext"),
+			       enif_make_double(other, 2.5));
+	enif_alloc_binary(100, &bin);
+	memset(bin.data, 'x', 100);
+	b = enif_make_binary(st, &bin);
+	roots[0] = enif_make_new_map(st);
+	for (i = 0; i < 10000; i++)
+	    enif_make_map_put(st, roots[0], enif_make_int(st, i % 50),
+			      enif_make_double(st, i), &roots[0]);
+	e[0] = enif_make_sub_binary(st, b, 10, 20);
+	e[1] = enif_make_int64(st, INT64_C(0x7fffffffffffffff));
+	roots[1] = enif_make_list_from_array(st, e, 2);
+	roots[1] = enif_make_tuple3(st, roots[1], roots[1], ext);
+	roots[2] = enif_make_int(st, 7);
+	roots[3] = roots[0];
+	for (i = 0; i < 4; i++)
+	    c[i] = enif_make_copy(env, roots[i]);
+	ok = ok && (cnif_heap_ranges(st, ranges, 0) > 100);
+	ok = ok && enif_env_gc(st, roots, 4);
+	// one fragment, holding the map, the tuple and the binaries
+	ok = ok && (cnif_heap_ranges(st, ranges, 1) == 1);
+	ok = ok && (ranges[1] - ranges[0] < 2*1024);
+	for (i = 0; i < 4; i++)
+	    ok = ok && enif_is_identical(roots[i], c[i]);
+	ok = ok && (roots[3] == roots[0]) && (roots[2] == c[2]);
+	ok = ok && enif_get_tuple(st, roots[1], &arity, &tp) &&
+	    (tp[0] == tp[1]) && (tp[2] == ext) && enif_is_env_term(st, tp[0]);
+	// keeps working as a heap
+	ok = ok && enif_make_map_put(st, roots[0], enif_make_int(st, 100),
+				     roots[1], &roots[0]);
+	ok = ok && enif_env_gc(st, roots, 1) &&
+	    enif_get_map_size(st, roots[0], &size) && (size == 51);
+	ok = ok && enif_env_gc(st, roots, 0) && (cnif_heap_ranges(st, ranges, 0) == 0);
+	enif_free_env(other);
+	enif_free_env(st);
+	report(ok, "env gc");
+    }
+
+    // speculative allocation with heap marks
+    {
+	ErlNifEnv* h = enif_alloc_env();
+	cnif_heap_mark_t m0, m1;
+	ERL_NIF_TERM* ranges[2];
+	ERL_NIF_TERM* p0;
+	ERL_NIF_TERM* p1;
+	enif_io_t* hio;
+	FILE* f;
+	char src[] = "{a,[1,2,3],\"abc\"} ].";
+	int ok = 1;
+
+	// rewind to empty keeps one fragment
+	cnif_heap_begin(h, &m0);
+	for (i = 0; i < 5000; i++)
+	    enif_make_tuple2(h, enif_make_int(h, i), enif_make_double(h, i));
+	ok = ok && (cnif_heap_ranges(h, ranges, 0) > 1);
+	ok = ok && cnif_heap_rewind(h, &m0);
+	ok = ok && (cnif_heap_ranges(h, ranges, 1) == 1);
+	p0 = cnif_heap_alloc(h, 1);
+	ok = ok && (p0 == ranges[1]-1);
+	// rewind across fragments to the same position
+	cnif_heap_begin(h, &m1);
+	p1 = cnif_heap_alloc(h, 2);
+	for (i = 0; i < 5000; i++)
+	    enif_make_list_cell(h, enif_make_int(h, i), enif_make_int(h, i));
+	ok = ok && cnif_heap_rewind(h, &m1);
+	ok = ok && (cnif_heap_ranges(h, ranges, 0) == 1);
+	ok = ok && (cnif_heap_alloc(h, 2) == p1);
+	cnif_heap_commit(h, &m1);
+	enif_clear_env(h);
+
+	// a form that fails to parse leaves nothing on the heap
+	f = fmemopen(src, strlen(src), "r");
+	hio = enif_stdio_alloc(h, NULL);
+	enif_io_push(hio, f, "*test*", 1, stdout, "*stdout*");
+	ok = ok && !enif_io_scan_forms(hio);
+	ok = ok && (cnif_heap_ranges(h, ranges, 1) == 1) &&
+	    (cnif_heap_alloc(h, 1) == ranges[1]-1);
+	enif_io_free(hio);
+	enif_free_env(h);
+	report(ok, "heap mark");
+    }
+
+    // heap accounting and a hard limit
+    {
+	ErlNifEnv* h = enif_alloc_env();
+	cnif_heap_stats_t s;
+	ERL_NIF_TERM t, m;
+	ERL_NIF_TERM keys[3], values[3];
+	enif_io_t* hio;
+	FILE* f;
+	char src[] = "{a,[1,2,3],\"abcdefghijklmnopqrstuvwxyz\"}.";
+	int ok = 1;
+
+	ok = ok && cnif_heap_stats(h, &s) && (s.size == 0) && (s.used == 0);
+	t = enif_make_tuple2(h, enif_make_int(h, 1), enif_make_double(h, 2.0));
+	ok = ok && cnif_heap_stats(h, &s) && (s.used == 3+2) &&
+	    (s.fragments == 1) && (s.size >= s.used) && (s.peak == s.size);
+	for (i = 0; i < 5000; i++)
+	    enif_make_list_cell(h, t, enif_make_list0(h));
+	ok = ok && cnif_heap_stats(h, &s) && (s.used == 5+2*5000) &&
+	    (s.fragments > 1) && (s.used + s.wasted <= s.size);
+
+	// builders and the parser fail once the limit is reached
+	enif_clear_env(h);
+	ok = ok && cnif_heap_stats(h, &s) && (s.size == 0) && (s.peak > 0);
+	cnif_heap_set_limit(h, 6);
+	t = enif_make_int(h, 7);
+	ok = ok && ((m = enif_make_tuple2(h, t, t)) != 0);
+	ok = ok && (enif_make_tuple3(h, t, t, t) == 0);
+	ok = ok && (enif_make_double(h, 1.0) != 0);
+	ok = ok && (enif_make_string(h, "abc", ERL_NIF_LATIN1) == 0);
+	keys[0] = enif_make_int(h, 1); values[0] = t;
+	keys[1] = enif_make_int(h, 2); values[1] = t;
+	keys[2] = enif_make_int(h, 3); values[2] = t;
+	ok = ok && (enif_make_map_from_arrays(h, keys, values, 3) == 0);
+	ok = ok && (enif_make_copy(h, m) == 0);
+	ok = ok && cnif_heap_stats(h, &s) && (s.size <= 6) &&
+	    (s.limit == 6) && (s.failures >= 4);
+
+	f = fmemopen(src, strlen(src), "r");
+	hio = enif_stdio_alloc(h, NULL);
+	enif_io_push(hio, f, "*test*", 1, stdout, "*stdout*");
+	ok = ok && !enif_io_scan_forms(hio);
+	ok = ok && (strcmp(enif_io_error(hio), "heap exhausted") == 0);
+	enif_io_free(hio);
+
+	// lifting the limit lets the form parse
+	cnif_heap_set_limit(h, 0);
+	f = fmemopen(src, strlen(src), "r");
+	hio = enif_stdio_alloc(h, NULL);
+	enif_io_push(hio, f, "*test*", 1, stdout, "*stdout*");
+	ok = ok && enif_io_scan_forms(hio);
+	enif_io_free(hio);
+	enif_free_env(h);
+	report(ok, "heap stats");
+    }
+
+    // pluggable allocators
+    {
+	size_t cnt[2] = { 0, 0 };
+	cnif_allocator_t counting = { count_alloc, count_realloc, count_free,
+				      cnt };
+	ErlNifEnv* a = enif_alloc_env();
+	ErlNifEnv* b = enif_alloc_env();
+	ERL_NIF_TERM u;
+	unsigned char* p = NULL;
+	void* q;
+	size_t sz, j, prev = 0;
+	int ok = 1;
+
+	ok = ok && (cnif_env_allocator(a) == cnif_get_allocator());
+	ok = ok && cnif_env_set_allocator(a, &counting);
+	t = enif_make_list(a, 0);
+	for (i = 0; i < 5000; i++)
+	    t = enif_make_list_cell(a, enif_make_double(a, i), t);
+	ok = ok && (cnt[0] > 1) && !cnif_env_set_allocator(a, NULL);
+	// fragments are not shared between allocators
+	ok = ok && !enif_env_adopt(b, a);
+	u = enif_env_transfer_term(b, a, t);
+	ok = ok && enif_is_env_term(b, u) && enif_is_env_term(a, t) &&
+	    (enif_compare(t, u) == 0);
+	enif_clear_env(a);
+	ok = ok && (cnt[1] == cnt[0]);
+	enif_free_env(a);
+	enif_free_env(b);
+
+	// contents survive moves between size classes
+	for (sz = 1; sz < 1000000; sz = 3*sz+1) {
+	    if ((p = enif_realloc(p, sz)) == NULL) {
+		ok = 0;
+		break;
+	    }
+	    for (j = 0; j < prev; j++)
+		ok = ok && (p[j] == (unsigned char) j);
+	    for (j = 0; j < sz; j++)
+		p[j] = (unsigned char) j;
+	    prev = sz;
+	}
+	p = enif_realloc(p, 100);
+	for (j = 0; j < 100; j++)
+	    ok = ok && (p[j] == (unsigned char) j);
+	enif_free(p);
+	// a freed block is handed out again
+	q = enif_alloc(100);
+	enif_free(q);
+	ok = ok && (enif_alloc(100) == q);
+	enif_free(q);
+	cnif_cache_flush();
+	report(ok, "allocator");
+    }
+
+    // allocation failures are reported, not crashed on
+    {
+	ErlNifEnv* a = enif_alloc_env();
+	ErlNifEnv* b = enif_alloc_env();
+	size_t budget = 0;
+	cnif_allocator_t failing =
+	    { budget_alloc, budget_realloc, budget_free, &budget };
+	ERL_NIF_TERM key[100], value[100];
+	ErlNifMapIterator iter;
+	ERL_NIF_TERM m1, m2, u;
+	int i;
+	int ok = 1;
+
+	for (i = 0; i < 100; i++) {
+	    key[i] = enif_make_int(a, i);
+	    value[i] = enif_make_int(a, 2*i);
+	}
+	m1 = enif_make_map_from_arrays(a, key, value, 100);
+	m2 = enif_make_map_from_arrays(a, key, value, 100);
+	cnif_set_allocator(&failing);
+	ok = ok && !enif_make_map_from_arrays(a, key, value, 100);
+	ok = ok && !enif_make_map_from_arrays(a, key, value, 10);
+	ok = ok && !enif_map_iterator_create(a, m1, &iter,
+					     ERL_NIF_MAP_ITERATOR_FIRST);
+	ok = ok && (enif_compare(m1, m2) == -enif_compare(m2, m1));
+	// gc fails and keeps the heap, a transfer falls back to a copy
+	ok = ok && !enif_env_gc(a, &m1, 1);
+	// then the fresh env and then the copy block fail
+	for (i = 1; i < 3; i++) {
+	    budget = i;
+	    ok = ok && !enif_env_gc(a, &m1, 1);
+	}
+	u = enif_env_transfer_term(b, a, m2);
+	cnif_set_allocator(NULL);
+	ok = ok && (enif_compare(m1, m2) == 0);
+	ok = ok && enif_is_env_term(b, u) && enif_is_env_term(a, m2) &&
+	    (enif_compare(u, m2) == 0);
+	ok = ok && enif_env_gc(b, NULL, 0);
+	enif_free_env(a);
+	enif_free_env(b);
+	report(ok, "alloc failure");
+    }
+
+    // large fragments in mmap'ed memory
+    {
+	ErlNifEnv* h = enif_alloc_env();
+	ErlNifEnv* c = enif_alloc_env();
+	cnif_heap_stats_t s;
+	ERL_NIF_TERM u;
+	int ok = 1;
+
+	ok = ok && cnif_env_set_allocator(h, &cnif_hugepage_allocator) &&
+	    cnif_env_set_fragment_size(h, (1 << 18) - 8);
+	t = enif_make_list(h, 0);
+	for (i = 0; i < 100000; i++)
+	    t = enif_make_list_cell(h, enif_make_tuple2(h, enif_make_int(h, i),
+							enif_make_double(h, i)),
+				    t);
+	ok = ok && cnif_heap_stats(h, &s) && (s.fragments == 3) &&
+	    (s.used == 7*100000);
+	ok = ok && cnif_env_set_allocator(c, &cnif_mmap_allocator) &&
+	    cnif_env_set_fragment_size(c, 1 << 20);
+	u = enif_make_copy(c, t);
+	ok = ok && (enif_compare(t, u) == 0);
+	ok = ok && cnif_heap_stats(c, &s) && (s.fragments == 1);
+	enif_free_env(h);
+	ok = ok && enif_is_env_term(c, u);
+	enif_free_env(c);
+	report(ok, "mmap heap");
+    }
+
+    // forms and push back across refills of the input window
+    {
+	ErlNifEnv* h = enif_alloc_env();
+	FILE* f = tmpfile();
+	enif_io_t* hio;
+	long sum = 0;
+	int lines = 1;
+	size_t j;
+	int ok = 1;
+
+	// "7." ends the first window, its push back spans the refill
+	for (j = 0; j < ENIF_IO_BUF_SIZE-2; j++)
+	    fputc(' ', f);
+	fputs("7.\n", f);
+	lines++;
+	// the float is split after the '.'
+	for (j = 0; j < ENIF_IO_BUF_SIZE-4; j++) {
+	    fputc((j % 64) ? ' ' : '\n', f);
+	    lines += ((j % 64) == 0);
+	}
+	fputs("12.5.\n8.", f);
+	lines++;
+	rewind(f);
+	hio = enif_stdio_alloc(h, &sum);
+	enif_io_set_callback(hio, sum_callback);
+	enif_io_push(hio, f, "*test*", 1, stdout, "*stdout*");
+	ok = ok && enif_io_scan_forms(hio) && (sum == 7+8) &&
+	    (enif_io_line(hio) == lines);
+	enif_io_free(hio);
+	// input already buffered by stdio is parsed
+	{
+	    char line[64];
+	    f = tmpfile();
+	    fputs("header\n1. 2.\n3.\n", f);
+	    rewind(f);
+	    ok = ok && (fgets(line, sizeof(line), f) != NULL);
+	    sum = 0;
+	    hio = enif_stdio_alloc(h, &sum);
+	    enif_io_set_callback(hio, sum_callback);
+	    enif_io_push(hio, f, "*test*", 2, stdout, "*stdout*");
+	    ok = ok && enif_io_scan_forms(hio) && (sum == 1+2+3);
+	    enif_io_free(hio);
+	}
+	// a term on a pipe is parsed while the writer keeps it open
+	{
+	    int fds[2];
+	    ok = ok && (pipe(fds) == 0) && (write(fds[1], "5.\n", 3) == 3) &&
+		((f = fdopen(fds[0], "r")) != NULL);
+	    if (ok) {
+		sum = 0;
+		hio = enif_stdio_alloc(h, &sum);
+		enif_io_set_callback(hio, first_callback);
+		enif_io_push(hio, f, "*pipe*", 1, stdout, "*stdout*");
+		alarm(10);  // a read waiting for more input never returns
+		enif_io_scan_forms(hio);
+		alarm(0);
+		ok = (sum == 5);
+		enif_io_free(hio);
+		close(fds[1]);
+	    }
+	}
+	enif_free_env(h);
+	report(ok, "io window");
+    }
+
+    // forms scanned in place from memory and from a mapped file
+    {
+	ErlNifEnv* h = enif_alloc_env();
+	ErlNifEnv* c = enif_alloc_env();
+	char* forms = "1. 2.\n foo. <<\"x\">>. 4.";
+	char path[] = "/tmp/cnif_test_XXXXXX";
+	ErlNifBinary bin;
+	keep_t keep;
+	long sum = 0;
+	const ERL_NIF_TERM* elems;
+	ERL_NIF_TERM u;
+	int arity;
+	int fd;
+	int ok = 1;
+
+	ok = ok && enif_io_parse_buffer(h, forms, strlen(forms),
+					sum_callback, &sum) && (sum == 7);
+	ok = ok && enif_io_parse_buffer(h, "", 0, sum_callback, &sum);
+	ok = ok && !enif_io_parse_buffer(h, "1. {2", 5, sum_callback, &sum);
+
+	forms = "<<\"hello\">>.\n<<\"a\\nb\">>.\n<<1,2>>.\n{x, << \"world\" >>}.";
+	fd = mkstemp(path);
+	ok = ok && (fd >= 0) && (write(fd, forms, strlen(forms)) > 0);
+	close(fd);
+	keep.n = 0;
+	ok = ok && enif_io_parse_file_mmap(h, path, keep_callback, &keep) &&
+	    (keep.n == 4);
+	ok = ok && enif_inspect_binary(h, keep.t[0], &bin) &&
+	    (bin.size == 5) && (memcmp(bin.data, "hello", 5) == 0);
+	ok = ok && enif_inspect_binary(h, keep.t[1], &bin) &&
+	    (bin.size == 3) && (memcmp(bin.data, "a\nb", 3) == 0);
+	ok = ok && enif_inspect_binary(h, keep.t[2], &bin) &&
+	    (bin.size == 2) && (bin.data[1] == 2);
+	// the copy keeps the mapping after the parse env is gone
+	u = enif_make_copy(c, keep.t[3]);
+	enif_free_env(h);
+	ok = ok && is_mapped(path);
+	ok = ok && enif_get_tuple(c, u, &arity, &elems) && (arity == 2) &&
+	    enif_inspect_binary(c, elems[1], &bin) &&
+	    (bin.size == 5) && (memcmp(bin.data, "world", 5) == 0);
+	// and releases it when cleared
+	enif_clear_env(c);
+	ok = ok && !is_mapped(path);
+	ok = ok && !enif_io_parse_file_mmap(c, "/nonexistent/cnif", 
+					    keep_callback, &keep);
+	unlink(path);
+	enif_free_env(c);
+	report(ok, "parse buffer");
+    }
+
     // Test stream a erlang consult file
     if (argc > 1) {
 	enif_io_set_callback(iop, term_callback);
@@ -199,6 +1565,7 @@ int main(int argc, char** argv)
 	if (!enif_io_scan_forms(iop)) {
 	    fprintf(stderr, "%s:%d: error %s\n", 
 		    argv[1], enif_io_line(iop), enif_io_error(iop));
+	    failures++;
 	}
     }
 
@@ -208,5 +1575,5 @@ int main(int argc, char** argv)
 
     enif_free_env(env);
 
-    exit(0);
+    exit(failures ? 1 : 0);
 }